@@ -0,0 +1,51 @@
+#pragma once
+
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+
+// Blocking FIFO queue with a maximum size, used to hand work between pipeline stages.
+// push() blocks while the queue is full and pop() blocks while it is empty. After
+// close(), push() fails and pop() drains the remaining items before failing.
+template <typename T>
+class BoundedQueue {
+public:
+	BoundedQueue(size_t capacity) : _capacity(capacity), _closed(false) {}
+
+	bool push(const T& item){
+		std::unique_lock<std::mutex> lock(_mutex);
+		_not_full.wait(lock, [this]{ return _closed || _items.size() < _capacity; });
+		if (_closed)
+			return false;
+		_items.push_back(item);
+		_not_empty.notify_one();
+		return true;
+	}
+
+	bool pop(T& item){
+		std::unique_lock<std::mutex> lock(_mutex);
+		_not_empty.wait(lock, [this]{ return _closed || !_items.empty(); });
+		if (_items.empty())
+			return false;
+		item = _items.front();
+		_items.pop_front();
+		_not_full.notify_one();
+		return true;
+	}
+
+	void close(){
+		std::lock_guard<std::mutex> lock(_mutex);
+		_closed = true;
+		_not_full.notify_all();
+		_not_empty.notify_all();
+	}
+
+private:
+	size_t _capacity;
+	bool _closed;
+	std::deque<T> _items;
+	std::mutex _mutex;
+	std::condition_variable _not_full;
+	std::condition_variable _not_empty;
+};
+
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <string>
+#include <cstdint>
+
+#include "RACE.h"
+
+// Progress of a sampling run, saved together with the sketch so that an interrupted
+// run can continue where it stopped
+struct Checkpoint {
+	std::string parameters; // the run's sampling parameters; it can only be resumed with the same ones
+	uint64_t reads;         // reads (or pairs) processed
+	uint64_t kept;          // reads (or pairs) kept
+	uint64_t input1;        // input offsets after the last processed read
+	uint64_t input2;
+	uint64_t output1;       // sizes of the outputs that hold the sample of those reads
+	uint64_t output2;
+	uint64_t scores;        // size of the --scores file (optional, 0 if there is none)
+
+	Checkpoint() : reads(0), kept(0), input1(0), input2(0), output1(0), output2(0), scores(0) {}
+};
+
+/*
+Checkpoint files start with a text header of key-value lines, padded to kCheckpointHeader
+bytes, followed by the sketch in the version 2 sketch format (so the header can be
+inspected with head). SaveCheckpoint writes to a temporary file that replaces path only
+once it is complete and on disk, so path always holds a consistent checkpoint, even if
+the run is killed while saving.
+*/
+static const size_t kCheckpointHeader = 4096;
+
+bool SaveCheckpoint(const std::string& path, const Checkpoint& checkpoint, Sketch& sketch);
+// Returns the sketch of the checkpoint (NULL on error)
+Sketch* LoadCheckpoint(const std::string& path, Checkpoint& checkpoint);
+
+// Saves only the sketch, with the same temporary-file protection
+bool SaveSketch(const std::string& path, Sketch& sketch);
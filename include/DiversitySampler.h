@@ -0,0 +1,97 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+#include "SequenceReader.h"
+#include "SequenceMinHash.h"
+#include "Pipeline.h"
+#include "RACE.h"
+
+// Sampling parameters, with the defaults of samplerace
+struct SamplerOptions {
+	double tau;           // keep reads whose KDE is below tau
+	int range;            // hash range of each ACE (B)
+	int reps;             // number of ACE repetitions (R)
+	int hashes;           // MinHashes per ACE (n)
+	int k;                // k-mer size
+	MinHashEngine engine;
+	int counter_bits;     // 8, 16 or 32; 0 chooses the narrowest that holds reps*tau
+	bool blocked;         // cache-line-blocked sketch layout
+	int threads;          // threads that hash a long sequence (in pieces)
+	size_t split_length;  // sequences of at least this many bases are split between the threads
+	size_t duplicate_cache; // bytes of the DuplicateCache for exact repeats (0 = no cache)
+
+	SamplerOptions() : tau(1.0), range(10000), reps(10), hashes(1), k(16),
+		engine(MINHASH_ROLLING), counter_bits(0), blocked(false), threads(1), split_length(20000),
+		duplicate_cache(0) {}
+};
+
+/*
+RACE diversity sampling of a stream of sequences, for programs that want to sample
+reads without going through files: each offered sequence is hashed, its KDE is looked
+up in the sketch and the sequence is added to the sketch. The sequence should be kept
+if its KDE is below tau. Offering the reads of a file one by one gives the same keep
+decisions as samplerace with the same options.
+
+With options.threads > 1, long sequences are hashed by several threads (the calling
+thread and options.threads - 1 helpers). The results do not change.
+
+A DiversitySampler is not thread-safe. Use one per thread (each with its own sketch),
+or hash on several threads and update one sketch in order as samplerace does.
+*/
+class DiversitySampler {
+public:
+	~DiversitySampler();
+
+	// Returns true if the sequence should be kept. score, if given, is set to its KDE
+	// (on a scale from 0 to the number of sequences offered so far).
+	bool offer(const char* sequence, size_t length, double* score = NULL);
+	bool offer(const std::string& sequence, double* score = NULL);
+	// Offers n sequences in order, which is faster than one at a time since the sketch
+	// counters of later sequences are prefetched. keep[i] (and scores[i], if given) are
+	// set as by the i-th of n calls to offer. Returns the number of kept sequences.
+	size_t offer(const SequenceView* sequences, size_t n, bool* keep, double* scores = NULL);
+	size_t offer(const std::vector<std::string>& sequences, std::vector<bool>& keep, std::vector<double>* scores = NULL);
+
+	// KDE of a sequence, without adding it to the sketch
+	double score(const char* sequence, size_t length);
+	double score(const std::string& sequence);
+
+	// Continues from a sketch saved by save (or samplerace --save-sketch), which must use
+	// the same reps, range, hashes, k and engine, and counters at least as wide as the
+	// sampler needs (CounterBitsFor). Returns false on error.
+	bool load(const std::string& path);
+	bool save(const std::string& path);
+
+	const SamplerOptions& options() const { return _options; }
+	Sketch& sketch() { return *_sketch; }
+	uint64_t offered() const { return _offered; }
+	uint64_t kept() const { return _kept; }
+	// offered sequences whose hashes came from the duplicate cache
+	uint64_t duplicates() const { return _duplicates; }
+
+private:
+	friend DiversitySampler* MakeDiversitySampler(const SamplerOptions& options);
+	DiversitySampler(const SamplerOptions& options, Sketch* sketch);
+
+	SamplerOptions _options;
+	BatchHasher _hasher;
+	Sketch* _sketch;
+	TaskPool* _pool; // threads - 1 helpers, or NULL
+	DuplicateCache* _cache; // or NULL
+	std::vector<int> _rehashes;
+	std::vector<double> _scores;
+	uint64_t _offered;
+	uint64_t _kept;
+	uint64_t _duplicates;
+
+	DiversitySampler(const DiversitySampler&);
+	DiversitySampler& operator=(const DiversitySampler&);
+};
+
+// Creates a sampler with an empty sketch. Returns NULL (with an error message) if the
+// options are invalid.
+DiversitySampler* MakeDiversitySampler(const SamplerOptions& options);
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <vector>
+#include <mutex>
+#include <cstdint>
+#include <cstddef>
+
+#include "SequenceReader.h"
+
+/*
+Bounded cache of the rehashed values of recently seen sequences, so that exact
+duplicates (PCR and optical duplicates) skip the MinHash and rehash steps. Sequences
+are identified by a 64-bit fingerprint (MurmurHash64A) and their length, so a false
+match is vanishingly unlikely (about one in 2^64 per lookup and entry of a set).
+
+The cache is 4-way set associative: a fingerprint selects one set of 4 entries, and a
+full set replaces its least recently used entry. It may be shared by several threads;
+each set is guarded by one of a fixed number of locks.
+
+Only the rehashes are cached. The KDE of a duplicate still has to be queried (and
+added) in the sketch, since it grows with every read.
+*/
+class DuplicateCache {
+public:
+	// A cache of at most bytes bytes (at least one set) for sequences with reps rehashes
+	DuplicateCache(size_t bytes, int reps);
+
+	// If the sequence is cached, copies its rehashes to rehashes[0 .. reps) and returns true
+	bool find(const SequenceView& sequence, int* rehashes);
+	// Caches the rehashes of a sequence that find() did not return
+	void insert(const SequenceView& sequence, const int* rehashes);
+
+	size_t entries() const { return _sets.size() * kWays; }
+	static size_t bytesPerEntry(int reps) { return sizeof(uint64_t) + 2*sizeof(uint32_t) + reps*sizeof(int); }
+
+private:
+	static const size_t kWays = 4;
+	static const size_t kLocks = 256;
+
+	// Entries of a set, most recently used first. Entry i of the set keeps its rehashes
+	// in slot[i] of the set's row of _values, so reordering only moves the keys.
+	struct Set {
+		uint64_t fingerprint[kWays];
+		uint32_t length[kWays];  // 0 for an empty entry
+		uint32_t slot[kWays];
+	};
+
+	static uint64_t Fingerprint(const SequenceView& sequence);
+	int* values(size_t set, uint32_t slot) { return _values.data() + (set*kWays + slot)*_reps; }
+
+	int _reps;
+	std::vector<Set> _sets;
+	std::vector<int> _values;
+	std::mutex _locks[kLocks];
+
+	DuplicateCache(const DuplicateCache&);
+	DuplicateCache& operator=(const DuplicateCache&);
+};
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <vector>
+#include <map>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include <zlib.h>
+
+#include "SequenceReader.h"
+#include "BoundedQueue.h"
+
+// True if the data starts with a gzip header
+bool IsGzip(const char* data, size_t length);
+// True if the data starts with a BGZF block header (a gzip member with a "BC" extra field)
+bool IsBGZF(const char* data, size_t length);
+
+// Streaming gzip decompression of another source. Concatenated gzip members (as
+// written by e.g. pigz or cat a.gz b.gz) are decompressed one after another.
+class GzipSource : public ByteSource {
+public:
+	GzipSource(ByteSource* input); // takes ownership of input
+	~GzipSource();
+	long read(char* buffer, size_t capacity);
+private:
+	ByteSource* _input;
+	z_stream _stream;
+	std::vector<unsigned char> _in;
+	bool _input_done;
+	bool _stream_done;
+};
+
+// Block-parallel decompression of BGZF (blocked gzip, as written by bgzip and samtools).
+// A dispatcher thread splits the input into independent BGZF blocks and hands groups
+// of blocks to a pool of inflate threads. read() returns the groups in input order.
+class BGZFSource : public ByteSource {
+public:
+	BGZFSource(ByteSource* input, int threads); // takes ownership of input
+	~BGZFSource();
+	long read(char* buffer, size_t capacity);
+
+private:
+	struct Job {
+		size_t id;
+		std::vector<unsigned char> compressed; // whole BGZF blocks
+		std::vector<char> data;                // decompressed
+		bool ok;
+	};
+
+	void dispatch();
+	void inflateJobs();
+	bool readFully(unsigned char* buffer, size_t length, size_t& got);
+
+	ByteSource* _input;
+	BoundedQueue<Job*> _work;
+	size_t _max_jobs; // groups dispatched but not yet consumed
+	std::vector<std::thread> _threads;
+
+	std::mutex _mutex;
+	std::condition_variable _cv;
+	std::map<size_t, Job*> _done;
+	size_t _total;
+	bool _dispatching;
+	bool _failed;
+	bool _stopping;
+
+	Job* _current;
+	size_t _current_offset;
+	size_t _next_id;
+};
+
@@ -1,2 +1,4 @@
-unsigned int MurmurHash ( const void * key, int len, unsigned int seed ); 
+#include <cstdint>
 
+unsigned int MurmurHash ( const void * key, int len, unsigned int seed ); 
+uint64_t MurmurHash64 ( const void * key, int len, uint64_t seed ); 
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <functional>
+
+#include "SequenceReader.h"
+#include "SequenceMinHash.h"
+#include "SamplingStats.h"
+#include "DuplicateCache.h"
+
+// A batch of consecutive reads travelling through the pipeline, together with the
+// per-read results of the hashing stage
+struct ReadBatch {
+	size_t id;                            // position of the batch in the input
+	size_t size;                          // number of reads
+	std::vector<SequenceRecord> records1; // reads (or interleaved pairs) of the first input
+	std::vector<SequenceRecord> records2; // mates from the second input (paired-end only)
+	std::vector<int> rehashes;            // R rehashed values per read (racesweep: for each sketch in turn)
+	std::vector<double> kde;              // sketch query of each read (racesweep: for each sketch in turn)
+	size_t duplicates;                    // reads whose rehashes came from the DuplicateCache
+
+	ReadBatch() : id(0), size(0), duplicates(0), _block(0), _used(0) {}
+	void clear();
+	// Copies a record into memory owned by the batch and returns a record with views
+	// into the copy. Needed for readers whose views do not outlive the next read.
+	SequenceRecord copy(const SequenceRecord& record);
+
+private:
+	// arena of fixed blocks that are reused from batch to batch, so copies never move
+	std::vector<std::vector<char> > _blocks;
+	size_t _block, _used;
+};
+
+// Fills ReadBatch::rehashes. Each pipeline worker needs its own BatchHasher, since
+// SequenceMinHash keeps scratch space.
+class BatchHasher {
+public:
+	BatchHasher(int reps, int hashes, int k, MinHashEngine engine);
+	// With times, the MinHash and rehash time of the batch is added to it (the batch is
+	// then hashed in two passes, so that the clock is only read three times)
+	void hash(ReadBatch& batch, StageTimes* times = NULL);
+	// rehashed values of one sequence, written to rehashes[0 .. reps). Returns true if
+	// they came from the duplicate cache.
+	bool hash(const SequenceView& sequence, int* rehashes);
+	// Nonzero value that identifies the hash functions (reps, hashes, k and engine), for
+	// Sketch::set_hash_tag. Hashers with the same tag give the same rehashes.
+	uint64_t tag() const;
+	// Hashes reads of at least split_length bases in parallel pieces (see SequenceMinHash::setPool)
+	void setPool(TaskPool* pool, size_t split_length) { _minhash.setPool(pool, split_length); }
+	// Looks up every sequence in cache (which may be shared by several hashers) before
+	// hashing it, and caches the rehashes of the ones that were not found
+	void setDuplicateCache(DuplicateCache* cache) { _cache = cache; }
+private:
+	int _reps, _hashes, _k;
+	MinHashEngine _engine;
+	SequenceMinHash _minhash;
+	DuplicateCache* _cache;
+	std::vector<int> _raw_hashes;
+	std::vector<int> _batch_hashes; // MinHashes of a whole batch (timed hashing only)
+	std::vector<char> _cached;      // reads of the batch found in the cache (timed hashing only)
+};
+
+/*
+Runs the sampling loop as three stages:
+1. read:   fills a batch with the next reads. Returns false at the end of the input
+           (a partially filled batch is still processed).
+2. work:   processes a batch. With more than one thread, batches are processed
+           concurrently by a pool of workers; worker is the index of the calling worker.
+3. commit: called once per batch, on one thread, strictly in input order. Returns
+           false to stop the pipeline.
+With threads = 1, the three stages run one after another on the calling thread.
+*/
+class Pipeline {
+public:
+	typedef std::function<bool(ReadBatch&)> ReadStage;
+	typedef std::function<void(ReadBatch&, int)> WorkStage;
+	typedef std::function<bool(ReadBatch&)> CommitStage;
+
+	Pipeline(int threads, size_t batch_size);
+	size_t batch_size() const { return _batch_size; }
+	// Returns false if a commit failed
+	bool run(ReadStage read, WorkStage work, CommitStage commit);
+
+private:
+	bool runSerial(ReadStage& read, WorkStage& work, CommitStage& commit);
+	int _threads;
+	size_t _batch_size;
+};
+
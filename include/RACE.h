@@ -3,35 +3,412 @@
 #include <iostream>
 #include <iomanip>
 #include <cstdint>
+#include <atomic>
+#include <vector>
+#include <string>
+#include <pthread.h>
+
+#include "SketchAllocator.h"
 
 
 typedef unsigned int race_sketch_t;
 
-class RACE 
+
+// Interface shared by every RACE instantiation, for code that picks the sketch type 
+// at runtime (e.g. from the command line). One virtual call per read is negligible 
+// next to hashing the read. 
+class Sketch 
+{
+public:
+    Sketch() : _hash_tag(0) {}
+    virtual ~Sketch() {}
+
+    virtual void add(const int *hashes) = 0; 
+    virtual double query_and_add(const int *hashes) = 0; 
+    // query_and_add for n reads, whose hashes are stored one read after another 
+    // (R hashes per read). results[i] is the same as the i-th of n calls in order. 
+    virtual void query_and_add(const int *hashes, size_t n, double *results) = 0; 
+    virtual void subtract(const int *hashes) = 0; 
+    virtual void clear() = 0; 
+    // Adds the counters of other, which must be a sketch of the same type and shape. 
+    // Returns false (and leaves this sketch alone) otherwise. 
+    virtual bool merge(const Sketch& other) = 0; 
+    // Subtracts the counters of other (e.g. sketch of reads that should no longer be 
+    // counted), with the same requirements as merge. Saturated counters are left alone. 
+    virtual bool unmerge(const Sketch& other) = 0; 
+    // New sketch of the same type and shape with zero counters (e.g. a delta to merge) 
+    virtual Sketch* make_empty() const = 0; 
+
+    virtual double query(const int *hashes) = 0; 
+
+    // Writes the sketch in the version 2 file format (see SketchFileHeader). 
+    virtual void serialize(std::ostream &out) = 0; 
+    // Reads a sketch written by serialize (or a version 1 file). Returns false, with an 
+    // error message, if the file is not a sketch of this layout or is corrupt. 
+    virtual bool deserialize(std::istream &in) = 0; 
+    // Uses the counters of a version 2 file written on a machine with the same byte 
+    // order and counter width in place: the file is memory-mapped (copy-on-write, so 
+    // updates stay private to the process) and pages are only read when they are used. 
+    // Unlike deserialize, the checksum is not verified, since that would read every page. 
+    virtual bool map(const std::string& path) = 0; 
+
+    virtual void pprint(std::ostream& out, int width = 3, bool format = true) = 0; 
+
+    // memory used by the counters, in bytes
+    virtual size_t bytes() const = 0; 
+    virtual size_t reps() const = 0; 
+    virtual size_t range() const = 0; 
+    // width of the counters: 8, 16 or 32. Counters saturate at 2^bits - 1, so a sketch 
+    // loaded from a file must be at least as wide as the run needs (CounterBitsFor). 
+    virtual int counter_bits() const = 0; 
+
+    // Identifies the hash functions that the hashes come from (see BatchHasher::tag), 
+    // so that a saved sketch is not updated with different ones. It is stored in sketch 
+    // files; 0 means unknown (e.g. version 1 files). 
+    uint64_t hash_tag() const { return _hash_tag; }
+    void set_hash_tag(uint64_t tag) { _hash_tag = tag; }
+
+protected: 
+    uint64_t _hash_tag; 
+};
+
+
+/*
+Header of version 2 sketch files. It is followed by the counters exactly as they are 
+in memory (native byte order and width), so a sketch loads with a single read, or can 
+be memory-mapped and used in place. The header is 64 bytes long, which keeps the 
+counters of a mapped file aligned to cache lines. 
+
+Version 1 files (magic 0x4D, version 1: R and range, then R*range big-endian uint32 
+counters) and the first blocked format (magic 0x42) can still be read. 
+*/
+struct SketchFileHeader {
+    uint8_t magic;          // 0x4D
+    uint8_t version;        // 2
+    uint8_t byte_order;     // SKETCH_LITTLE_ENDIAN or SKETCH_BIG_ENDIAN, for every field below
+    uint8_t counter_bytes;  // 1, 2 or 4
+    uint8_t layout;         // SKETCH_LAYOUT_ROWS (RACE) or SKETCH_LAYOUT_BLOCKED (BlockedRACE)
+    uint8_t reserved[3]; 
+    uint64_t R; 
+    uint64_t range; 
+    uint64_t counters;      // number of counters after the header
+    uint32_t checksum;      // CRC-32 of the counter bytes
+    uint32_t reserved2; 
+    uint64_t hash_tag;      // Sketch::hash_tag
+    uint8_t padding[16]; 
+}; 
+static_assert(sizeof(SketchFileHeader) == 64, "sketch file header must be 64 bytes"); 
+
+enum { SKETCH_LITTLE_ENDIAN = 1, SKETCH_BIG_ENDIAN = 2 }; 
+enum { SKETCH_LAYOUT_ROWS = 0, SKETCH_LAYOUT_BLOCKED = 1 }; 
+
+/*
+hash % range, as computed by the original code: negative hashes are sign-extended to 
+64 bits before the remainder. reciprocal = 2^64 / range + 1 gives the remainder of the 
+low 32 bits with a multiply (no division), and a sign-extended negative hash adds 
+negative_offset = (2^64 - 2^32) % range. There is no branch on the sign, since hash 
+signs are random and the branch would be mispredicted half of the time. 
+*/
+static inline size_t SignedRemainder(int hash, uint64_t reciprocal, size_t range, size_t negative_offset){
+    size_t remainder = (size_t)(((unsigned __int128)(reciprocal * (uint32_t)hash) * range) >> 64); 
+    remainder += negative_offset & (0 - (size_t)((uint32_t)hash >> 31)); 
+    remainder -= range & (0 - (size_t)(remainder >= range)); 
+    return remainder; 
+}
+
+/*
+RACE sketch with R rows of range counters. 
+
+Counter: uint8_t, uint16_t or uint32_t. 8- and 16-bit counters saturate at their 
+maximum instead of wrapping. Keep decisions (query < tau) are unaffected by saturation 
+as long as the maximum is at least R*tau: a saturated counter alone then pushes the 
+mean over tau, just like the exact count would. 
+
+PowerOfTwoRange: the row index is hash & (range - 1) instead of hash % range. For other 
+ranges, the remainder is computed by multiply-shift with a precomputed reciprocal 
+(Lemire et al., "Faster Remainder by Direct Computation"), which gives exactly 
+hash % range without a division. 
+
+Every instantiation that a program may use is compiled in RACE.cpp. 
+*/
+template <typename Counter = race_sketch_t, bool PowerOfTwoRange = false>
+class RACE : public Sketch 
 {
 public:
     RACE(size_t R, size_t range); 
     ~RACE(); 
 
-    void add(int *hashes); 
-    double query_and_add(int *hashes); 
-    void subtract(int *hashes); 
+    void add(const int *hashes); 
+    double query_and_add(const int *hashes); 
+    void query_and_add(const int *hashes, size_t n, double *results); 
+    void subtract(const int *hashes); 
     void clear(); 
+    bool merge(const Sketch& other); 
+    bool unmerge(const Sketch& other); 
+    Sketch* make_empty() const { return new RACE(_R, _range); }
 
-    double query(int *hashes); 
+    double query(const int *hashes); 
 
     void serialize(std::ostream &out); 
-    void deserialize(std::istream &in); 
+    bool deserialize(std::istream &in); 
+    bool map(const std::string& path); 
 
     void pprint(std::ostream& out, int width = 3, bool format = true); 
+
+    size_t bytes() const { return _R*_range*sizeof(Counter); }
+    size_t reps() const { return _R; }
+    size_t range() const { return _range; }
+    int counter_bits() const { return 8*sizeof(Counter); }
     
     private:
         size_t _R, _range;
-        race_sketch_t* _sketch;
+        Counter* _sketch;
+        void* _map;       // file mapping that holds _sketch, if mapped
+        size_t _map_size; 
+        SketchAllocator* _allocator; // allocator of _sketch, if not mapped
+        size_t _allocated; // bytes allocated for _sketch
+        const uint8_t magic_number = 0x4D; // magic number for binary file IO
+        const uint8_t file_version_number = 0x02; // file version number 
+
+        // parameters of the row index computation
+        size_t _mask; 
+        uint64_t _reciprocal; 
+        size_t _negative_offset; 
+        void setRange(size_t range); 
+        // resizes to R x range, reusing the counters if the size does not change 
+        void reshape(size_t R, size_t range); 
+        void release(); 
+        bool loadVersion1(std::istream &in); 
+
+        inline size_t index(int hash) const {
+            if (PowerOfTwoRange)
+                return (uint32_t)hash & _mask; 
+            return SignedRemainder(hash, _reciprocal, _range, _negative_offset); 
+        }
+        // requests the counters of one read from memory 
+        inline void prefetch(const int *hashes) const {
+            for (size_t r = 0; r < _R; r++)
+                __builtin_prefetch(_sketch + r*_range + index(hashes[r]), 1); 
+        }
+
+        RACE(const RACE&); 
+        RACE& operator=(const RACE&); 
+};
+
+/*
+Cache-line-blocked RACE sketch (like a blocked Bloom filter). The R rows are split into 
+groups of rows that share 64-byte blocks: the hash of the first row in a group picks 
+one block, and every row of the group has a few counters inside that block. A query 
+touches one cache line per group (e.g. a single line for R = 10 with 8-bit counters) 
+instead of one per row. The number of blocks is chosen so the sketch has as many 
+counters (bytes) as a RACE with the same R and range. 
+
+Two reads share a counter only if they agree on the group's block as well as the row's 
+slot, and the rows of a group share the block, so they are not independent: this is a 
+different (sharper) estimator than RACE, and tau has to be retuned for it. Reads collide 
+less often and more reads are kept for the same tau; the two agree closely only at tiny 
+ranges (most reads collide anyway), and layoutbench measures both. 
+*/
+template <typename Counter = race_sketch_t>
+class BlockedRACE : public Sketch 
+{
+public:
+    BlockedRACE(size_t R, size_t range); 
+    ~BlockedRACE(); 
+
+    void add(const int *hashes); 
+    double query_and_add(const int *hashes); 
+    void query_and_add(const int *hashes, size_t n, double *results); 
+    void subtract(const int *hashes); 
+    void clear(); 
+    bool merge(const Sketch& other); 
+    bool unmerge(const Sketch& other); 
+    Sketch* make_empty() const { return new BlockedRACE(_R, _range); }
+
+    double query(const int *hashes); 
+
+    // The counters are stored block by block. deserialize also reads the first blocked 
+    // format: (Big Endian) magic 0x42 (uint8_t); version 1 (uint8_t); counter width in 
+    // bytes (uint8_t); R (uint64_t); range (uint64_t); every counter as a uint32_t 
+    void serialize(std::ostream &out); 
+    bool deserialize(std::istream &in); 
+    bool map(const std::string& path); 
+
+    void pprint(std::ostream& out, int width = 3, bool format = true); 
+
+    size_t bytes() const { return _groups*_blocks*kLineBytes; }
+    size_t reps() const { return _R; }
+    size_t range() const { return _range; }
+    int counter_bits() const { return 8*sizeof(Counter); }
+
+    private:
+        static const size_t kLineBytes = 64; 
+        static const size_t kCountersPerLine = kLineBytes / sizeof(Counter); 
+
+        size_t _R, _range;
+        size_t _group_rows; // rows per group (G)
+        size_t _slots;      // counters of each row in a block (S)
+        size_t _groups;     // ceil(R / G)
+        size_t _blocks;     // blocks per group
+        Counter* _sketch;   // _groups x _blocks blocks of kCountersPerLine counters
+        void* _map;         // file mapping that holds _sketch, if mapped
+        size_t _map_size; 
+        SketchAllocator* _allocator; // allocator of _sketch, if not mapped
+        size_t _allocated;  // bytes allocated for _sketch
+        uint64_t _reciprocal; 
+        size_t _negative_offset; 
         const uint8_t magic_number = 0x4D; // magic number for binary file IO
-        const uint8_t file_version_number = 0x01; // file version number 
+        const uint8_t file_version_number = 0x02; // file version number 
+        const uint8_t blocked_v1_magic_number = 0x42; // first blocked format
+
+        void setShape(size_t R, size_t range); 
+        void allocate(); 
+        void release(); 
+        bool loadVersion1(std::istream &in); 
+
+        // block of group g for this read 
+        inline Counter* block(const int *hashes, size_t g) const {
+            size_t index = SignedRemainder(hashes[g*_group_rows], _reciprocal, _blocks, _negative_offset); 
+            return _sketch + (g*_blocks + index)*kCountersPerLine; 
+        }
+        inline void prefetch(const int *hashes) const {
+            for (size_t g = 0; g < _groups; g++)
+                __builtin_prefetch(block(hashes, g), 1); 
+        }
+        // slot of a row inside its block, from bits of the hash that are not used by block()
+        inline size_t slot(int hash) const {
+            return ((uint64_t)((uint32_t)hash * 0x9E3779B9u) * _slots) >> 32; 
+        }
+
+        BlockedRACE(const BlockedRACE&); 
+        BlockedRACE& operator=(const BlockedRACE&); 
 };
 
+// True if range is a power of two (and RACE<Counter, true> can be used)
+bool IsPowerOfTwo(size_t range); 
+
+// Smallest counter width (8, 16 or 32 bits) whose maximum is at least R*tau, so that 
+// saturation never changes a keep decision 
+int CounterBitsFor(size_t R, double tau); 
+// Smallest counter width that counts up to reads without saturating (0 if no width can), 
+// for sketches whose counters are decreased again, e.g. by a WindowedSketch 
+int CounterBitsForReads(uint64_t reads); 
+
+// Creates the RACE instantiation for the given counter width (8, 16 or 32) and range. 
+// Returns NULL for an unsupported counter width. 
+Sketch* MakeRACE(size_t R, size_t range, int counter_bits = 32); 
+// Same for the cache-line-blocked layout 
+Sketch* MakeBlockedRACE(size_t R, size_t range, int counter_bits = 32); 
+
+// Opens a sketch file of either layout and format version, as the RACE instantiation 
+// that matches its counter width and range. With map = true, version 2 files in the 
+// byte order of this machine are memory-mapped (see Sketch::map) instead of read. 
+// Returns NULL on error. 
+Sketch* LoadSketch(const std::string& path, bool map = false); 
+// Same for a sketch that starts at the current position of a stream (never mapped) 
+Sketch* LoadSketch(std::istream& in); 
 
 
+// RACE sketch that can be queried and updated by many threads at once. The counters 
+// are atomics, and query_and_add uses one fetch-add per repetition, so there are no 
+// locks. Concurrent reads are counted in whatever order the threads reach the 
+// counters, so the query values depend on the interleaving. 
+class ConcurrentRACE 
+{
+public:
+    ConcurrentRACE(size_t R, size_t range); 
+    ~ConcurrentRACE(); 
+
+    void add(const int *hashes); 
+    double query_and_add(const int *hashes); 
+    void query_and_add(const int *hashes, size_t n, double *results); 
+    double query(const int *hashes); 
+    void clear(); 
+
+    private:
+        size_t _R, _range;
+        std::atomic<race_sketch_t>* _sketch;
+        SketchAllocator* _allocator; 
+
+        ConcurrentRACE(const ConcurrentRACE&); 
+        ConcurrentRACE& operator=(const ConcurrentRACE&); 
+};
+
 
+/*
+Sharded sampling: every worker (shard) has a private delta sketch. A read is queried 
+against the shared sketch plus the worker's delta and only added to the delta, so the 
+hot path has no atomics and no writes to shared memory. After every merge_interval 
+reads of a shard, its delta is folded into the shared sketch under a write lock and 
+cleared. 
+
+As with ConcurrentRACE, the workers process their batches concurrently, so a read may 
+be counted before reads that come earlier in the input. In addition, the reads in the 
+other shards' deltas (up to (shards - 1) * merge_interval reads) are not counted at 
+all until they are folded in. A small interval gives a sample close to the serial one, 
+a large interval scales better. Every delta has the size of the shared sketch. 
+*/
+class ShardedSketch 
+{
+public:
+    // global is owned by the caller; the deltas (one per shard, of the same type and 
+    // shape as global) are owned by the ShardedSketch. R is the number of hashes per read. 
+    ShardedSketch(Sketch* global, const std::vector<Sketch*>& deltas, size_t R, size_t merge_interval); 
+    ~ShardedSketch(); 
+
+    // query_and_add for n reads of one shard (see Sketch::query_and_add). Only the 
+    // thread that works for the shard may call this with its index. 
+    void query_and_add(int shard, const int *hashes, size_t n, double *results); 
+    // folds every delta into the shared sketch (e.g. at the end of the input) 
+    void merge(); 
+
+    private:
+        Sketch* _global; 
+        std::vector<Sketch*> _deltas; 
+        std::vector<size_t> _pending; // reads in each delta 
+        size_t _R; 
+        size_t _merge_interval; 
+        pthread_rwlock_t _lock; 
+
+        void fold(int shard); 
+
+        ShardedSketch(const ShardedSketch&); 
+        ShardedSketch& operator=(const ShardedSketch&); 
+};
+
+
+/*
+Sliding-window sampling of unbounded streams: a read is only counted by the reads that 
+follow it in the next window. The window is a ring of epochs of epoch_reads reads each. 
+Every read is queried and added in the total sketch, as usual, and is also added to the 
+sketch of the current epoch. When an epoch is full, the oldest epoch is subtracted from 
+the total and its sketch is reused for the next one. The total therefore counts the 
+reads of the last (epochs - 1) full epochs plus those of the current one, so the KDE 
+stops growing with the length of the stream.
+
+Memory is epochs + 1 sketches, and each read costs one more sketch update than without 
+a window, plus an amortized 1/epoch_reads of a pass over the counters. The counters must 
+not saturate within a window (see CounterBitsForReads), or subtraction is not exact. 
+*/
+class WindowedSketch 
+{
+public:
+    // total is owned by the caller; the epoch sketches are made with total->make_empty(). 
+    // R is the number of hashes per read. 
+    WindowedSketch(Sketch* total, size_t R, size_t epoch_reads, size_t epochs); 
+    ~WindowedSketch(); 
+
+    // query_and_add for n reads in order (see Sketch::query_and_add) 
+    void query_and_add(const int *hashes, size_t n, double *results); 
+
+    private:
+        Sketch* _total; 
+        std::vector<Sketch*> _epochs; 
+        size_t _current; // epoch that the reads are added to 
+        size_t _pending; // reads in the current epoch 
+        size_t _R; 
+        size_t _epoch_reads; 
+
+        WindowedSketch(const WindowedSketch&); 
+        WindowedSketch& operator=(const WindowedSketch&); 
+};
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "SequenceReader.h"
+#include "BoundedQueue.h"
+
+// Destination for the kept reads
+class SampleWriter {
+public:
+	virtual ~SampleWriter() {}
+	virtual bool write(const char* data, size_t length) = 0;
+	// Writes everything passed to write() so far to the file and flushes it to disk.
+	// size is set to the size of the file, which a resumed run can truncate it to.
+	// Returns false if any write failed.
+	virtual bool sync(uint64_t& size) = 0;
+	// Flushes everything and closes the file. Returns false if any write failed.
+	virtual bool close() = 0;
+};
+
+// True for output paths that OpenSampleWriter compresses (ending in .gz or .bgz)
+bool IsCompressedOutput(const std::string& path);
+
+// Opens path for writing. Paths ending in .gz or .bgz get a BGZFWriter with the given
+// number of compression threads, anything else a FileWriter. The path "-" writes
+// (uncompressed) to standard output. With resume_size >= 0,
+// the file is truncated to resume_size bytes (a size returned by sync) and appended
+// to, instead of being replaced. Returns NULL on error.
+SampleWriter* OpenSampleWriter(const std::string& path, int threads, int64_t resume_size = -1);
+
+// Writes a record chunk, adding the final newline if the input did not have one. Returns
+// false once the writer has failed (see SampleWriter::write).
+bool WriteChunk(SampleWriter& out, const SequenceView& chunk);
+
+
+// Uncompressed output. write() only copies into the current buffer, and full buffers
+// are written to the file by a writer thread, so the caller does not wait for the disk
+// (or for a slow pipe) unless every buffer is queued.
+class FileWriter : public SampleWriter {
+public:
+	FileWriter(int fd);
+	~FileWriter();
+	bool write(const char* data, size_t length);
+	bool sync(uint64_t& size);
+	bool close();
+private:
+	void submit();
+	void writeBuffers();
+
+	int _fd;
+	bool _closed;
+	std::vector<char>* _current;
+
+	BoundedQueue<std::vector<char>*> _free;
+	BoundedQueue<std::vector<char>*> _full;
+	std::vector<std::vector<char> > _pool;
+	std::thread _writer;
+
+	std::mutex _mutex;
+	std::condition_variable _cv;
+	size_t _submitted; // buffers handed to the writer thread
+	size_t _written;   // buffers written to the file
+	bool _ok;
+	int _error;        // errno of the first failed write
+};
+
+// BGZF (blocked gzip) output, readable by gzip, zcat, bgzip and htslib. write() only
+// copies into the current buffer. Full buffers are compressed into BGZF blocks by a
+// pool of threads, and a writer thread appends the blocks to the file in order.
+class BGZFWriter : public SampleWriter {
+public:
+	BGZFWriter(int fd, int threads, int level = 6);
+	~BGZFWriter();
+	bool write(const char* data, size_t length);
+	bool sync(uint64_t& size);
+	bool close();
+private:
+	struct Job {
+		size_t id;
+		std::vector<char> data;                // uncompressed
+		std::vector<unsigned char> compressed; // BGZF blocks
+		bool ok;
+	};
+
+	void submit();
+	void compressJobs();
+	void writeJobs();
+
+	int _fd;
+	int _level;
+	bool _closed;
+	Job* _current;
+	size_t _next_id;
+
+	BoundedQueue<Job*> _free;
+	BoundedQueue<Job*> _work;
+	std::vector<Job> _pool;
+	std::vector<std::thread> _threads;
+	std::thread _writer;
+
+	std::mutex _mutex;
+	std::condition_variable _cv;
+	std::map<size_t, Job*> _done;
+	size_t _written; // jobs written to the file
+	bool _submitting;
+	bool _ok;
+};
+
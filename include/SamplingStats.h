@@ -0,0 +1,124 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <chrono>
+#include <iostream>
+#include <cstdint>
+#include <cstddef>
+
+// Stages of the sampling loop that are timed separately
+enum SamplingStage {
+	STAGE_PARSE = 0,   // reading and parsing the input
+	STAGE_MINHASH = 1, // SequenceMinHash::getHash
+	STAGE_REHASH = 2,  // rehash of the MinHashes into sketch indices
+	STAGE_SKETCH = 3,  // query_and_add
+	STAGE_OUTPUT = 4,  // writing the kept reads
+	NUM_STAGES = 5
+};
+
+const char* SamplingStageName(SamplingStage stage);
+
+// Monotonic time in nanoseconds
+inline uint64_t StatsClock(){
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Nanoseconds spent in each stage. Every thread adds to its own StageTimes, and they
+// are summed at the end, so timing needs no synchronization. Times are taken per batch
+// of reads, not per read, so the clock is read a few times per thousand reads.
+struct StageTimes {
+	uint64_t ns[NUM_STAGES];
+
+	StageTimes() { clear(); }
+	void clear() { for (int s = 0; s < NUM_STAGES; s++) ns[s] = 0; }
+	void add(const StageTimes& other) { for (int s = 0; s < NUM_STAGES; s++) ns[s] += other.ns[s]; }
+};
+
+/*
+Histogram of the KDE values of the reads. The KDE of a read is the sum of its R counters
+divided by R, so the histogram counts the (integer) sums in power-of-two buckets: bucket
+0 holds the sum 0, and bucket b > 0 holds the sums in [2^(b-1), 2^b - 1]. Adding a value
+is a multiplication and a count-leading-zeros.
+*/
+class KDEHistogram {
+public:
+	KDEHistogram(size_t reps) : _reps(reps), _counts(65, 0) {}
+	inline void add(double kde){
+		uint64_t sum = (uint64_t)(kde*_reps + 0.5);
+		_counts[sum ? 64 - __builtin_clzll(sum) : 0]++;
+	}
+	size_t reps() const { return _reps; }
+	const std::vector<uint64_t>& counts() const { return _counts; }
+private:
+	size_t _reps;
+	std::vector<uint64_t> _counts;
+};
+
+/*
+Hardware counters (CPU cycles, instructions, cache misses, data TLB misses) of the
+process through perf_event_open. The counters include every thread that is started after
+start(), so it should be called before the pipeline threads are created. They are often
+unavailable, e.g. in containers or with a restrictive /proc/sys/kernel/perf_event_paranoid;
+start() then returns false and the report leaves them out. Some CPUs (and most virtual
+machines) have no TLB miss event; has(DTLB_MISSES) is then false, but the others count.
+*/
+class PerfCounters {
+public:
+	enum Event { CYCLES = 0, INSTRUCTIONS = 1, CACHE_MISSES = 2, DTLB_MISSES = 3, NUM_EVENTS = 4 };
+
+	PerfCounters();
+	~PerfCounters();
+	bool start();
+	// Stops counting and reads the counters
+	void stop();
+	bool available() const { return _available; }
+	bool has(Event event) const { return _available && _fds[event] >= 0; }
+	uint64_t value(Event event) const { return _values[event]; }
+	static const char* name(Event event);
+
+private:
+	int _fds[NUM_EVENTS];
+	uint64_t _values[NUM_EVENTS];
+	bool _available;
+
+	PerfCounters(const PerfCounters&);
+	PerfCounters& operator=(const PerfCounters&);
+};
+
+// Page faults of the process (from getrusage, so always available), between start() and stop()
+struct PageFaults {
+	uint64_t minor; // resolved without I/O, e.g. the first touch of a sketch page
+	uint64_t major; // needed I/O, e.g. pages of a mapped sketch file
+	PageFaults() : minor(0), major(0) {}
+	void start();
+	void stop();
+};
+
+// Everything reported by samplerace --stats
+struct SamplingStats {
+	uint64_t reads;      // reads (or pairs) processed
+	uint64_t kept;       // reads (or pairs) kept
+	uint64_t bases;      // bases of the first input
+	uint64_t duplicates; // reads (or pairs) whose hashes came from the duplicate cache
+	uint64_t cache_entries; // size of the duplicate cache (0 = no cache)
+	int threads;
+	uint64_t start_ns;   // StatsClock() at the start of the run
+	uint64_t end_ns;
+	StageTimes times;    // summed over all threads
+	KDEHistogram kde;
+	PerfCounters perf;
+	PageFaults faults;   // started by the constructor
+	std::string allocator; // SketchAllocator::name of the sketches
+	uint64_t sketch_bytes; // memory of the sketches, and how much of it is in huge pages
+	uint64_t huge_page_bytes;
+
+	SamplingStats(size_t reps, int threads);
+	double seconds() const { return (end_ns - start_ns) / 1e9; }
+	// One line for the periodic progress report
+	void progress(std::ostream& out) const;
+	void json(std::ostream& out) const;
+};
+
+// Writes stats.json() to path. Returns false on error.
+bool SaveStats(const std::string& path, const SamplingStats& stats);
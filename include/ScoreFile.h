@@ -0,0 +1,59 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+#include "SampleWriter.h"
+
+/*
+Per-read KDE scores of a sampling run (samplerace --scores), so that the sample of any
+other tau can be taken later by racefilter without hashing the reads again. The KDE of
+a read does not depend on tau, since every read is added to the sketch, as long as the
+counters do not saturate: samplerace --scores therefore always uses 32-bit counters,
+and rejects a sketch (--load-sketch or a checkpoint) with narrower ones.
+
+The file starts with a 16-byte header: the magic "RACEKDE1", then the number of reps R
+as a little-endian uint32 and 4 reserved bytes. It is followed by one score per read
+(or pair), in input order. A score is the sum of the R counters of the read, which is
+an integer and its KDE times R, stored as an unsigned LEB128 varint: typically one or
+two bytes per read, and KDE = sum / R exactly as the sketch computes it.
+*/
+static const size_t kScoreHeader = 16;
+
+class ScoreWriter {
+public:
+	ScoreWriter();
+	~ScoreWriter();
+	// With resume_size >= 0, appends to an existing score file that is first truncated
+	// to resume_size bytes (a size returned by sync). Returns false on error.
+	bool open(const std::string& path, size_t reps, int64_t resume_size = -1);
+	void add(const double* kde, size_t n);
+	// Writes everything to disk; size is set to the size of the file (see SampleWriter::sync)
+	bool sync(uint64_t& size);
+	bool close();
+private:
+	SampleWriter* _out;
+	size_t _reps;
+	std::vector<unsigned char> _buffer;
+};
+
+class ScoreReader {
+public:
+	ScoreReader();
+	~ScoreReader();
+	bool open(const std::string& path);
+	size_t reps() const { return _reps; }
+	// Sets sum to the next score. Returns false at the end of the file or on error (see failed()).
+	bool next(uint64_t& sum);
+	bool failed() const { return _failed; }
+	void close();
+private:
+	bool refill();
+	int _fd;
+	size_t _reps;
+	std::vector<unsigned char> _buffer;
+	size_t _position, _end;
+	bool _failed;
+};
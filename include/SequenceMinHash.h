@@ -1,22 +1,63 @@
-#pragma once 
+#pragma once
 
 #include <limits>
 #include <vector>
 #include <string>
+#include <cstdint>
 
 #include <iostream>
 
 #include "MurmurHash.h"
-
+#include "TaskPool.h"
+
+// Hashing engines for SequenceMinHash::getHash
+// MINHASH_MURMUR: original engine, hashes k raw bytes with MurmurHash at every position
+// MINHASH_ROLLING: packs the read into 2-bit codes and rolls each k-mer as a 64-bit integer
+// MINHASH_ONEPERM: rolling k-mers, but a single scan fills all the MinHash slots at once
+//                  (one permutation hashing with optimal densification)
+enum MinHashEngine {
+	MINHASH_MURMUR = 0,
+	MINHASH_ROLLING = 1,
+	MINHASH_ONEPERM = 2
+};
 
 class SequenceMinHash {
-private: 
-	int _numhashes; 
-public: 
-	SequenceMinHash(int number_of_hashes); 
-	void getHash(size_t k, const std::string& sequence, int* hashes); 
-	unsigned int internalHash(int input, int seed); 
-}; 
-
-
+private:
+	int _numhashes;
+	MinHashEngine _engine;
+	std::vector<uint32_t> _salts; // one salt per MinHash seed (rolling engine)
+	std::vector<uint64_t> _kmers; // scratch space for the mixed k-mers of one read
+	std::vector<uint64_t> _bins; // scratch space for the one permutation hashing bins
+
+	// long reads are split into pieces that are hashed by the threads of _pool
+	struct Piece {
+		std::vector<uint64_t> kmers;
+		std::vector<uint64_t> bins;
+		std::vector<int> hashes;
+		std::vector<uint32_t> minima;
+	};
+	TaskPool* _pool;
+	size_t _split_length;
+	std::vector<Piece> _pieces;
+
+	static size_t MurmurStarts(size_t k, size_t length);
+	void getHashMurmur(size_t k, const char* seq, size_t first, size_t last, int* hashes, uint32_t* minima);
+	void getHashSplit(size_t k, const char* seq, size_t len, int* hashes);
+	void rollKmers(size_t k, const char* seq, size_t begin, size_t end, std::vector<uint64_t>& kmers);
+	void fillBins(const uint64_t* kmers, size_t nkmers, uint64_t* bins);
+	void densifyBins(size_t nkmers, int* hashes);
+public:
+	SequenceMinHash(int number_of_hashes, MinHashEngine engine = MINHASH_ROLLING);
+	void getHash(size_t k, const std::string& sequence, int* hashes);
+	void getHash(size_t k, const char* sequence, size_t length, int* hashes);
+	unsigned int internalHash(int input, int seed);
+	// Reads of at least split_length bases are split into pieces (of at least a few
+	// thousand bases each) that are hashed in parallel by the pool, together with the
+	// calling thread. The hashes are the same as without a pool. The pool may be shared
+	// by several SequenceMinHash objects on different threads. NULL turns splitting off.
+	void setPool(TaskPool* pool, size_t split_length);
+};
+
+// Parses an engine name ("murmur", "rolling" or "oph"). Returns false for unknown names.
+bool ParseMinHashEngine(const std::string& name, MinHashEngine& engine);
 
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <string>
+#include <iostream>
+#include <cstdint>
+#include <cstddef>
+
+// A read-only view into the input buffer (not null-terminated)
+struct SequenceView {
+	const char* data;
+	size_t length;
+
+	SequenceView() : data(NULL), length(0) {}
+	SequenceView(const char* d, size_t l) : data(d), length(l) {}
+	std::string str() const { return std::string(data, length); }
+};
+
+// One fasta/fastq record. Every field is a view into the reader's buffer: nothing is
+// copied or allocated per record. Lines do not include their newline.
+struct SequenceRecord {
+	SequenceView header;   // starts with '>' or '@'
+	SequenceView sequence;
+	SequenceView plus;     // fastq only
+	SequenceView quality;  // fastq only
+	SequenceView chunk;    // the full text of the record(s), including newlines
+	uint64_t offset;       // byte offset of chunk in the input
+};
+
+// Where the bytes of a streamed (non-mapped) input come from
+class ByteSource {
+public:
+	virtual ~ByteSource() {}
+	// Reads up to capacity bytes. Returns the number of bytes read, 0 at end of input
+	// and -1 on error.
+	virtual long read(char* buffer, size_t capacity) = 0;
+};
+
+/*
+Zero-copy fasta/fastq reader. Regular files are memory-mapped, and the record views
+stay valid until the reader is closed. Other inputs (pipes, or files that cannot be
+mapped) are read in large blocks, and the views are only valid until the next call
+to next().
+
+Inputs are read ahead of the parser: streamed inputs by a thread per reader that fills
+a ring of blocks, and mapped inputs by asking the kernel to read the next window of
+the file in the background. Readers of the two files of a paired-end run therefore
+read concurrently.
+
+Gzip-compressed inputs are recognized by their header (not by the file name) and
+decompressed on the fly. BGZF inputs are decompressed block-parallel.
+
+Like SequenceFeatures, fasta records are expected to have the sequence on one line.
+*/
+class SequenceReader {
+public:
+	SequenceReader();
+	~SequenceReader();
+
+	// fastWhat is either "fasta" or "fastq". threads is the number of decompression
+	// threads for BGZF inputs. The path "-" reads standard input.
+	bool open(const std::string& path, const std::string& fastWhat, int threads = 1);
+	void close();
+
+	// Parses the next nrecords records. record describes the first of them, and
+	// record.chunk covers all nrecords (e.g. nrecords = 2 for interleaved pairs).
+	// Returns false at the end of the input or on a parse error (see failed()).
+	bool next(SequenceRecord& record, int nrecords = 1);
+	// Continues at the given byte offset of the input (e.g. the end of a record that was
+	// processed in an earlier run). Streamed inputs are read and decompressed up to the
+	// offset, but not parsed. Returns false if the input is shorter.
+	bool skip(uint64_t offset);
+
+	// True if the views stay valid after the next call to next()
+	bool mapped() const { return _map != NULL; }
+	bool failed() const { return _failed; }
+	// Size of the input in bytes, or 0 if it is not a mapped file
+	uint64_t size() const { return _map ? _map_size : 0; }
+
+private:
+	bool parse(SequenceRecord& record, int nrecords, bool& incomplete);
+	bool refill();
+	void advise();
+
+	std::string _fastWhat;
+	char _begin;
+	int _lines_per_record;
+
+	int _fd;
+	char* _map;
+	size_t _map_size;
+	size_t _advised; // end of the mapped range that was passed to madvise(MADV_WILLNEED)
+
+	ByteSource* _source;
+	char* _buffer;
+	size_t _capacity;
+
+	// unread bytes are [_cursor, _end); _base is the input offset of _buffer[0]
+	const char* _cursor;
+	const char* _end;
+	uint64_t _base;
+	bool _eof;
+	bool _failed;
+
+	SequenceReader(const SequenceReader&);
+	SequenceReader& operator=(const SequenceReader&);
+};
+
+// Writes a record chunk, adding the final newline if the input did not have one
+void WriteChunk(std::ostream& out, const SequenceView& chunk);
+
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <cstddef>
+
+/*
+Memory for the counters of RACE, BlockedRACE and ConcurrentRACE. Sketches are hit at
+random, so a large sketch is bound by TLB misses with 4 KB pages, and on multi-socket
+machines by accesses to the memory of the other socket. The sketches take their counters
+from the current allocator (SetSketchAllocator), which can be replaced before sketches
+are created, e.g. by a PageAllocator for huge pages or NUMA placement. Each sketch keeps
+the allocator it was created with. Sketches mapped from files (LoadSketch with map) do
+not use the allocator.
+*/
+class SketchAllocator {
+public:
+	virtual ~SketchAllocator() {}
+	// Returns zeroed memory of bytes bytes, aligned to at least a cache line. Throws
+	// std::bad_alloc on failure, like new.
+	virtual void* allocate(size_t bytes) = 0;
+	virtual void deallocate(void* memory, size_t bytes) = 0;
+	virtual std::string name() const = 0;
+	// Bytes currently allocated, and how many of them are backed by huge pages (as far
+	// as the allocator can tell)
+	virtual void usage(size_t& bytes, size_t& huge_bytes) const = 0;
+};
+
+// The heap (the default): posix_memalign, with 4 KB pages and the process's NUMA policy
+class HeapAllocator : public SketchAllocator {
+public:
+	HeapAllocator() : _bytes(0) {}
+	void* allocate(size_t bytes);
+	void deallocate(void* memory, size_t bytes);
+	std::string name() const { return "heap"; }
+	void usage(size_t& bytes, size_t& huge_bytes) const;
+private:
+	mutable std::mutex _mutex;
+	size_t _bytes;
+};
+
+enum HugePages {
+	HUGE_PAGES_NONE = 0,     // 4 KB pages
+	HUGE_PAGES_THP = 1,      // transparent huge pages (madvise(MADV_HUGEPAGE) on 2 MB aligned memory)
+	HUGE_PAGES_EXPLICIT = 2  // pages from the hugetlbfs pool (MAP_HUGETLB), or THP if the pool is empty
+};
+
+enum NumaPolicy {
+	NUMA_DEFAULT = 0,    // the process's policy (usually: the node of the thread that first touches a page)
+	NUMA_INTERLEAVE = 1, // pages spread round-robin over all nodes, for sketches that every thread uses
+	NUMA_LOCAL = 2       // pages on the node of the thread that first touches them, e.g. the private
+	                     // delta of a --sharded worker (the counters are not touched by allocate)
+};
+
+// Anonymous memory mappings with the given page size and NUMA placement. NUMA placement
+// uses mbind and is skipped (with a warning) on machines with one node or without it.
+class PageAllocator : public SketchAllocator {
+public:
+	PageAllocator(HugePages pages, NumaPolicy numa);
+	void* allocate(size_t bytes);
+	void deallocate(void* memory, size_t bytes);
+	std::string name() const;
+	// huge_bytes counts the AnonHugePages of /proc/self/smaps for transparent huge pages
+	void usage(size_t& bytes, size_t& huge_bytes) const;
+private:
+	struct Region {
+		char* start;
+		size_t size;
+		bool hugetlb;
+	};
+	HugePages _pages;
+	NumaPolicy _numa;
+	bool _warned_hugetlb, _warned_numa;
+	mutable std::mutex _mutex;
+	std::vector<Region> _regions;
+
+	void place(void* memory, size_t size);
+};
+
+// The allocator of new sketches. The allocator must outlive every sketch created with it.
+SketchAllocator& GetSketchAllocator();
+// NULL restores the heap
+void SetSketchAllocator(SketchAllocator* allocator);
+
+// Parse the names "none", "thp" and "explicit", and "none", "interleave" and "local".
+// Return false for unknown names.
+bool ParseHugePages(const std::string& name, HugePages& pages);
+bool ParseNumaPolicy(const std::string& name, NumaPolicy& numa);
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <iostream>
+#include <cstdint>
+#include <cstddef>
+
+// A simulated read and the index of the genome it was sampled from
+struct SyntheticRead {
+	std::string sequence;
+	size_t source;
+};
+
+// count random genomes (uniform ACGT) of the given length
+std::vector<std::string> RandomGenomes(size_t count, size_t length, uint64_t seed);
+
+/*
+Samples nreads reads of read_length bases from the genomes, with substitution errors
+at error_rate. Genome g is chosen with probability proportional to 1/(g+1)^skew, so
+with skew > 0 the first genomes are abundant and the last ones rare (the setting that
+diversity sampling is meant for). The same seed always gives the same reads.
+*/
+std::vector<SyntheticRead> SimulateReads(const std::vector<std::string>& genomes, size_t nreads,
+	size_t read_length, double error_rate, double skew, uint64_t seed);
+
+/*
+Long reads (as from nanopore or PacBio sequencers): read lengths are log-normal with
+the given mean (and a standard deviation of half the mean), and errors are split evenly
+between substitutions, insertions and deletions. Reads are cut at the end of the genome,
+so genomes should be several times longer than mean_length.
+*/
+std::vector<SyntheticRead> SimulateLongReads(const std::vector<std::string>& genomes, size_t nreads,
+	size_t mean_length, double error_rate, double skew, uint64_t seed);
+
+// Writes the reads as fastq records named by their index and source genome
+void WriteFastq(std::ostream& out, const std::vector<SyntheticRead>& reads);
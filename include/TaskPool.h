@@ -0,0 +1,48 @@
+#pragma once
+
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+/*
+Helper threads for splitting one piece of work (e.g. hashing a long read) into chunks
+that run in parallel. run() hands out the chunks of a loop to the helpers and works on
+them itself, so it finishes even when every helper is busy. Any number of threads may
+call run() at the same time: the helpers take chunks from the loops in the order they
+were started.
+*/
+class TaskPool {
+public:
+	TaskPool(int helpers);
+	~TaskPool(); // joins the helpers; no loop may be running
+
+	// Calls chunk(0), ..., chunk(nchunks - 1), in any order and on any thread, and
+	// returns once all of them have returned
+	void run(size_t nchunks, const std::function<void(size_t)>& chunk);
+	int helpers() const { return (int)_threads.size(); }
+
+private:
+	struct Loop {
+		const std::function<void(size_t)>* chunk;
+		size_t nchunks;
+		size_t next;     // next chunk to hand out
+		size_t finished; // chunks that have returned
+	};
+
+	void help();
+	// Claims the next chunk of the first loop in _loops (with _mutex held)
+	bool claim(Loop*& loop, size_t& index);
+
+	std::mutex _mutex;
+	std::condition_variable _work;     // a loop was added, or the pool is stopping
+	std::condition_variable _finished; // a chunk finished
+	std::deque<Loop*> _loops;          // loops with chunks left to hand out
+	bool _stopping;
+	std::vector<std::thread> _threads;
+
+	TaskPool(const TaskPool&);
+	TaskPool& operator=(const TaskPool&);
+};
@@ -6,14 +6,35 @@
 #include <fstream>
 #include <vector>
 #include <math.h>
+#include <cstdint>
 #include "MurmurHash.h"
 
-bool SequenceFeatures(std::istream& in, std::string& sequence, std::string& chunk, std::string fastWhat); 
+bool SequenceFeatures(std::istream& in, std::string& sequence, std::string& chunk, const std::string& fastWhat); 
 
 
-bool SequenceFeaturesI(std::istream& in, std::string& sequence, std::string& chunk, std::string fastWhat); 
-bool SequenceFeaturesPE(std::istream& in1, std::istream& in2, std::string& sequence, std::string& chunk1, std::string& chunk2, std::string fastWhat); 
-bool SequenceFeaturesSE(std::istream& in, std::string& sequence, std::string& chunk, std::string fastWhat); 
+bool SequenceFeaturesI(std::istream& in, std::string& sequence, std::string& chunk, const std::string& fastWhat); 
+bool SequenceFeaturesPE(std::istream& in1, std::istream& in2, std::string& sequence, std::string& chunk1, std::string& chunk2, const std::string& fastWhat); 
+bool SequenceFeaturesSE(std::istream& in, std::string& sequence, std::string& chunk, const std::string& fastWhat); 
 
 
+// A range of bytes [offset, offset + length) in an input file
+struct ByteRange {
+    uint64_t offset; 
+    uint64_t length; 
+};
 
+// Kept records, stored as byte ranges of the input instead of copies of the records. 
+// Adjacent ranges are merged, so keeping a run of consecutive reads costs one range. 
+class ByteRangeList {
+public: 
+    void add(uint64_t offset, uint64_t length); 
+    const std::vector<ByteRange>& ranges() const { return _ranges; }
+    uint64_t bytes() const; 
+private: 
+    std::vector<ByteRange> _ranges; 
+}; 
+
+// Writes the given ranges of input to output, copying in the kernel (copy_file_range,
+// then sendfile, then plain reads and writes as fallbacks). If the last range ends at
+// the end of a file without a final newline, a newline is appended. 
+bool CopyByteRanges(const std::string& input, const std::string& output, const std::vector<ByteRange>& ranges); 
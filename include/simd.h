@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+
+// Vectorized kernels for the hot loops of the sampler, with runtime CPU dispatch.
+// Every kernel has a scalar version, and all versions return identical results, so
+// one binary gives the same samples on every machine.
+
+enum SimdLevel {
+	SIMD_SCALAR = 0,
+	SIMD_AVX2 = 1,
+	SIMD_AVX512 = 2
+};
+
+// Best instruction set supported by this CPU
+SimdLevel DetectSimdLevel();
+// Instruction set used by the kernels (DetectSimdLevel() unless overridden)
+SimdLevel ActiveSimdLevel();
+// Override the dispatch, e.g. to compare against the scalar kernels. Returns false
+// if the CPU does not support the requested level. Not thread-safe: call it before
+// hashing starts.
+bool SetSimdLevel(SimdLevel level);
+
+const char* SimdLevelName(SimdLevel level);
+bool ParseSimdLevel(const std::string& name, SimdLevel& level);
+
+// Rolling MinHash: for each of nseeds seeds, finds the k-mer with the smallest
+// fmix32((uint32_t)kmer ^ salts[n]) and writes the high half of that k-mer to hashes[n]
+// (0 if there are no k-mers). The seeds are evaluated 8 (AVX2) or 16 (AVX-512) at a time.
+// If minima is given, minima[n] is set to the smallest value (0xffffffff if there are no
+// k-mers), so that the results of consecutive pieces of a read can be combined.
+void MinHashKernel(const uint64_t* kmers, size_t nkmers, const uint32_t* salts, int nseeds, int* hashes, uint32_t* minima = NULL);
+
+// MurmurHash (seed 42) of each group of values_per_set integers, for nhashes groups.
+// The groups are hashed 8 (AVX2) or 16 (AVX-512) at a time.
+void RehashKernel(const int* input_hashes, int* output_hashes, int nhashes, int values_per_set);
+
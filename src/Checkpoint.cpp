@@ -0,0 +1,116 @@
+#include "Checkpoint.h"
+
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+/*
+Copyright 2019, Benjamin Coleman, All rights reserved.
+Free for research use. For commercial use, contact
+Rice University Invention & Patent or the author
+
+*/
+
+static const char* kCheckpointMagic = "RACE checkpoint 1";
+
+// Flushes a closed file to disk and moves it to path
+static bool Commit(const std::string& temporary, const std::string& path){
+    int fd = open(temporary.c_str(), O_RDONLY);
+    bool ok = (fd >= 0 && fsync(fd) == 0);
+    if (fd >= 0)
+        close(fd);
+    if (!ok || rename(temporary.c_str(), path.c_str()) != 0){
+        std::cerr<<"Could not write "<<path<<": "<<strerror(errno)<<std::endl;
+        unlink(temporary.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool SaveCheckpoint(const std::string& path, const Checkpoint& checkpoint, Sketch& sketch){
+    std::ostringstream header;
+    header<<kCheckpointMagic<<'\n';
+    header<<"parameters "<<checkpoint.parameters<<'\n';
+    header<<"reads "<<checkpoint.reads<<'\n';
+    header<<"kept "<<checkpoint.kept<<'\n';
+    header<<"input1 "<<checkpoint.input1<<'\n';
+    header<<"input2 "<<checkpoint.input2<<'\n';
+    header<<"output1 "<<checkpoint.output1<<'\n';
+    header<<"output2 "<<checkpoint.output2<<'\n';
+    header<<"scores "<<checkpoint.scores<<'\n';
+    std::string text = header.str();
+    if (text.size() >= kCheckpointHeader){
+        std::cerr<<"Checkpoint parameters are too long"<<std::endl;
+        return false;
+    }
+    text.resize(kCheckpointHeader, '\n');
+
+    std::string temporary = path + ".tmp";
+    std::ofstream out(temporary.c_str(), std::ios::binary | std::ios::out | std::ios::trunc);
+    out.write(text.data(), text.size());
+    sketch.serialize(out);
+    out.close();
+    if (!out){
+        std::cerr<<"Could not write checkpoint "<<temporary<<std::endl;
+        unlink(temporary.c_str());
+        return false;
+    }
+    return Commit(temporary, path);
+}
+
+Sketch* LoadCheckpoint(const std::string& path, Checkpoint& checkpoint){
+    std::ifstream in(path.c_str(), std::ios::binary | std::ios::in);
+    if (!in){
+        std::cerr<<"Could not open checkpoint "<<path<<std::endl;
+        return NULL;
+    }
+    std::string text(kCheckpointHeader, '\0');
+    in.read(&text[0], text.size());
+    std::istringstream header(text);
+    std::string line;
+    if (!in || !std::getline(header, line) || line != kCheckpointMagic){
+        std::cerr<<"Not a checkpoint file: "<<path<<std::endl;
+        return NULL;
+    }
+    int fields = 0;
+    while (std::getline(header, line) && !line.empty()){
+        size_t space = line.find(' ');
+        std::string key = line.substr(0, space);
+        std::string value = (space == std::string::npos) ? "" : line.substr(space + 1);
+        if (key == "parameters"){ checkpoint.parameters = value; fields++; }
+        else if (key == "reads"){ checkpoint.reads = std::stoull(value); fields++; }
+        else if (key == "kept"){ checkpoint.kept = std::stoull(value); fields++; }
+        else if (key == "input1"){ checkpoint.input1 = std::stoull(value); fields++; }
+        else if (key == "input2"){ checkpoint.input2 = std::stoull(value); fields++; }
+        else if (key == "output1"){ checkpoint.output1 = std::stoull(value); fields++; }
+        else if (key == "output2"){ checkpoint.output2 = std::stoull(value); fields++; }
+        else if (key == "scores"){ checkpoint.scores = std::stoull(value); }
+    }
+    if (fields != 7){
+        std::cerr<<"Incomplete checkpoint file: "<<path<<std::endl;
+        return NULL;
+    }
+    Sketch* sketch = LoadSketch(in);
+    if (sketch == NULL)
+        std::cerr<<"Could not load the sketch of checkpoint "<<path<<std::endl;
+    return sketch;
+}
+
+bool SaveSketch(const std::string& path, Sketch& sketch){
+    std::string temporary = path + ".tmp";
+    std::ofstream out(temporary.c_str(), std::ios::binary | std::ios::out | std::ios::trunc);
+    sketch.serialize(out);
+    out.close();
+    if (!out){
+        std::cerr<<"Could not write sketch "<<temporary<<std::endl;
+        unlink(temporary.c_str());
+        return false;
+    }
+    return Commit(temporary, path);
+}
@@ -0,0 +1,127 @@
+#include "DiversitySampler.h"
+#include "Checkpoint.h"
+
+#include <iostream>
+#include <memory>
+
+/*
+Copyright 2019, Benjamin Coleman, All rights reserved.
+Free for research use. For commercial use, contact
+Rice University Invention & Patent or the author
+
+*/
+
+DiversitySampler* MakeDiversitySampler(const SamplerOptions& options){
+    if (options.tau <= 0 || options.range <= 0 || options.reps <= 0 || options.hashes <= 0 || options.k <= 0 || options.threads <= 0){
+        std::cerr<<"Invalid sampler options: tau, range, reps, hashes, k and threads must be positive"<<std::endl;
+        return NULL;
+    }
+    int counter_bits = options.counter_bits ? options.counter_bits : CounterBitsFor(options.reps, options.tau);
+    Sketch* sketch = options.blocked ? MakeBlockedRACE(options.reps, options.range, counter_bits) : MakeRACE(options.reps, options.range, counter_bits);
+    if (sketch == NULL){
+        std::cerr<<"Invalid sampler options: counter_bits must be 8, 16 or 32"<<std::endl;
+        return NULL;
+    }
+    return new DiversitySampler(options, sketch);
+}
+
+DiversitySampler::DiversitySampler(const SamplerOptions& options, Sketch* sketch) :
+    _options(options), _hasher(options.reps, options.hashes, options.k, options.engine),
+    _sketch(sketch), _pool(NULL), _cache(NULL), _rehashes(options.reps), _offered(0), _kept(0), _duplicates(0){
+    _sketch->set_hash_tag(_hasher.tag());
+    if (options.threads > 1){
+        _pool = new TaskPool(options.threads - 1);
+        _hasher.setPool(_pool, options.split_length);
+    }
+    if (options.duplicate_cache > 0){
+        _cache = new DuplicateCache(options.duplicate_cache, options.reps);
+        _hasher.setDuplicateCache(_cache);
+    }
+}
+
+DiversitySampler::~DiversitySampler(){
+    delete _sketch;
+    delete _pool;
+    delete _cache;
+}
+
+bool DiversitySampler::offer(const char* sequence, size_t length, double* score){
+    _duplicates += _hasher.hash(SequenceView(sequence, length), _rehashes.data());
+    double KDE = _sketch->query_and_add(_rehashes.data());
+    if (score) *score = KDE;
+    bool keep = (KDE < _options.tau);
+    _offered++;
+    _kept += keep;
+    return keep;
+}
+
+bool DiversitySampler::offer(const std::string& sequence, double* score){
+    return offer(sequence.data(), sequence.size(), score);
+}
+
+size_t DiversitySampler::offer(const SequenceView* sequences, size_t n, bool* keep, double* scores){
+    size_t reps = _options.reps;
+    _rehashes.resize(n * reps);
+    for (size_t i = 0; i < n; i++)
+        _duplicates += _hasher.hash(sequences[i], _rehashes.data() + i*reps);
+    if (scores == NULL){
+        _scores.resize(n);
+        scores = _scores.data();
+    }
+    _sketch->query_and_add(_rehashes.data(), n, scores);
+    size_t kept = 0;
+    for (size_t i = 0; i < n; i++){
+        keep[i] = (scores[i] < _options.tau);
+        kept += keep[i];
+    }
+    _offered += n;
+    _kept += kept;
+    return kept;
+}
+
+size_t DiversitySampler::offer(const std::vector<std::string>& sequences, std::vector<bool>& keep, std::vector<double>* scores){
+    std::vector<SequenceView> views(sequences.size());
+    for (size_t i = 0; i < sequences.size(); i++)
+        views[i] = SequenceView(sequences[i].data(), sequences[i].size());
+    std::unique_ptr<bool[]> decisions(new bool[sequences.size()]);
+    if (scores) scores->resize(sequences.size());
+    size_t kept = offer(views.data(), views.size(), decisions.get(), scores ? scores->data() : NULL);
+    keep.assign(decisions.get(), decisions.get() + sequences.size());
+    return kept;
+}
+
+double DiversitySampler::score(const char* sequence, size_t length){
+    _rehashes.resize(_options.reps);
+    _hasher.hash(SequenceView(sequence, length), _rehashes.data());
+    return _sketch->query(_rehashes.data());
+}
+
+double DiversitySampler::score(const std::string& sequence){
+    return score(sequence.data(), sequence.size());
+}
+
+bool DiversitySampler::load(const std::string& path){
+    Sketch* sketch = LoadSketch(path);
+    if (sketch == NULL)
+        return false;
+    if (sketch->reps() != (size_t)_options.reps || sketch->range() != (size_t)_options.range
+        || (sketch->hash_tag() != 0 && sketch->hash_tag() != _hasher.tag())){
+        std::cerr<<"The sketch in "<<path<<" was built with different reps, range or hash functions"<<std::endl;
+        delete sketch;
+        return false;
+    }
+    int counter_bits = _options.counter_bits ? _options.counter_bits : CounterBitsFor(_options.reps, _options.tau);
+    if (sketch->counter_bits() < counter_bits){
+        std::cerr<<"The sketch in "<<path<<" has "<<sketch->counter_bits()<<"-bit counters, but the sampler needs "<<counter_bits<<"-bit counters"<<std::endl;
+        delete sketch;
+        return false;
+    }
+    sketch->set_hash_tag(_hasher.tag());
+    delete _sketch;
+    _sketch = sketch;
+    return true;
+}
+
+bool DiversitySampler::save(const std::string& path){
+    return SaveSketch(path, *_sketch);
+}
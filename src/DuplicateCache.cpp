@@ -0,0 +1,79 @@
+#include "DuplicateCache.h"
+#include "MurmurHash.h"
+
+#include <algorithm>
+#include <cstring>
+
+/*
+Copyright 2019, Benjamin Coleman, All rights reserved.
+Free for research use. For commercial use, contact
+Rice University Invention & Patent or the author
+
+*/
+
+DuplicateCache::DuplicateCache(size_t bytes, int reps) : _reps(reps){
+    size_t nsets = std::max((size_t)1, bytes / (kWays * bytesPerEntry(reps)));
+    Set empty;
+    for (size_t i = 0; i < kWays; i++){
+        empty.fingerprint[i] = 0;
+        empty.length[i] = 0;
+        empty.slot[i] = i;
+    }
+    _sets.assign(nsets, empty);
+    _values.resize(nsets * kWays * reps);
+}
+
+uint64_t DuplicateCache::Fingerprint(const SequenceView& sequence){
+    return MurmurHash64(sequence.data, sequence.length, 0xD0B1CAC4E);
+}
+
+bool DuplicateCache::find(const SequenceView& sequence, int* rehashes){
+    if (sequence.length == 0 || sequence.length > UINT32_MAX)
+        return false;
+    uint64_t fingerprint = Fingerprint(sequence);
+    size_t s = fingerprint % _sets.size();
+    std::lock_guard<std::mutex> lock(_locks[s % kLocks]);
+    Set& set = _sets[s];
+    for (size_t i = 0; i < kWays; i++){
+        if (set.length[i] == sequence.length && set.fingerprint[i] == fingerprint){
+            uint32_t slot = set.slot[i];
+            memcpy(rehashes, values(s, slot), _reps*sizeof(int));
+            // move the entry to the front
+            for (size_t j = i; j > 0; j--){
+                set.fingerprint[j] = set.fingerprint[j-1];
+                set.length[j] = set.length[j-1];
+                set.slot[j] = set.slot[j-1];
+            }
+            set.fingerprint[0] = fingerprint;
+            set.length[0] = sequence.length;
+            set.slot[0] = slot;
+            return true;
+        }
+    }
+    return false;
+}
+
+void DuplicateCache::insert(const SequenceView& sequence, const int* rehashes){
+    if (sequence.length == 0 || sequence.length > UINT32_MAX)
+        return;
+    uint64_t fingerprint = Fingerprint(sequence);
+    size_t s = fingerprint % _sets.size();
+    std::lock_guard<std::mutex> lock(_locks[s % kLocks]);
+    Set& set = _sets[s];
+    // another thread may have cached the same sequence in the meantime
+    for (size_t i = 0; i < kWays; i++){
+        if (set.length[i] == sequence.length && set.fingerprint[i] == fingerprint)
+            return;
+    }
+    // the least recently used entry (the last one) makes room at the front
+    uint32_t slot = set.slot[kWays - 1];
+    for (size_t j = kWays - 1; j > 0; j--){
+        set.fingerprint[j] = set.fingerprint[j-1];
+        set.length[j] = set.length[j-1];
+        set.slot[j] = set.slot[j-1];
+    }
+    set.fingerprint[0] = fingerprint;
+    set.length[0] = sequence.length;
+    set.slot[0] = slot;
+    memcpy(values(s, slot), rehashes, _reps*sizeof(int));
+}
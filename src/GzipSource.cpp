@@ -0,0 +1,280 @@
+#include "GzipSource.h"
+
+#include <cstring>
+#include <algorithm>
+
+/*
+Copyright 2019, Benjamin Coleman, All rights reserved.
+Free for research use. For commercial use, contact
+Rice University Invention & Patent or the author
+
+*/
+
+static const size_t kGzipInput = 1 << 20;    // compressed read size for streaming gzip
+static const size_t kBGZFJobBytes = 1 << 22; // uncompressed bytes per group of BGZF blocks
+static const size_t kBGZFHeader = 18;        // size of a BGZF header with only the BC field
+static const size_t kBGZFMaxBlock = 1 << 16;
+
+static inline uint16_t LittleEndian16(const unsigned char* p){
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static inline uint32_t LittleEndian32(const unsigned char* p){
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+bool IsGzip(const char* data, size_t length){
+    return length >= 2 && (unsigned char)data[0] == 0x1f && (unsigned char)data[1] == 0x8b;
+}
+
+// Returns the total size of the BGZF block starting at p (BSIZE + 1), or 0 if p does
+// not start a BGZF block. Needs the first 12 + XLEN bytes of the block.
+static size_t BGZFBlockSize(const unsigned char* p, size_t length){
+    if (length < 12 || p[0] != 0x1f || p[1] != 0x8b || p[2] != 8 || !(p[3] & 4))
+        return 0;
+    size_t xlen = LittleEndian16(p + 10);
+    if (length < 12 + xlen)
+        return 0;
+    // look for the BC subfield among the extra fields
+    const unsigned char* field = p + 12;
+    const unsigned char* end = field + xlen;
+    while (field + 4 <= end){
+        size_t slen = LittleEndian16(field + 2);
+        if (field[0] == 'B' && field[1] == 'C' && slen == 2 && field + 6 <= end)
+            return (size_t)LittleEndian16(field + 4) + 1;
+        field += 4 + slen;
+    }
+    return 0;
+}
+
+bool IsBGZF(const char* data, size_t length){
+    return BGZFBlockSize((const unsigned char*)data, length) != 0;
+}
+
+
+GzipSource::GzipSource(ByteSource* input) : _input(input), _in(kGzipInput), _input_done(false), _stream_done(false){
+    memset(&_stream, 0, sizeof(_stream));
+    // 15 + 16: zlib window with gzip header decoding
+    inflateInit2(&_stream, 15 + 16);
+}
+
+GzipSource::~GzipSource(){
+    inflateEnd(&_stream);
+    delete _input;
+}
+
+long GzipSource::read(char* buffer, size_t capacity){
+    _stream.next_out = (Bytef*)buffer;
+    _stream.avail_out = capacity;
+
+    while (_stream.avail_out == capacity){
+        if (_stream.avail_in == 0 && !_input_done){
+            long n = _input->read((char*)_in.data(), _in.size());
+            if (n < 0)
+                return -1;
+            if (n == 0)
+                _input_done = true;
+            _stream.next_in = _in.data();
+            _stream.avail_in = n;
+        }
+        if (_stream_done){
+            // the previous member ended; start the next one if there is more input
+            if (_stream.avail_in == 0 && _input_done)
+                break;
+            inflateReset(&_stream);
+            _stream_done = false;
+        }
+        if (_stream.avail_in == 0 && _input_done){
+            std::cerr<<"Error decompressing gzip input: unexpected end of file"<<std::endl;
+            return -1;
+        }
+
+        int status = inflate(&_stream, Z_NO_FLUSH);
+        if (status == Z_STREAM_END){
+            _stream_done = true;
+        } else if (status != Z_OK && status != Z_BUF_ERROR){
+            std::cerr<<"Error decompressing gzip input: "<<(_stream.msg ? _stream.msg : "corrupt data")<<std::endl;
+            return -1;
+        }
+    }
+    return (long)(capacity - _stream.avail_out);
+}
+
+
+BGZFSource::BGZFSource(ByteSource* input, int threads) :
+    _input(input), _work(2*std::max(threads, 1)), _max_jobs(4*std::max(threads, 1)), _total(0), _dispatching(true),
+    _failed(false), _stopping(false), _current(NULL), _current_offset(0), _next_id(0){
+    threads = std::max(threads, 1);
+    _threads.push_back(std::thread(&BGZFSource::dispatch, this));
+    for (int t = 0; t < threads; t++)
+        _threads.push_back(std::thread(&BGZFSource::inflateJobs, this));
+}
+
+BGZFSource::~BGZFSource(){
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stopping = true;
+        _cv.notify_all();
+    }
+    _work.close();
+    for (size_t t = 0; t < _threads.size(); t++)
+        _threads[t].join();
+    for (std::map<size_t, Job*>::iterator it = _done.begin(); it != _done.end(); ++it)
+        delete it->second;
+    delete _current;
+    delete _input;
+}
+
+bool BGZFSource::readFully(unsigned char* buffer, size_t length, size_t& got){
+    got = 0;
+    while (got < length){
+        long n = _input->read((char*)buffer + got, length - got);
+        if (n < 0)
+            return false;
+        if (n == 0)
+            break;
+        got += n;
+    }
+    return true;
+}
+
+void BGZFSource::dispatch(){
+    // Cut the compressed input into groups of whole blocks. Only the block headers are
+    // parsed here; the inflate threads do the real work.
+    size_t id = 0;
+    bool ok = true;
+    bool more = true;
+    while (more && ok){
+        Job* job = new Job();
+        job->id = id;
+        job->ok = true;
+        size_t uncompressed = 0;
+        while (uncompressed < kBGZFJobBytes){
+            size_t start = job->compressed.size();
+            job->compressed.resize(start + kBGZFHeader);
+            size_t got;
+            if (!readFully(job->compressed.data() + start, kBGZFHeader, got)){ ok = false; break; }
+            if (got == 0){
+                job->compressed.resize(start);
+                more = false;
+                break;
+            }
+            size_t block_size = BGZFBlockSize(job->compressed.data() + start, got);
+            if (got < kBGZFHeader || block_size < kBGZFHeader + 8 || block_size > kBGZFMaxBlock){
+                std::cerr<<"Error decompressing BGZF input: invalid block header"<<std::endl;
+                ok = false;
+                break;
+            }
+            job->compressed.resize(start + block_size);
+            if (!readFully(job->compressed.data() + start + kBGZFHeader, block_size - kBGZFHeader, got) || got != block_size - kBGZFHeader){
+                std::cerr<<"Error decompressing BGZF input: truncated block"<<std::endl;
+                ok = false;
+                break;
+            }
+            uncompressed += LittleEndian32(job->compressed.data() + start + block_size - 4);
+        }
+        if (!ok || job->compressed.empty()){
+            delete job;
+            break;
+        }
+        {
+            // do not get more than a few groups ahead of the consumer
+            std::unique_lock<std::mutex> lock(_mutex);
+            _cv.wait(lock, [&]{ return _stopping || id < _next_id + _max_jobs; });
+            if (_stopping){
+                delete job;
+                break;
+            }
+        }
+        if (!_work.push(job)){
+            delete job;
+            break;
+        }
+        id++;
+    }
+    _work.close();
+    std::lock_guard<std::mutex> lock(_mutex);
+    _total = id;
+    _dispatching = false;
+    if (!ok)
+        _failed = true;
+    _cv.notify_all();
+}
+
+void BGZFSource::inflateJobs(){
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    inflateInit2(&stream, -15); // raw deflate: the block headers are parsed by hand
+
+    Job* job;
+    while (_work.pop(job)){
+        // sizes of all blocks in the group, so the output can be allocated once (a block
+        // never holds more than kBGZFMaxBlock bytes, so a larger ISIZE is corrupt)
+        size_t total = 0;
+        for (size_t p = 0; p < job->compressed.size() && job->ok; p += BGZFBlockSize(job->compressed.data() + p, job->compressed.size() - p)){
+            size_t block_size = BGZFBlockSize(job->compressed.data() + p, job->compressed.size() - p);
+            uint32_t isize = LittleEndian32(job->compressed.data() + p + block_size - 4);
+            if (isize > kBGZFMaxBlock){
+                std::cerr<<"Error decompressing BGZF input: corrupt block"<<std::endl;
+                job->ok = false;
+            }
+            total += isize;
+        }
+        if (job->ok) job->data.resize(total);
+
+        size_t out = 0;
+        for (size_t p = 0; p < job->compressed.size() && job->ok; ){
+            const unsigned char* block = job->compressed.data() + p;
+            size_t block_size = BGZFBlockSize(block, job->compressed.size() - p);
+            size_t header = 12 + LittleEndian16(block + 10);
+            uint32_t crc = LittleEndian32(block + block_size - 8);
+            uint32_t isize = LittleEndian32(block + block_size - 4);
+
+            inflateReset(&stream);
+            stream.next_in = (Bytef*)(block + header);
+            stream.avail_in = block_size - header - 8;
+            stream.next_out = (Bytef*)(job->data.data() + out);
+            stream.avail_out = isize;
+            int status = inflate(&stream, Z_FINISH);
+            if ((status != Z_STREAM_END && !(isize == 0 && status == Z_BUF_ERROR)) || stream.avail_out != 0
+                || crc32(0L, (const Bytef*)(job->data.data() + out), isize) != crc){
+                std::cerr<<"Error decompressing BGZF input: corrupt block"<<std::endl;
+                job->ok = false;
+            }
+            out += isize;
+            p += block_size;
+        }
+        job->compressed.clear();
+        job->compressed.shrink_to_fit();
+
+        std::lock_guard<std::mutex> lock(_mutex);
+        _done[job->id] = job;
+        _cv.notify_all();
+    }
+    inflateEnd(&stream);
+}
+
+long BGZFSource::read(char* buffer, size_t capacity){
+    while (_current == NULL || _current_offset == _current->data.size()){
+        delete _current;
+        _current = NULL;
+        _current_offset = 0;
+
+        std::unique_lock<std::mutex> lock(_mutex);
+        _cv.wait(lock, [this]{ return _done.count(_next_id) || (!_dispatching && _next_id >= _total); });
+        if (!_done.count(_next_id)){
+            // the end of the input, or the dispatcher found a bad block
+            return _failed ? -1 : 0;
+        }
+        _current = _done[_next_id];
+        _done.erase(_next_id);
+        _next_id++;
+        _cv.notify_all();
+        if (!_current->ok)
+            return -1;
+    }
+    size_t n = std::min(capacity, _current->data.size() - _current_offset);
+    memcpy(buffer, _current->data.data() + _current_offset, n);
+    _current_offset += n;
+    return (long)n;
+}
@@ -1,4 +1,5 @@
 #include "MurmurHash.h"
+#include <cstring>
 // MurmurHash2, by Austin Appleby
 
 unsigned int MurmurHash (const void * key, int len, unsigned int seed)
@@ -51,3 +52,50 @@ unsigned int MurmurHash (const void * key, int len, unsigned int seed)
 
 	return h;
 } 
+
+// MurmurHash64A, by Austin Appleby: the 64-bit hash of MurmurHash2, for when 32 bits
+// are too few (e.g. fingerprints of whole reads)
+
+uint64_t MurmurHash64 (const void * key, int len, uint64_t seed)
+{
+	const uint64_t m = 0xc6a4a7935bd1e995ULL;
+	const int r = 47;
+
+	uint64_t h = seed ^ (len * m);
+
+	const unsigned char * data = (const unsigned char *)key;
+	const unsigned char * end = data + (len / 8) * 8;
+
+	while(data != end)
+	{
+		uint64_t k;
+		memcpy(&k, data, sizeof(k)); // (reads are not aligned)
+
+		k *= m; 
+		k ^= k >> r; 
+		k *= m; 
+		
+		h ^= k;
+		h *= m; 
+
+		data += 8;
+	}
+
+	switch(len & 7)
+	{
+	case 7: h ^= uint64_t(data[6]) << 48;
+	case 6: h ^= uint64_t(data[5]) << 40;
+	case 5: h ^= uint64_t(data[4]) << 32;
+	case 4: h ^= uint64_t(data[3]) << 24;
+	case 3: h ^= uint64_t(data[2]) << 16;
+	case 2: h ^= uint64_t(data[1]) << 8;
+	case 1: h ^= uint64_t(data[0]);
+	        h *= m;
+	};
+
+	h ^= h >> r;
+	h *= m;
+	h ^= h >> r;
+
+	return h;
+}
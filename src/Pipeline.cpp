@@ -0,0 +1,219 @@
+#include "Pipeline.h"
+#include "MurmurHash.h"
+#include "BoundedQueue.h"
+#include "util.h"
+
+#include <map>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+/*
+Copyright 2019, Benjamin Coleman, All rights reserved.
+Free for research use. For commercial use, contact
+Rice University Invention & Patent or the author
+
+*/
+
+static const size_t kArenaBlock = 1 << 20;
+
+
+void ReadBatch::clear(){
+    size = 0;
+    records1.clear();
+    records2.clear();
+    kde.clear();
+    duplicates = 0;
+    _block = 0;
+    _used = 0;
+}
+
+static inline SequenceView Rebase(const SequenceView& view, const char* from, const char* to){
+    if (view.data == NULL)
+        return view;
+    return SequenceView(to + (view.data - from), view.length);
+}
+
+SequenceRecord ReadBatch::copy(const SequenceRecord& record){
+    size_t length = record.chunk.length;
+    // find a block with enough room, adding one if needed
+    while (_block < _blocks.size() && _used + length > _blocks[_block].size()){
+        _block++;
+        _used = 0;
+    }
+    if (_block == _blocks.size()){
+        _blocks.push_back(std::vector<char>(std::max(kArenaBlock, length)));
+        _used = 0;
+    }
+    char* destination = _blocks[_block].data() + _used;
+    std::copy(record.chunk.data, record.chunk.data + length, destination);
+    _used += length;
+
+    SequenceRecord copied = record;
+    const char* from = record.chunk.data;
+    copied.header = Rebase(record.header, from, destination);
+    copied.sequence = Rebase(record.sequence, from, destination);
+    copied.plus = Rebase(record.plus, from, destination);
+    copied.quality = Rebase(record.quality, from, destination);
+    copied.chunk = SequenceView(destination, length);
+    return copied;
+}
+
+
+BatchHasher::BatchHasher(int reps, int hashes, int k, MinHashEngine engine) :
+    _reps(reps), _hashes(hashes), _k(k), _engine(engine), _minhash(reps*hashes, engine), _cache(NULL), _raw_hashes(reps*hashes) {}
+
+uint64_t BatchHasher::tag() const {
+    int parameters[4] = {_reps, _hashes, _k, (int)_engine};
+    uint64_t low = MurmurHash(parameters, sizeof(parameters), 0x5EED);
+    uint64_t high = MurmurHash(parameters, sizeof(parameters), 0x7A6);
+    return ((high << 32) | low) | 1;
+}
+
+bool BatchHasher::hash(const SequenceView& sequence, int* rehashes){
+    if (_cache && _cache->find(sequence, rehashes))
+        return true;
+    _minhash.getHash(_k, sequence.data, sequence.length, _raw_hashes.data());
+    rehash(_raw_hashes.data(), rehashes, _reps, _hashes);
+    if (_cache)
+        _cache->insert(sequence, rehashes);
+    return false;
+}
+
+void BatchHasher::hash(ReadBatch& batch, StageTimes* times){
+    batch.rehashes.resize(batch.size * _reps);
+    if (times == NULL){
+        for (size_t i = 0; i < batch.size; i++){
+            batch.duplicates += hash(batch.records1[i].sequence, batch.rehashes.data() + i*_reps);
+        }
+        return;
+    }
+    // (cache lookups count as MinHash time, and cache insertions as rehash time)
+    size_t n = _reps * _hashes;
+    _batch_hashes.resize(batch.size * n);
+    _cached.assign(batch.size, 0);
+    uint64_t start = StatsClock();
+    for (size_t i = 0; i < batch.size; i++){
+        const SequenceView& sequence = batch.records1[i].sequence;
+        if (_cache && _cache->find(sequence, batch.rehashes.data() + i*_reps)){
+            _cached[i] = 1;
+            batch.duplicates++;
+            continue;
+        }
+        _minhash.getHash(_k, sequence.data, sequence.length, _batch_hashes.data() + i*n);
+    }
+    uint64_t hashed = StatsClock();
+    for (size_t i = 0; i < batch.size; i++){
+        if (_cached[i])
+            continue;
+        rehash(_batch_hashes.data() + i*n, batch.rehashes.data() + i*_reps, _reps, _hashes);
+        if (_cache)
+            _cache->insert(batch.records1[i].sequence, batch.rehashes.data() + i*_reps);
+    }
+    times->ns[STAGE_MINHASH] += hashed - start;
+    times->ns[STAGE_REHASH] += StatsClock() - hashed;
+}
+
+
+Pipeline::Pipeline(int threads, size_t batch_size){
+    _threads = (threads < 1) ? 1 : threads;
+    _batch_size = batch_size;
+}
+
+bool Pipeline::runSerial(ReadStage& read, WorkStage& work, CommitStage& commit){
+    ReadBatch batch;
+    bool more = true;
+    for (size_t id = 0; more; id++){
+        batch.clear();
+        batch.id = id;
+        more = read(batch);
+        if (batch.size == 0)
+            break;
+        work(batch, 0);
+        if (!commit(batch))
+            return false;
+    }
+    return true;
+}
+
+bool Pipeline::run(ReadStage read, WorkStage work, CommitStage commit){
+    if (_threads == 1)
+        return runSerial(read, work, commit);
+
+    // A fixed pool of batches circulates free -> read -> work -> commit -> free, which
+    // bounds memory and keeps the reader at most a few batches ahead of the commit.
+    size_t pool_size = 2*_threads + 2;
+    std::vector<ReadBatch> pool(pool_size);
+    BoundedQueue<ReadBatch*> free_batches(pool_size);
+    BoundedQueue<ReadBatch*> work_batches(pool_size);
+    for (size_t i = 0; i < pool_size; i++)
+        free_batches.push(&pool[i]);
+
+    // finished batches wait here until all earlier batches are committed
+    std::mutex done_mutex;
+    std::condition_variable done_cv;
+    std::map<size_t, ReadBatch*> done;
+    size_t total = 0;
+    bool reading = true;
+
+    std::thread reader([&](){
+        ReadBatch* batch;
+        size_t id = 0;
+        bool more = true;
+        while (more && free_batches.pop(batch)){
+            batch->clear();
+            batch->id = id;
+            more = read(*batch);
+            if (batch->size == 0)
+                break;
+            if (!work_batches.push(batch))
+                break;
+            id++;
+        }
+        work_batches.close();
+        std::lock_guard<std::mutex> lock(done_mutex);
+        total = id;
+        reading = false;
+        done_cv.notify_all();
+    });
+
+    std::vector<std::thread> workers;
+    for (int w = 0; w < _threads; w++){
+        workers.push_back(std::thread([&, w](){
+            ReadBatch* batch;
+            while (work_batches.pop(batch)){
+                work(*batch, w);
+                std::lock_guard<std::mutex> lock(done_mutex);
+                done[batch->id] = batch;
+                done_cv.notify_all();
+            }
+        }));
+    }
+
+    bool success = true;
+    for (size_t id = 0; ; id++){
+        ReadBatch* batch = NULL;
+        {
+            std::unique_lock<std::mutex> lock(done_mutex);
+            done_cv.wait(lock, [&]{ return done.count(id) || (!reading && id >= total); });
+            if (!done.count(id))
+                break;
+            batch = done[id];
+            done.erase(id);
+        }
+        if (!commit(*batch)){
+            success = false;
+            break;
+        }
+        free_batches.push(batch);
+    }
+
+    // on failure, unblock the reader and the workers so they can be joined
+    free_batches.close();
+    work_batches.close();
+    reader.join();
+    for (size_t w = 0; w < workers.size(); w++)
+        workers[w].join();
+    return success;
+}
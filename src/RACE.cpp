@@ -8,8 +8,20 @@
 
 #include <cstdint>
 #include <cstring>
+#include <cstdlib>
 
 #include <limits>
+#include <algorithm>
+#include <new>
+#include <vector>
+#include <fstream>
+#include <cerrno>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
 
 /*
 Copyright 2019, Benjamin Coleman, All rights reserved. 
@@ -19,31 +31,293 @@ Rice University Invention & Patent or the author
 */
 
 
-RACE::RACE(size_t R, size_t range){
+// How many reads ahead the batched query_and_add requests counters. Each read has up 
+// to R cache misses, so a few reads are enough to keep the memory system busy. 
+static const size_t kPrefetchReads = 4; 
+
+// 8- and 16-bit counters saturate at their maximum; 32-bit counters wrap like the 
+// original sketch did 
+template <typename Counter>
+static inline Counter Increment(Counter value){
+	if (sizeof(Counter) < sizeof(uint32_t))
+		return value + (value != std::numeric_limits<Counter>::max()); 
+	return value + 1; 
+}
+
+// Sum of two counters, saturating like Increment 
+template <typename Counter>
+static inline Counter Add(Counter a, Counter b){
+	if (sizeof(Counter) < sizeof(uint32_t) && (uint32_t)a + b > std::numeric_limits<Counter>::max())
+		return std::numeric_limits<Counter>::max(); 
+	return a + b; 
+}
+
+// A saturated counter has lost its true count, so it is left alone 
+template <typename Counter>
+static inline Counter Decrement(Counter value){
+	if (sizeof(Counter) < sizeof(uint32_t) && value == std::numeric_limits<Counter>::max())
+		return value; 
+	return value - 1; 
+}
+
+template <typename Counter>
+static inline Counter Subtract(Counter a, Counter b){
+	if (sizeof(Counter) < sizeof(uint32_t) && a == std::numeric_limits<Counter>::max())
+		return a; 
+	return (b < a) ? a - b : 0; 
+}
+
+
+// Version 2 sketch files (see SketchFileHeader) 
+
+static uint8_t NativeByteOrder(){
+	uint32_t n = 1; 
+	return *(uint8_t*)(&n) ? SKETCH_LITTLE_ENDIAN : SKETCH_BIG_ENDIAN; 
+}
+
+static uint32_t SketchChecksum(const void* data, size_t bytes){
+	// zlib's crc32 takes 32-bit lengths 
+	uLong crc = crc32(0L, Z_NULL, 0); 
+	const Bytef* p = (const Bytef*)data; 
+	while (bytes > 0){
+		uInt n = (uInt)std::min(bytes, (size_t)1 << 30); 
+		crc = crc32(crc, p, n); 
+		p += n; 
+		bytes -= n; 
+	}
+	return (uint32_t)crc; 
+}
+
+static void WriteSketchFile(std::ostream& out, uint8_t layout, size_t counter_bytes, size_t R, size_t range, size_t counters, const void* data, uint64_t hash_tag){
+	SketchFileHeader header; 
+	memset(&header, 0, sizeof(header)); 
+	header.magic = 0x4D; 
+	header.version = 2; 
+	header.byte_order = NativeByteOrder(); 
+	header.counter_bytes = counter_bytes; 
+	header.layout = layout; 
+	header.R = R; 
+	header.range = range; 
+	header.counters = counters; 
+	header.checksum = SketchChecksum(data, counters*counter_bytes); 
+	header.hash_tag = hash_tag; 
+	out.write(reinterpret_cast<const char *>(&header), sizeof(header)); 
+	out.write(reinterpret_cast<const char *>(data), counters*counter_bytes); 
+}
+
+// Converts the fields of a version 2 header to the native byte order and checks them 
+static bool FixSketchHeader(SketchFileHeader& header){
+	if (header.byte_order != SKETCH_LITTLE_ENDIAN && header.byte_order != SKETCH_BIG_ENDIAN){
+		std::cerr<<"Invalid byte order in sketch file"<<std::endl; 
+		return false; 
+	}
+	if (header.byte_order != NativeByteOrder()){
+		header.R = __builtin_bswap64(header.R); 
+		header.range = __builtin_bswap64(header.range); 
+		header.counters = __builtin_bswap64(header.counters); 
+		header.checksum = __builtin_bswap32(header.checksum); 
+		header.hash_tag = __builtin_bswap64(header.hash_tag); 
+	}
+	if (header.counter_bytes != 1 && header.counter_bytes != 2 && header.counter_bytes != 4){
+		std::cerr<<"Invalid counter width in sketch file"<<std::endl; 
+		return false; 
+	}
+	if (header.layout != SKETCH_LAYOUT_ROWS && header.layout != SKETCH_LAYOUT_BLOCKED){
+		std::cerr<<"Invalid layout in sketch file"<<std::endl; 
+		return false; 
+	}
+	return true; 
+}
+
+// Bytes between the position of in and its end, or the largest value if in cannot seek 
+static uint64_t RemainingBytes(std::istream& in){
+	std::streampos position = in.tellg(); 
+	if (position < 0)
+		return UINT64_MAX; 
+	in.seekg(0, std::ios::end); 
+	std::streampos end = in.tellg(); 
+	in.seekg(position); 
+	return (end < position) ? 0 : (uint64_t)(end - position); 
+}
+
+// Reads the rest of a version 2 header, after the magic number and version, and checks 
+// that the file holds the counters it claims 
+static bool ReadSketchHeader(std::istream& in, SketchFileHeader& header){
+	in.read(reinterpret_cast<char *>(&header) + 2, sizeof(header) - 2); 
+	if (!in){
+		std::cerr<<"Truncated sketch file"<<std::endl; 
+		return false; 
+	}
+	if (!FixSketchHeader(header))
+		return false; 
+	if (RemainingBytes(in)/header.counter_bytes < header.counters){
+		std::cerr<<"Truncated sketch file"<<std::endl; 
+		return false; 
+	}
+	return true; 
+}
+
+// Reads the counters after a version 2 header. In the common case (same byte order and 
+// width) they are read straight into the sketch; otherwise they are converted, and wider 
+// counters saturate at the maximum of Counter. 
+template <typename Counter>
+static bool ReadSketchCounters(std::istream& in, const SketchFileHeader& header, Counter* counters){
+	size_t bytes = header.counters*header.counter_bytes; 
+	bool swap = (header.byte_order != NativeByteOrder()); 
+	if (!swap && header.counter_bytes == sizeof(Counter)){
+		in.read(reinterpret_cast<char *>(counters), bytes); 
+		if (!in){
+			std::cerr<<"Truncated sketch file"<<std::endl; 
+			return false; 
+		}
+		if (SketchChecksum(counters, bytes) != header.checksum){
+			std::cerr<<"Corrupt sketch file (checksum mismatch)"<<std::endl; 
+			return false; 
+		}
+		return true; 
+	}
+
+	std::vector<char> buffer(bytes); 
+	in.read(buffer.data(), bytes); 
+	if (!in){
+		std::cerr<<"Truncated sketch file"<<std::endl; 
+		return false; 
+	}
+	if (SketchChecksum(buffer.data(), bytes) != header.checksum){
+		std::cerr<<"Corrupt sketch file (checksum mismatch)"<<std::endl; 
+		return false; 
+	}
+	for (size_t i = 0; i < header.counters; i++){
+		const char* p = buffer.data() + i*header.counter_bytes; 
+		uint32_t value; 
+		if (header.counter_bytes == 1){
+			value = (uint8_t)*p; 
+		} else if (header.counter_bytes == 2){
+			uint16_t v; 
+			memcpy(&v, p, sizeof(v)); 
+			value = swap ? __builtin_bswap16(v) : v; 
+		} else {
+			memcpy(&value, p, sizeof(value)); 
+			if (swap)
+				value = __builtin_bswap32(value); 
+		}
+		if (value > std::numeric_limits<Counter>::max())
+			value = std::numeric_limits<Counter>::max(); 
+		counters[i] = value; 
+	}
+	return true; 
+}
+
+// Maps a version 2 sketch file written in the native byte order. Returns the mapping 
+// (of map_size bytes, counters after the header), or NULL on error. 
+static void* MapSketchFile(const std::string& path, SketchFileHeader& header, size_t& map_size){
+	int fd = open(path.c_str(), O_RDONLY); 
+	if (fd < 0){
+		std::cerr<<"Could not open sketch file "<<path<<": "<<strerror(errno)<<std::endl; 
+		return NULL; 
+	}
+	struct stat info; 
+	if (fstat(fd, &info) != 0 || info.st_size < (off_t)sizeof(header) || pread(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header)
+		|| header.magic != 0x4D){
+		std::cerr<<"Not a RACE sketch file: "<<path<<std::endl; 
+		close(fd); 
+		return NULL; 
+	}
+	if (header.version != 2 || header.byte_order != NativeByteOrder()){
+		std::cerr<<"Only version 2 sketch files in the byte order of this machine can be mapped: "<<path<<std::endl; 
+		close(fd); 
+		return NULL; 
+	}
+	if (!FixSketchHeader(header)){
+		close(fd); 
+		return NULL; 
+	}
+	map_size = sizeof(header) + header.counters*header.counter_bytes; 
+	if ((uint64_t)info.st_size < map_size){
+		std::cerr<<"Truncated sketch file: "<<path<<std::endl; 
+		close(fd); 
+		return NULL; 
+	}
+	// private mapping: queries read the file, updates go to copies of the pages 
+	void* map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0); 
+	close(fd); 
+	if (map == MAP_FAILED){
+		std::cerr<<"Could not map sketch file "<<path<<": "<<strerror(errno)<<std::endl; 
+		return NULL; 
+	}
+	return map; 
+}
+
+static inline uint64_t BigEndian64(const uint8_t* p){
+	uint64_t value = 0; 
+	for (int i = 0; i < 8; i++)
+		value = (value << 8) | p[i]; 
+	return value; 
+}
+
+template <typename Counter, bool PowerOfTwoRange>
+RACE<Counter, PowerOfTwoRange>::RACE(size_t R, size_t range) : _map(NULL), _map_size(0), 
+	_allocator(&GetSketchAllocator()), _allocated(0){
 	// parameters: R = number of ACE repetitions
 	// range = size of each ACE array 
 	_R = R, 
-	_range = range; 
+	setRange(range); 
 
-	_sketch = new race_sketch_t[ _R*_range ](); 
+	_allocated = bytes(); 
+	_sketch = (Counter*)_allocator->allocate(_allocated); 
 }
 
-RACE::~RACE(){
-	delete[] _sketch; 
+template <typename Counter, bool PowerOfTwoRange>
+RACE<Counter, PowerOfTwoRange>::~RACE(){
+	release(); 
 }
 
-void RACE::add(int *hashes){
+template <typename Counter, bool PowerOfTwoRange>
+void RACE<Counter, PowerOfTwoRange>::release(){
+	if (_map)
+		munmap(_map, _map_size); 
+	else
+		_allocator->deallocate(_sketch, _allocated); 
+	_map = NULL; 
+	_sketch = NULL; 
+	_allocated = 0; 
+}
+
+template <typename Counter, bool PowerOfTwoRange>
+void RACE<Counter, PowerOfTwoRange>::reshape(size_t R, size_t range){
+	if (_map || R*range != _R*_range){
+		release(); 
+		_allocated = R*range*sizeof(Counter); 
+		_sketch = (Counter*)_allocator->allocate(_allocated); 
+	}
+	_R = R; 
+	setRange(range); 
+}
+
+template <typename Counter, bool PowerOfTwoRange>
+void RACE<Counter, PowerOfTwoRange>::setRange(size_t range){
+	_range = range; 
+	_mask = range - 1; 
+	// reciprocal for the multiply-shift remainder of 32-bit values 
+	_reciprocal = UINT64_C(0xFFFFFFFFFFFFFFFF) / range + 1; 
+	// a negative hash h is 2^64 - 2^32 + (uint32_t)h once sign-extended to 64 bits 
+	_negative_offset = UINT64_C(0xFFFFFFFF00000000) % range; 
+}
+
+template <typename Counter, bool PowerOfTwoRange>
+void RACE<Counter, PowerOfTwoRange>::add(const int *hashes){
 	/* 
 	Input: A set of R integer hash values, one hash value for each ACE repetition
 	*/
 	#pragma omp parallel for
 	for (size_t r = 0; r < _R; r++){
-		size_t index = hashes[r] % _range; 
-		_sketch[r*_range + index] = _sketch[r*_range + index] + 1; 
+		size_t index = this->index(hashes[r]); 
+		_sketch[r*_range + index] = Increment(_sketch[r*_range + index]); 
 	}
 }
 
-double RACE::query_and_add(int *hashes){
+template <typename Counter, bool PowerOfTwoRange>
+double RACE<Counter, PowerOfTwoRange>::query_and_add(const int *hashes){
 	/* 
 	Input: A set of R integer hash values, one hash value for each ACE repetition
 	Performs: Update to RACE array
@@ -51,31 +325,51 @@ double RACE::query_and_add(int *hashes){
 	*/
 	double mean = 0; 
 	for (size_t r = 0; r < _R; r++){
-		size_t index = hashes[r] % _range; 
+		size_t index = this->index(hashes[r]); 
 		mean = mean + _sketch[r*_range + index]; 
-		_sketch[r*_range + index] = _sketch[r*_range + index] + 1; 
+		_sketch[r*_range + index] = Increment(_sketch[r*_range + index]); 
 	}
 	mean = mean / _R; 
 	return mean; 
 }
 
 
-void RACE::subtract(int *hashes){
+template <typename Counter, bool PowerOfTwoRange>
+void RACE<Counter, PowerOfTwoRange>::query_and_add(const int *hashes, size_t n, double *results){
+	/* 
+	The counters of read i + kPrefetchReads are requested while read i is updated, so 
+	the cache misses of several reads overlap instead of stalling one after another. 
+	The updates themselves happen in input order, so the results are exactly those of 
+	n calls to query_and_add. 
+	*/
+	size_t ahead = std::min(n, kPrefetchReads); 
+	for (size_t i = 0; i < ahead; i++)
+		prefetch(hashes + i*_R); 
+	for (size_t i = 0; i < n; i++){
+		if (i + kPrefetchReads < n)
+			prefetch(hashes + (i + kPrefetchReads)*_R); 
+		results[i] = RACE::query_and_add(hashes + i*_R); 
+	}
+}
+
+template <typename Counter, bool PowerOfTwoRange>
+void RACE<Counter, PowerOfTwoRange>::subtract(const int *hashes){
 	/*
 	Input: A set of R integer hash values, one hash value for each ACE repetition
 	*/
 	#pragma omp parallel for
 	for (size_t r = 0; r < _R; r++){
-		size_t index = hashes[r] % _range; 
-		_sketch[r*_range + index] = _sketch[r*_range + index] - 1;
+		size_t index = this->index(hashes[r]); 
+		_sketch[r*_range + index] = Decrement(_sketch[r*_range + index]);
 	}
 }
 
-double RACE::query(int *hashes){
+template <typename Counter, bool PowerOfTwoRange>
+double RACE<Counter, PowerOfTwoRange>::query(const int *hashes){
 
 	double mean = 0; 
 	for (size_t r = 0; r < _R; r++){
-		size_t index = hashes[r] % _range;
+		size_t index = this->index(hashes[r]);
 		mean = mean + _sketch[r*_range + index]; 
 	}
 	mean = mean / _R; 
@@ -83,84 +377,107 @@ double RACE::query(int *hashes){
 }
 
 
-void RACE::clear(){
+template <typename Counter, bool PowerOfTwoRange>
+void RACE<Counter, PowerOfTwoRange>::clear(){
 	memset(_sketch, 0, _R*_range*sizeof(*_sketch));
 }
 
+template <typename Counter, bool PowerOfTwoRange>
+bool RACE<Counter, PowerOfTwoRange>::merge(const Sketch& other){
+	const RACE* sketch = dynamic_cast<const RACE*>(&other); 
+	if (sketch == NULL || sketch->_R != _R || sketch->_range != _range){
+		std::cerr<<"Cannot merge RACE sketches of different types or shapes"<<std::endl; 
+		return false; 
+	}
+	for (size_t i = 0; i < _R*_range; i++)
+		_sketch[i] = Add(_sketch[i], sketch->_sketch[i]); 
+	return true; 
+}
 
+template <typename Counter, bool PowerOfTwoRange>
+bool RACE<Counter, PowerOfTwoRange>::unmerge(const Sketch& other){
+	const RACE* sketch = dynamic_cast<const RACE*>(&other); 
+	if (sketch == NULL || sketch->_R != _R || sketch->_range != _range){
+		std::cerr<<"Cannot subtract RACE sketches of different types or shapes"<<std::endl; 
+		return false; 
+	}
+	for (size_t i = 0; i < _R*_range; i++)
+		_sketch[i] = Subtract(_sketch[i], sketch->_sketch[i]); 
+	return true; 
+}
 
-void RACE::serialize(std::ostream &out){
+template <typename Counter, bool PowerOfTwoRange>
+void RACE<Counter, PowerOfTwoRange>::serialize(std::ostream &out){
 	/*
 	Input: A BINARY ostream out. You can open a binary output stream
 	with the flag: std::ios::binary | std::ios::out
-	Format: (Big Endian) 
-	magic_number (uint8_t); file_version_number (uint8_t); R (uint64_t); range (uint64_t);
-	Then every element in the sketch, as a uint32_t
+	Format: version 2 (see SketchFileHeader): the header, then the counters as they 
+	are in memory, row after row 
 	*/
-
-	// 0. Determine if system is big-endian or little-endian 
-	// 1. Write magic numbers and parameters to file 
-	// 2. For each element in sketch, cast element to standard-sized element 
-	// 3. Depending on (1), bitflip so that it is big-endian (network order)
-	// 4. Write to stream 
-
-	// 1. Determine if system is big-endian or little-endian
-	uint32_t n = 1; 
-	bool is_little_endian = *(uint8_t*)(&n);
-
-	// 0. Write magic number and file version. Dont worry about endianness, as these are bytes 
-	out.write(reinterpret_cast <const char *>(&magic_number), sizeof(uint8_t));
-	out.write(reinterpret_cast <const char *>(&file_version_number), sizeof(uint8_t));
-
-	// 0. Write the parameters to the file 
-	uint64_t sketch_param = _R; 
-	if (is_little_endian)
-		sketch_param = __builtin_bswap64(sketch_param);
-    out.write(reinterpret_cast <char *>(&sketch_param), sizeof(uint64_t));
-	
-	sketch_param = _range; 
-	if (is_little_endian)
-		sketch_param = __builtin_bswap64(sketch_param);
-    out.write(reinterpret_cast <char *>(&sketch_param), sizeof(uint64_t));
-
-	// 2. For each element in sketch
-	for (size_t r = 0; r < _R; r++){
-		for (size_t i = 0; i < _range; i++){
-			// 2. Cast element to standard-sized element
-			uint32_t value = _sketch[r*_range + i];
-			// 3. Depending on (1), bitflip so that it is big-endian (network order)
-			if (is_little_endian)
-				value = __builtin_bswap32(value);
-			// 4. Write to stream 
-			out.write(reinterpret_cast <char *>(&value), sizeof(uint32_t));
-		}
-	}
+	WriteSketchFile(out, SKETCH_LAYOUT_ROWS, sizeof(Counter), _R, _range, _R*_range, _sketch, _hash_tag); 
 }
 
 
-void RACE::deserialize(std::istream& in){
+template <typename Counter, bool PowerOfTwoRange>
+bool RACE<Counter, PowerOfTwoRange>::deserialize(std::istream& in){
   	/*   
 	Input: A BINARY istream in. You can open a binary input stream
 	with the flag: std::ios::binary | std::ios::in
-
-	beware: frees sketch
+	Reads version 1 and version 2 files. The counters are reused if the shape does not 
+	change. On error, the sketch is left empty (or unchanged if the header was invalid). 
 	*/
+	uint8_t magic = 0, version = 0;
+	in.read(reinterpret_cast<char *>(&magic), sizeof(uint8_t)); 
+	in.read(reinterpret_cast<char *>(&version), sizeof(uint8_t)); 
+	if (!in || magic != magic_number){
+		std::cerr<<"Not a RACE sketch file (bad magic number)"<<std::endl; 
+		return false; 
+	}
+	if (version == 1)
+		return loadVersion1(in); 
+	if (version != file_version_number){
+		std::cerr<<"Unsupported RACE sketch file version "<<(int)version<<std::endl; 
+		return false; 
+	}
 
-	// 0. Determine if system is little-endian
+	SketchFileHeader header; 
+	header.magic = magic; 
+	header.version = version; 
+	if (!ReadSketchHeader(in, header))
+		return false; 
+	if (header.layout != SKETCH_LAYOUT_ROWS || header.counters != header.R*header.range){
+		std::cerr<<"The sketch file does not hold a RACE sketch with the row layout"<<std::endl; 
+		return false; 
+	}
+	if (PowerOfTwoRange && !IsPowerOfTwo(header.range)){
+		std::cerr<<"Cannot load a sketch with range "<<header.range<<" into a power-of-two RACE"<<std::endl; 
+		return false; 
+	}
+	reshape(header.R, header.range); 
+	if (!ReadSketchCounters(in, header, _sketch)){
+		clear(); 
+		return false; 
+	}
+	_hash_tag = header.hash_tag; 
+	return true; 
+}
+
+template <typename Counter, bool PowerOfTwoRange>
+bool RACE<Counter, PowerOfTwoRange>::loadVersion1(std::istream& in){
+	/*
+	Version 1 format: (Big Endian) magic_number (uint8_t); file_version_number (uint8_t); 
+	R (uint64_t); range (uint64_t); then every element in the sketch, as a uint32_t 
+	*/
 	uint32_t n = 1;
 	bool is_little_endian = *(uint8_t*)(&n);
 
-	uint8_t magic, version;
 	uint64_t R, range;
-
-	in.read(reinterpret_cast<char *>(&magic), sizeof(uint8_t)); 
-	in.read(reinterpret_cast<char *>(&version), sizeof(uint8_t)); 
-	
-	if (magic != magic_number)
-		return;
-
 	in.read(reinterpret_cast<char *>(&R), sizeof(uint64_t));
 	in.read(reinterpret_cast<char *>(&range), sizeof(uint64_t));
+	if (!in){
+		std::cerr<<"Truncated sketch file"<<std::endl; 
+		return false; 
+	}
 
 	// fix endian-ness of parameters
 	if (is_little_endian){
@@ -168,37 +485,662 @@ void RACE::deserialize(std::istream& in){
 		range = __builtin_bswap64(range);
 	}
 
-	_R = R; _range = range; 
-	uint32_t* recovered_sketch = new uint32_t[_R*_range]; 
-
-	// now read the sketch into recovered_sketch
-	in.read(reinterpret_cast <char *>(recovered_sketch), _R*_range*sizeof(uint32_t));
+	if (PowerOfTwoRange && !IsPowerOfTwo(range)){
+		std::cerr<<"Cannot load a sketch with range "<<range<<" into a power-of-two RACE"<<std::endl; 
+		return false; 
+	}
+	// before anything is allocated for the shape the file claims 
+	if (R == 0 || range == 0 || RemainingBytes(in)/4/R < range){
+		std::cerr<<"Truncated sketch file"<<std::endl; 
+		return false; 
+	}
 
-	delete[] _sketch;
-	_sketch = new unsigned int[_R *_range];
+	reshape(R, range); 
+	for (size_t i = 0; i < _R*_range; i++){
+		uint32_t value; 
+		in.read(reinterpret_cast <char *>(&value), sizeof(uint32_t));
+		if (is_little_endian)
+			value = __builtin_bswap32(value);
+		// saturate narrow counters 
+		if (value > std::numeric_limits<Counter>::max())
+			value = std::numeric_limits<Counter>::max(); 
+		_sketch[i] = value;
+	}
+	if (!in){
+		std::cerr<<"Truncated sketch file"<<std::endl; 
+		clear(); 
+		return false; 
+	}
+	_hash_tag = 0; 
+	return true; 
+}
 
-	for (size_t r = 0; r < _R; r++){
-		for (size_t i = 0; i < _range; i++){
-			uint32_t value = recovered_sketch[r*_range + i];
-			// 3. Depending on (1), bitflip so that it is big-endian (network order)
-			if (is_little_endian)
-				value = __builtin_bswap32(value);
-			// 4. Save to our sketch 
-			_sketch[r*_range + i] = value;
-		}
+template <typename Counter, bool PowerOfTwoRange>
+bool RACE<Counter, PowerOfTwoRange>::map(const std::string& path){
+	SketchFileHeader header; 
+	size_t map_size; 
+	void* map = MapSketchFile(path, header, map_size); 
+	if (map == NULL)
+		return false; 
+	if (header.layout != SKETCH_LAYOUT_ROWS || header.counter_bytes != sizeof(Counter) || header.counters != header.R*header.range
+		|| (PowerOfTwoRange && !IsPowerOfTwo(header.range))){
+		std::cerr<<"The sketch file "<<path<<" does not match this sketch (layout, counter width or range)"<<std::endl; 
+		munmap(map, map_size); 
+		return false; 
 	}
-	delete[] recovered_sketch; 
+	release(); 
+	_R = header.R; 
+	setRange(header.range); 
+	_sketch = reinterpret_cast<Counter*>((char*)map + sizeof(SketchFileHeader)); 
+	_map = map; 
+	_map_size = map_size; 
+	_hash_tag = header.hash_tag; 
+	return true; 
 }
 
-void RACE::pprint(std::ostream& out, int width, bool format){
+template <typename Counter, bool PowerOfTwoRange>
+void RACE<Counter, PowerOfTwoRange>::pprint(std::ostream& out, int width, bool format){
 	for (size_t r = 0; r < _R; r++){
 		if (format)
 			out << std::string((width+1)*_range + 1, '-') << std::endl; 
 		for (size_t i = 0; i < _range; i++)
-			out << '|' << std::setw(width) << _sketch[r*_range + i];
+			out << '|' << std::setw(width) << (uint32_t)_sketch[r*_range + i];
 		out << '|' << std::endl; 
 	}
 	if (format)
 		out << std::string((width+1)*_range + 1, '-') << std::endl; 
 }
 
+
+// fewest counters a row gets inside a block of BlockedRACE 
+static const size_t kMinBlockSlots = 4; 
+
+template <typename Counter>
+BlockedRACE<Counter>::BlockedRACE(size_t R, size_t range) : _sketch(NULL), _map(NULL), _map_size(0), 
+	_allocator(&GetSketchAllocator()), _allocated(0){
+	setShape(R, range); 
+	allocate(); 
+}
+
+template <typename Counter>
+BlockedRACE<Counter>::~BlockedRACE(){
+	release(); 
+}
+
+template <typename Counter>
+void BlockedRACE<Counter>::release(){
+	if (_map)
+		munmap(_map, _map_size); 
+	else
+		_allocator->deallocate(_sketch, _allocated); 
+	_map = NULL; 
+	_sketch = NULL; 
+	_allocated = 0; 
+}
+
+template <typename Counter>
+void BlockedRACE<Counter>::setShape(size_t R, size_t range){
+	_R = R; 
+	_range = range; 
+	// as many rows per block as leaves each row kMinBlockSlots counters, spread evenly 
+	// over the groups (R = 10 with 32-bit counters: groups of 4, 3 and 3 rows) 
+	size_t max_rows = std::min(R, std::max(kCountersPerLine / kMinBlockSlots, (size_t)1)); 
+	_groups = (R + max_rows - 1) / max_rows; 
+	_group_rows = (R + _groups - 1) / _groups; 
+	_slots = kCountersPerLine / _group_rows; 
+	// the same number of counters as a RACE with this R and range 
+	_blocks = std::max((R*range + _groups*kCountersPerLine - 1) / (_groups*kCountersPerLine), (size_t)1); 
+	_reciprocal = UINT64_C(0xFFFFFFFFFFFFFFFF) / _blocks + 1; 
+	_negative_offset = UINT64_C(0xFFFFFFFF00000000) % _blocks; 
+}
+
+template <typename Counter>
+void BlockedRACE<Counter>::allocate(){
+	release(); 
+	// (zeroed, and aligned to cache lines) 
+	_allocated = bytes(); 
+	_sketch = (Counter*)_allocator->allocate(_allocated); 
+}
+
+template <typename Counter>
+void BlockedRACE<Counter>::add(const int *hashes){
+	for (size_t g = 0; g < _groups; g++){
+		Counter* line = block(hashes, g); 
+		size_t first = g*_group_rows; 
+		size_t last = std::min(first + _group_rows, _R); 
+		for (size_t r = first; r < last; r++){
+			Counter& counter = line[(r - first)*_slots + slot(hashes[r])]; 
+			counter = Increment(counter); 
+		}
+	}
+}
+
+template <typename Counter>
+double BlockedRACE<Counter>::query_and_add(const int *hashes){
+	double mean = 0; 
+	for (size_t g = 0; g < _groups; g++){
+		Counter* line = block(hashes, g); 
+		size_t first = g*_group_rows; 
+		size_t last = std::min(first + _group_rows, _R); 
+		for (size_t r = first; r < last; r++){
+			Counter& counter = line[(r - first)*_slots + slot(hashes[r])]; 
+			mean = mean + counter; 
+			counter = Increment(counter); 
+		}
+	}
+	mean = mean / _R; 
+	return mean; 
+}
+
+template <typename Counter>
+void BlockedRACE<Counter>::query_and_add(const int *hashes, size_t n, double *results){
+	// as for RACE, but there is only one cache line to request per group of rows 
+	size_t ahead = std::min(n, kPrefetchReads); 
+	for (size_t i = 0; i < ahead; i++)
+		prefetch(hashes + i*_R); 
+	for (size_t i = 0; i < n; i++){
+		if (i + kPrefetchReads < n)
+			prefetch(hashes + (i + kPrefetchReads)*_R); 
+		results[i] = BlockedRACE::query_and_add(hashes + i*_R); 
+	}
+}
+
+template <typename Counter>
+void BlockedRACE<Counter>::subtract(const int *hashes){
+	for (size_t g = 0; g < _groups; g++){
+		Counter* line = block(hashes, g); 
+		size_t first = g*_group_rows; 
+		size_t last = std::min(first + _group_rows, _R); 
+		for (size_t r = first; r < last; r++){
+			Counter& counter = line[(r - first)*_slots + slot(hashes[r])]; 
+			counter = Decrement(counter); 
+		}
+	}
+}
+
+template <typename Counter>
+double BlockedRACE<Counter>::query(const int *hashes){
+	double mean = 0; 
+	for (size_t g = 0; g < _groups; g++){
+		Counter* line = block(hashes, g); 
+		size_t first = g*_group_rows; 
+		size_t last = std::min(first + _group_rows, _R); 
+		for (size_t r = first; r < last; r++)
+			mean = mean + line[(r - first)*_slots + slot(hashes[r])]; 
+	}
+	mean = mean / _R; 
+	return mean; 
+}
+
+template <typename Counter>
+void BlockedRACE<Counter>::clear(){
+	memset(_sketch, 0, bytes()); 
+}
+
+template <typename Counter>
+bool BlockedRACE<Counter>::merge(const Sketch& other){
+	const BlockedRACE* sketch = dynamic_cast<const BlockedRACE*>(&other); 
+	if (sketch == NULL || sketch->_R != _R || sketch->_range != _range){
+		std::cerr<<"Cannot merge RACE sketches of different types or shapes"<<std::endl; 
+		return false; 
+	}
+	size_t counters = _groups*_blocks*kCountersPerLine; 
+	for (size_t i = 0; i < counters; i++)
+		_sketch[i] = Add(_sketch[i], sketch->_sketch[i]); 
+	return true; 
+}
+
+template <typename Counter>
+bool BlockedRACE<Counter>::unmerge(const Sketch& other){
+	const BlockedRACE* sketch = dynamic_cast<const BlockedRACE*>(&other); 
+	if (sketch == NULL || sketch->_R != _R || sketch->_range != _range){
+		std::cerr<<"Cannot subtract RACE sketches of different types or shapes"<<std::endl; 
+		return false; 
+	}
+	size_t counters = _groups*_blocks*kCountersPerLine; 
+	for (size_t i = 0; i < counters; i++)
+		_sketch[i] = Subtract(_sketch[i], sketch->_sketch[i]); 
+	return true; 
+}
+
+template <typename Counter>
+void BlockedRACE<Counter>::serialize(std::ostream &out){
+	WriteSketchFile(out, SKETCH_LAYOUT_BLOCKED, sizeof(Counter), _R, _range, _groups*_blocks*kCountersPerLine, _sketch, _hash_tag); 
+}
+
+template <typename Counter>
+bool BlockedRACE<Counter>::deserialize(std::istream& in){
+	uint8_t magic = 0, version = 0;
+	in.read(reinterpret_cast<char *>(&magic), sizeof(uint8_t)); 
+	in.read(reinterpret_cast<char *>(&version), sizeof(uint8_t)); 
+	if (in && magic == blocked_v1_magic_number && version == 1)
+		return loadVersion1(in); 
+	if (!in || magic != magic_number){
+		std::cerr<<"Not a RACE sketch file (bad magic number)"<<std::endl; 
+		return false; 
+	}
+	if (version != file_version_number){
+		std::cerr<<"Unsupported blocked RACE sketch file version "<<(int)version<<std::endl; 
+		return false; 
+	}
+
+	SketchFileHeader header; 
+	header.magic = magic; 
+	header.version = version; 
+	if (!ReadSketchHeader(in, header))
+		return false; 
+	if (header.layout != SKETCH_LAYOUT_BLOCKED){
+		std::cerr<<"The sketch file does not hold a blocked RACE sketch"<<std::endl; 
+		return false; 
+	}
+	// the geometry depends on the counter width, so the widths have to agree 
+	if (header.counter_bytes != sizeof(Counter)){
+		std::cerr<<"Cannot load a blocked sketch with "<<8*(int)header.counter_bytes<<"-bit counters into one with "
+			<<8*sizeof(Counter)<<"-bit counters"<<std::endl; 
+		return false; 
+	}
+	size_t old_bytes = bytes(); 
+	size_t old_R = _R, old_range = _range; 
+	setShape(header.R, header.range); 
+	if (header.counters != _groups*_blocks*kCountersPerLine){
+		std::cerr<<"Corrupt sketch file (wrong number of counters)"<<std::endl; 
+		setShape(old_R, old_range); 
+		return false; 
+	}
+	if (_map || bytes() != old_bytes)
+		allocate(); 
+	if (!ReadSketchCounters(in, header, _sketch)){
+		clear(); 
+		return false; 
+	}
+	_hash_tag = header.hash_tag; 
+	return true; 
+}
+
+template <typename Counter>
+bool BlockedRACE<Counter>::loadVersion1(std::istream& in){
+	uint32_t n = 1;
+	bool is_little_endian = *(uint8_t*)(&n);
+
+	uint8_t width = 0;
+	uint64_t R, range;
+	in.read(reinterpret_cast<char *>(&width), sizeof(uint8_t)); 
+	if (width != sizeof(Counter)){
+		std::cerr<<"Cannot load a blocked sketch with "<<8*(int)width<<"-bit counters into one with "
+			<<8*sizeof(Counter)<<"-bit counters"<<std::endl; 
+		return false; 
+	}
+	in.read(reinterpret_cast<char *>(&R), sizeof(uint64_t));
+	in.read(reinterpret_cast<char *>(&range), sizeof(uint64_t));
+	if (!in){
+		std::cerr<<"Truncated sketch file"<<std::endl; 
+		return false; 
+	}
+	if (is_little_endian){
+		R = __builtin_bswap64(R); 
+		range = __builtin_bswap64(range);
+	}
+
+	// (the blocks hold at least R*range counters) 
+	uint64_t remaining = RemainingBytes(in); 
+	if (R == 0 || range == 0 || remaining/4/R < range){
+		std::cerr<<"Truncated sketch file"<<std::endl; 
+		return false; 
+	}
+	size_t old_R = _R, old_range = _range; 
+	setShape(R, range); 
+	size_t counters = _groups*_blocks*kCountersPerLine; 
+	if (remaining/4 < counters){
+		std::cerr<<"Truncated sketch file"<<std::endl; 
+		setShape(old_R, old_range); 
+		return false; 
+	}
+	allocate(); 
+	for (size_t i = 0; i < counters; i++){
+		uint32_t value; 
+		in.read(reinterpret_cast<char *>(&value), sizeof(uint32_t));
+		if (is_little_endian)
+			value = __builtin_bswap32(value);
+		_sketch[i] = value; 
+	}
+	if (!in){
+		std::cerr<<"Truncated sketch file"<<std::endl; 
+		clear(); 
+		return false; 
+	}
+	_hash_tag = 0; 
+	return true; 
+}
+
+template <typename Counter>
+bool BlockedRACE<Counter>::map(const std::string& path){
+	SketchFileHeader header; 
+	size_t map_size; 
+	void* map = MapSketchFile(path, header, map_size); 
+	if (map == NULL)
+		return false; 
+	size_t old_R = _R, old_range = _range; 
+	setShape(header.R, header.range); 
+	if (header.layout != SKETCH_LAYOUT_BLOCKED || header.counter_bytes != sizeof(Counter) || header.counters != _groups*_blocks*kCountersPerLine){
+		std::cerr<<"The sketch file "<<path<<" does not match this sketch (layout or counter width)"<<std::endl; 
+		munmap(map, map_size); 
+		setShape(old_R, old_range); 
+		return false; 
+	}
+	release(); 
+	// the header is 64 bytes, so the blocks stay aligned to cache lines 
+	_sketch = reinterpret_cast<Counter*>((char*)map + sizeof(SketchFileHeader)); 
+	_map = map; 
+	_map_size = map_size; 
+	_hash_tag = header.hash_tag; 
+	return true; 
+}
+
+template <typename Counter>
+void BlockedRACE<Counter>::pprint(std::ostream& out, int width, bool format){
+	// one line per block 
+	for (size_t b = 0; b < _groups*_blocks; b++){
+		for (size_t i = 0; i < kCountersPerLine; i++)
+			out << '|' << std::setw(width) << (uint32_t)_sketch[b*kCountersPerLine + i];
+		out << '|' << std::endl; 
+	}
+	if (format)
+		out << std::string((width+1)*kCountersPerLine + 1, '-') << std::endl; 
+}
+
+template class BlockedRACE<uint8_t>; 
+template class BlockedRACE<uint16_t>; 
+template class BlockedRACE<uint32_t>; 
+
+
+bool IsPowerOfTwo(size_t range){
+	return range > 0 && (range & (range - 1)) == 0; 
+}
+
+int CounterBitsFor(size_t R, double tau){
+	double max_count = R * tau; 
+	if (max_count <= std::numeric_limits<uint8_t>::max())
+		return 8; 
+	if (max_count <= std::numeric_limits<uint16_t>::max())
+		return 16; 
+	return 32; 
+}
+
+int CounterBitsForReads(uint64_t reads){
+	if (reads <= std::numeric_limits<uint8_t>::max())
+		return 8; 
+	if (reads <= std::numeric_limits<uint16_t>::max())
+		return 16; 
+	if (reads < std::numeric_limits<uint32_t>::max())
+		return 32; 
+	return 0; 
+}
+
+template <typename Counter>
+static Sketch* MakeRACE(size_t R, size_t range){
+	if (IsPowerOfTwo(range))
+		return new RACE<Counter, true>(R, range); 
+	return new RACE<Counter, false>(R, range); 
+}
+
+Sketch* MakeRACE(size_t R, size_t range, int counter_bits){
+	switch(counter_bits){
+		case 8: return MakeRACE<uint8_t>(R, range); 
+		case 16: return MakeRACE<uint16_t>(R, range); 
+		case 32: return MakeRACE<uint32_t>(R, range); 
+	}
+	return NULL; 
+}
+
+Sketch* MakeBlockedRACE(size_t R, size_t range, int counter_bits){
+	switch(counter_bits){
+		case 8: return new BlockedRACE<uint8_t>(R, range); 
+		case 16: return new BlockedRACE<uint16_t>(R, range); 
+		case 32: return new BlockedRACE<uint32_t>(R, range); 
+	}
+	return NULL; 
+}
+
+// Creates the instantiation for the sketch file that starts at the current position of 
+// in, and leaves the position there. mappable is set for version 2 files in the native 
+// byte order; if also map is set, the counters for more than one row are not allocated. 
+static Sketch* MakeSketchFor(std::istream& in, bool map, bool& mappable){
+	std::streampos start = in.tellg(); 
+	in.seekg(0, std::ios::end); 
+	uint64_t file_size = (uint64_t)(in.tellg() - start); 
+	in.seekg(start); 
+
+	uint8_t head[sizeof(SketchFileHeader)]; 
+	in.read(reinterpret_cast<char *>(head), sizeof(head)); 
+	size_t got = in.gcount(); 
+	in.clear(); 
+	in.seekg(start); 
+
+	Sketch* sketch = NULL; 
+	mappable = false; 
+	if (got >= 18 && head[0] == 0x4D && head[1] == 1){
+		uint64_t R = BigEndian64(head + 2), range = BigEndian64(head + 10); 
+		if (R == 0 || range == 0 || (file_size - 18)/4/R < range){
+			std::cerr<<"Truncated sketch file"<<std::endl; 
+			return NULL; 
+		}
+		sketch = MakeRACE(R, range, 32); 
+	} else if (got >= 19 && head[0] == 0x42 && head[1] == 1){
+		uint64_t R = BigEndian64(head + 3), range = BigEndian64(head + 11); 
+		if (R == 0 || range == 0 || (file_size - 19)/4/R < range){
+			std::cerr<<"Truncated sketch file"<<std::endl; 
+			return NULL; 
+		}
+		sketch = MakeBlockedRACE(R, range, 8*head[2]); 
+	} else if (got == sizeof(SketchFileHeader) && head[0] == 0x4D && head[1] == 2){
+		SketchFileHeader header; 
+		memcpy(&header, head, sizeof(header)); 
+		if (!FixSketchHeader(header))
+			return NULL; 
+		if (header.R == 0 || header.range == 0 || (file_size - sizeof(header))/header.counter_bytes < header.counters){
+			std::cerr<<"Truncated sketch file"<<std::endl; 
+			return NULL; 
+		}
+		mappable = (header.byte_order == NativeByteOrder()); 
+		// a sketch that is going to be mapped only needs its own counters for one row 
+		size_t R = (map && mappable) ? 1 : header.R; 
+		if (header.layout == SKETCH_LAYOUT_ROWS)
+			sketch = MakeRACE(R, header.range, 8*header.counter_bytes); 
+		else
+			sketch = MakeBlockedRACE(R, header.range, 8*header.counter_bytes); 
+	} else {
+		std::cerr<<"Not a RACE sketch file (bad magic number or version)"<<std::endl; 
+		return NULL; 
+	}
+	if (sketch == NULL)
+		std::cerr<<"Invalid counter width in sketch file"<<std::endl; 
+	return sketch; 
+}
+
+Sketch* LoadSketch(std::istream& in){
+	bool mappable; 
+	Sketch* sketch = MakeSketchFor(in, false, mappable); 
+	if (sketch == NULL)
+		return NULL; 
+	if (!sketch->deserialize(in)){
+		delete sketch; 
+		return NULL; 
+	}
+	return sketch; 
+}
+
+Sketch* LoadSketch(const std::string& path, bool map){
+	std::ifstream in(path.c_str(), std::ios::binary | std::ios::in); 
+	if (!in){
+		std::cerr<<"Could not open sketch file "<<path<<std::endl; 
+		return NULL; 
+	}
+	bool mappable; 
+	Sketch* sketch = MakeSketchFor(in, map, mappable); 
+	if (sketch == NULL){
+		std::cerr<<"Could not load sketch file "<<path<<std::endl; 
+		return NULL; 
+	}
+	bool ok = (map && mappable) ? sketch->map(path) : sketch->deserialize(in); 
+	if (!ok){
+		std::cerr<<"Could not load sketch file "<<path<<std::endl; 
+		delete sketch; 
+		return NULL; 
+	}
+	return sketch; 
+}
+
+template class RACE<uint8_t, false>; 
+template class RACE<uint8_t, true>; 
+template class RACE<uint16_t, false>; 
+template class RACE<uint16_t, true>; 
+template class RACE<uint32_t, false>; 
+template class RACE<uint32_t, true>; 
+
+
+ConcurrentRACE::ConcurrentRACE(size_t R, size_t range) : _allocator(&GetSketchAllocator()){
+	_R = R; 
+	_range = range; 
+	// lock-free atomics of an integer have its representation, so zeroed memory holds zeroes 
+	static_assert(sizeof(std::atomic<race_sketch_t>) == sizeof(race_sketch_t), "atomic counters must be plain integers"); 
+	_sketch = static_cast<std::atomic<race_sketch_t>*>(_allocator->allocate(_R*_range*sizeof(race_sketch_t))); 
+}
+
+ConcurrentRACE::~ConcurrentRACE(){
+	_allocator->deallocate(_sketch, _R*_range*sizeof(race_sketch_t)); 
+}
+
+void ConcurrentRACE::add(const int *hashes){
+	for (size_t r = 0; r < _R; r++){
+		size_t index = hashes[r] % _range; 
+		_sketch[r*_range + index].fetch_add(1, std::memory_order_relaxed); 
+	}
+}
+
+double ConcurrentRACE::query_and_add(const int *hashes){
+	/* 
+	Same as RACE::query_and_add, but each counter is read and incremented by a single 
+	atomic fetch-add. Relaxed ordering is enough: the counters are independent, and 
+	no other memory is published through them. 
+	*/
+	double mean = 0; 
+	for (size_t r = 0; r < _R; r++){
+		size_t index = hashes[r] % _range; 
+		mean = mean + _sketch[r*_range + index].fetch_add(1, std::memory_order_relaxed); 
+	}
+	mean = mean / _R; 
+	return mean; 
+}
+
+void ConcurrentRACE::query_and_add(const int *hashes, size_t n, double *results){
+	// The prefetched lines may be taken away by other threads before the fetch-add, 
+	// which only costs the miss that the prefetch tried to hide. 
+	for (size_t i = 0; i < n; i++){
+		if (i + kPrefetchReads < n){
+			const int* next = hashes + (i + kPrefetchReads)*_R; 
+			for (size_t r = 0; r < _R; r++)
+				__builtin_prefetch(_sketch + r*_range + next[r] % _range, 1); 
+		}
+		results[i] = query_and_add(hashes + i*_R); 
+	}
+}
+
+double ConcurrentRACE::query(const int *hashes){
+	double mean = 0; 
+	for (size_t r = 0; r < _R; r++){
+		size_t index = hashes[r] % _range; 
+		mean = mean + _sketch[r*_range + index].load(std::memory_order_relaxed); 
+	}
+	mean = mean / _R; 
+	return mean; 
+}
+
+void ConcurrentRACE::clear(){
+	for (size_t i = 0; i < _R*_range; i++){
+		_sketch[i].store(0, std::memory_order_relaxed); 
+	}
+}
+
+
+ShardedSketch::ShardedSketch(Sketch* global, const std::vector<Sketch*>& deltas, size_t R, size_t merge_interval) : 
+	_global(global), _deltas(deltas), _pending(deltas.size(), 0), _R(R), _merge_interval(std::max(merge_interval, (size_t)1)){
+	// writers first, or a stream of readers could hold off a merge indefinitely 
+	pthread_rwlockattr_t attributes; 
+	pthread_rwlockattr_init(&attributes); 
+	pthread_rwlockattr_setkind_np(&attributes, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP); 
+	pthread_rwlock_init(&_lock, &attributes); 
+	pthread_rwlockattr_destroy(&attributes); 
+}
+
+ShardedSketch::~ShardedSketch(){
+	pthread_rwlock_destroy(&_lock); 
+	for (size_t i = 0; i < _deltas.size(); i++)
+		delete _deltas[i]; 
+}
+
+void ShardedSketch::query_and_add(int shard, const int *hashes, size_t n, double *results){
+	Sketch* delta = _deltas[shard]; 
+	// the delta is folded in after exactly _merge_interval reads, which may be in the 
+	// middle of the batch 
+	size_t i = 0; 
+	while (i < n){
+		size_t count = std::min(n - i, _merge_interval - _pending[shard]); 
+		pthread_rwlock_rdlock(&_lock); 
+		// no other thread writes to the shared sketch while we hold the read lock 
+		for (size_t j = i; j < i + count; j++)
+			results[j] = _global->query(hashes + j*_R) + delta->query_and_add(hashes + j*_R); 
+		pthread_rwlock_unlock(&_lock); 
+		i += count; 
+		_pending[shard] += count; 
+		if (_pending[shard] == _merge_interval)
+			fold(shard); 
+	}
+}
+
+void ShardedSketch::fold(int shard){
+	pthread_rwlock_wrlock(&_lock); 
+	_global->merge(*_deltas[shard]); 
+	pthread_rwlock_unlock(&_lock); 
+	_deltas[shard]->clear(); 
+	_pending[shard] = 0; 
+}
+
+void ShardedSketch::merge(){
+	for (size_t shard = 0; shard < _deltas.size(); shard++){
+		if (_pending[shard] > 0)
+			fold(shard); 
+	}
+}
+
+
+WindowedSketch::WindowedSketch(Sketch* total, size_t R, size_t epoch_reads, size_t epochs) : 
+	_total(total), _current(0), _pending(0), _R(R), _epoch_reads(std::max(epoch_reads, (size_t)1)){
+	for (size_t e = 0; e < std::max(epochs, (size_t)1); e++)
+		_epochs.push_back(total->make_empty()); 
+}
+
+WindowedSketch::~WindowedSketch(){
+	for (size_t e = 0; e < _epochs.size(); e++)
+		delete _epochs[e]; 
+}
+
+void WindowedSketch::query_and_add(const int *hashes, size_t n, double *results){
+	// the oldest epoch expires after exactly _epoch_reads reads, which may be in the 
+	// middle of the batch 
+	size_t i = 0; 
+	while (i < n){
+		size_t count = std::min(n - i, _epoch_reads - _pending); 
+		_total->query_and_add(hashes + i*_R, count, results + i); 
+		Sketch* epoch = _epochs[_current]; 
+		for (size_t j = i; j < i + count; j++)
+			epoch->add(hashes + j*_R); 
+		i += count; 
+		_pending += count; 
+		if (_pending == _epoch_reads){
+			_current = (_current + 1) % _epochs.size(); 
+			_total->unmerge(*_epochs[_current]); 
+			_epochs[_current]->clear(); 
+			_pending = 0; 
+		}
+	}
+}
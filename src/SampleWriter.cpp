@@ -0,0 +1,339 @@
+#include "SampleWriter.h"
+
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+/*
+Copyright 2019, Benjamin Coleman, All rights reserved.
+Free for research use. For commercial use, contact
+Rice University Invention & Patent or the author
+
+*/
+
+static const size_t kWriteBuffer = 1 << 20;
+static const size_t kWriteBuffers = 4;                 // buffers queued for the writer thread
+static const size_t kBGZFBlockData = 0xff00;          // uncompressed bytes per BGZF block (as in htslib)
+static const size_t kBGZFJobBytes = 16*kBGZFBlockData; // uncompressed bytes per compression job
+static const size_t kBGZFHeader = 18;
+static const size_t kBGZFFooter = 8;
+
+// empty BGZF block that marks the end of the file
+static const unsigned char kBGZFEOF[28] = {
+    0x1f, 0x8b, 0x08, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0x06, 0x00, 0x42, 0x43,
+    0x02, 0x00, 0x1b, 0x00, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
+};
+
+static bool WriteAll(int fd, const char* data, size_t length){
+    while (length > 0){
+        ssize_t n = ::write(fd, data, length);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        data += n;
+        length -= n;
+    }
+    return true;
+}
+
+static inline void PutLittleEndian16(unsigned char* p, uint16_t value){
+    p[0] = value & 0xff;
+    p[1] = value >> 8;
+}
+
+static inline void PutLittleEndian32(unsigned char* p, uint32_t value){
+    p[0] = value & 0xff;
+    p[1] = (value >> 8) & 0xff;
+    p[2] = (value >> 16) & 0xff;
+    p[3] = value >> 24;
+}
+
+
+bool IsCompressedOutput(const std::string& path){
+    size_t length = path.length();
+    return (length > 3 && path.compare(length - 3, 3, ".gz") == 0) || (length > 4 && path.compare(length - 4, 4, ".bgz") == 0);
+}
+
+SampleWriter* OpenSampleWriter(const std::string& path, int threads, int64_t resume_size){
+    int fd = (path == "-") ? dup(STDOUT_FILENO) : ::open(path.c_str(), O_WRONLY | O_CREAT | (resume_size < 0 ? O_TRUNC : 0), 0644);
+    if (fd < 0){
+        std::cerr<<"Could not open output file "<<path<<": "<<strerror(errno)<<std::endl;
+        return NULL;
+    }
+    if (resume_size >= 0){
+        // drop whatever was written after the checkpoint (for BGZF output, this is at a
+        // block boundary, so new blocks can simply be appended)
+        struct stat info;
+        if (fstat(fd, &info) != 0 || info.st_size < resume_size || ftruncate(fd, resume_size) != 0 || lseek(fd, resume_size, SEEK_SET) < 0){
+            std::cerr<<"Could not resume output file "<<path<<": it is shorter than at the checkpoint or cannot be truncated"<<std::endl;
+            ::close(fd);
+            return NULL;
+        }
+    }
+    if (IsCompressedOutput(path)){
+        return new BGZFWriter(fd, threads);
+    }
+    return new FileWriter(fd);
+}
+
+bool WriteChunk(SampleWriter& out, const SequenceView& chunk){
+    bool ok = out.write(chunk.data, chunk.length);
+    if (chunk.length > 0 && chunk.data[chunk.length - 1] != '\n')
+        ok = out.write("\n", 1) && ok;
+    return ok;
+}
+
+
+FileWriter::FileWriter(int fd) : _fd(fd), _closed(false), _current(NULL), _free(kWriteBuffers),
+    _full(kWriteBuffers), _pool(kWriteBuffers), _submitted(0), _written(0), _ok(true), _error(0){
+    for (size_t i = 0; i < _pool.size(); i++){
+        _pool[i].reserve(kWriteBuffer);
+        _free.push(&_pool[i]);
+    }
+    _free.pop(_current);
+    _writer = std::thread(&FileWriter::writeBuffers, this);
+}
+
+FileWriter::~FileWriter(){
+    close();
+}
+
+bool FileWriter::write(const char* data, size_t length){
+    while (length > 0){
+        size_t n = std::min(length, kWriteBuffer - _current->size());
+        _current->insert(_current->end(), data, data + n);
+        data += n;
+        length -= n;
+        if (_current->size() == kWriteBuffer)
+            submit();
+    }
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _ok;
+}
+
+void FileWriter::submit(){
+    // hand the current buffer to the writer thread and continue in a free one (this
+    // only waits if every buffer is still queued for writing)
+    if (_current->empty())
+        return;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _submitted++;
+    }
+    _full.push(_current);
+    _free.pop(_current);
+}
+
+void FileWriter::writeBuffers(){
+    std::vector<char>* buffer;
+    while (_full.pop(buffer)){
+        bool ok = WriteAll(_fd, buffer->data(), buffer->size());
+        int error = errno;
+        buffer->clear();
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (!ok && _ok){
+                _ok = false;
+                _error = error;
+            }
+            _written++;
+            _cv.notify_all();
+        }
+        _free.push(buffer);
+    }
+}
+
+bool FileWriter::sync(uint64_t& size){
+    // wait until the writer thread has written every submitted buffer
+    submit();
+    std::unique_lock<std::mutex> lock(_mutex);
+    _cv.wait(lock, [this]{ return _written == _submitted; });
+    if (_ok && fsync(_fd) != 0){
+        _ok = false;
+        _error = errno;
+    }
+    off_t position = lseek(_fd, 0, SEEK_CUR);
+    if (_ok && position < 0){
+        _ok = false;
+        _error = errno;
+    }
+    size = _ok ? position : 0;
+    if (!_ok)
+        std::cerr<<"Error writing output file: "<<strerror(_error)<<std::endl;
+    return _ok;
+}
+
+bool FileWriter::close(){
+    if (_closed)
+        return _ok;
+    _closed = true;
+    submit();
+    _full.close();
+    _writer.join();
+    if (::close(_fd) != 0 && _ok){
+        _ok = false;
+        _error = errno;
+    }
+    if (!_ok)
+        std::cerr<<"Error writing output file: "<<strerror(_error)<<std::endl;
+    return _ok;
+}
+
+
+BGZFWriter::BGZFWriter(int fd, int threads, int level) :
+    _fd(fd), _level(level), _closed(false), _current(NULL), _next_id(0),
+    _free(2*std::max(threads, 1) + 2), _work(2*std::max(threads, 1) + 2),
+    _pool(2*std::max(threads, 1) + 2), _written(0), _submitting(true), _ok(true){
+    for (size_t i = 0; i < _pool.size(); i++){
+        _pool[i].data.reserve(kBGZFJobBytes);
+        _free.push(&_pool[i]);
+    }
+    _free.pop(_current);
+    for (int t = 0; t < std::max(threads, 1); t++)
+        _threads.push_back(std::thread(&BGZFWriter::compressJobs, this));
+    _writer = std::thread(&BGZFWriter::writeJobs, this);
+}
+
+BGZFWriter::~BGZFWriter(){
+    close();
+}
+
+bool BGZFWriter::write(const char* data, size_t length){
+    while (length > 0){
+        size_t n = std::min(length, kBGZFJobBytes - _current->data.size());
+        _current->data.insert(_current->data.end(), data, data + n);
+        data += n;
+        length -= n;
+        if (_current->data.size() == kBGZFJobBytes)
+            submit();
+    }
+    // (a block that failed to compress or write fails every later write)
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _ok;
+}
+
+void BGZFWriter::submit(){
+    // hand the current buffer to the compression threads and continue in a free one
+    // (this only waits if every buffer is still being compressed or written)
+    if (_current->data.empty())
+        return;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _current->id = _next_id++;
+    }
+    _work.push(_current);
+    _free.pop(_current);
+}
+
+void BGZFWriter::compressJobs(){
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    // raw deflate: the BGZF header and footer are written by hand
+    deflateInit2(&stream, _level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+    size_t max_block = kBGZFHeader + deflateBound(&stream, kBGZFBlockData) + kBGZFFooter;
+
+    Job* job;
+    while (_work.pop(job)){
+        size_t nblocks = (job->data.size() + kBGZFBlockData - 1) / kBGZFBlockData;
+        job->compressed.resize(nblocks * max_block);
+        job->ok = true;
+        size_t out = 0;
+        for (size_t in = 0; in < job->data.size(); in += kBGZFBlockData){
+            size_t length = std::min(kBGZFBlockData, job->data.size() - in);
+            unsigned char* block = job->compressed.data() + out;
+
+            deflateReset(&stream);
+            stream.next_in = (Bytef*)(job->data.data() + in);
+            stream.avail_in = length;
+            stream.next_out = block + kBGZFHeader;
+            stream.avail_out = max_block - kBGZFHeader - kBGZFFooter;
+            if (deflate(&stream, Z_FINISH) != Z_STREAM_END){
+                job->ok = false;
+                break;
+            }
+            size_t block_size = kBGZFHeader + stream.total_out + kBGZFFooter;
+
+            memcpy(block, kBGZFEOF, kBGZFHeader);
+            PutLittleEndian16(block + 16, block_size - 1);
+            PutLittleEndian32(block + block_size - 8, crc32(0L, (const Bytef*)(job->data.data() + in), length));
+            PutLittleEndian32(block + block_size - 4, length);
+            out += block_size;
+        }
+        job->compressed.resize(out);
+
+        std::lock_guard<std::mutex> lock(_mutex);
+        _done[job->id] = job;
+        _cv.notify_all();
+    }
+    deflateEnd(&stream);
+}
+
+void BGZFWriter::writeJobs(){
+    for (size_t id = 0; ; id++){
+        Job* job;
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _cv.wait(lock, [&]{ return _done.count(id) || (!_submitting && id >= _next_id); });
+            if (!_done.count(id))
+                break;
+            job = _done[id];
+            _done.erase(id);
+        }
+        bool ok = job->ok && WriteAll(_fd, (const char*)job->compressed.data(), job->compressed.size());
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (!ok)
+                _ok = false;
+            _written = id + 1;
+            _cv.notify_all();
+        }
+        job->data.clear();
+        _free.push(job);
+    }
+}
+
+bool BGZFWriter::sync(uint64_t& size){
+    // wait until the writer thread has written every submitted block
+    submit();
+    std::unique_lock<std::mutex> lock(_mutex);
+    _cv.wait(lock, [this]{ return _written == _next_id; });
+    if (_ok && fsync(_fd) != 0)
+        _ok = false;
+    off_t position = lseek(_fd, 0, SEEK_CUR);
+    if (position < 0)
+        _ok = false;
+    size = _ok ? position : 0;
+    if (!_ok)
+        std::cerr<<"Error writing compressed output file"<<std::endl;
+    return _ok;
+}
+
+bool BGZFWriter::close(){
+    if (_closed)
+        return _ok;
+    _closed = true;
+    submit();
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _submitting = false;
+        _cv.notify_all();
+    }
+    _work.close();
+    for (size_t t = 0; t < _threads.size(); t++)
+        _threads[t].join();
+    _writer.join();
+
+    if (_ok)
+        _ok = WriteAll(_fd, (const char*)kBGZFEOF, sizeof(kBGZFEOF));
+    if (::close(_fd) != 0)
+        _ok = false;
+    if (!_ok)
+        std::cerr<<"Error writing compressed output file"<<std::endl;
+    return _ok;
+}
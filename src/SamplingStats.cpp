@@ -0,0 +1,205 @@
+#include "SamplingStats.h"
+
+#include <fstream>
+#include <cstring>
+#include <cerrno>
+
+#include <unistd.h>
+#include <sys/resource.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+/*
+Copyright 2019, Benjamin Coleman, All rights reserved.
+Free for research use. For commercial use, contact
+Rice University Invention & Patent or the author
+
+*/
+
+const char* SamplingStageName(SamplingStage stage){
+    switch (stage){
+        case STAGE_PARSE: return "parse";
+        case STAGE_MINHASH: return "minhash";
+        case STAGE_REHASH: return "rehash";
+        case STAGE_SKETCH: return "sketch";
+        case STAGE_OUTPUT: return "output";
+        default: return "unknown";
+    }
+}
+
+
+PerfCounters::PerfCounters() : _available(false){
+    for (int e = 0; e < NUM_EVENTS; e++){
+        _fds[e] = -1;
+        _values[e] = 0;
+    }
+}
+
+PerfCounters::~PerfCounters(){
+    for (int e = 0; e < NUM_EVENTS; e++)
+        if (_fds[e] >= 0) close(_fds[e]);
+}
+
+const char* PerfCounters::name(Event event){
+    switch (event){
+        case CYCLES: return "cycles";
+        case INSTRUCTIONS: return "instructions";
+        case CACHE_MISSES: return "cache_misses";
+        case DTLB_MISSES: return "dtlb_misses";
+        default: return "unknown";
+    }
+}
+
+bool PerfCounters::start(){
+#ifdef __linux__
+    const uint64_t configs[NUM_EVENTS] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES,
+        PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)};
+    for (int e = 0; e < NUM_EVENTS; e++){
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = (e == DTLB_MISSES) ? PERF_TYPE_HW_CACHE : PERF_TYPE_HARDWARE;
+        attr.config = configs[e];
+        attr.disabled = 1;
+        attr.inherit = 1; // count the threads created later as well
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        _fds[e] = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+        if (_fds[e] < 0 && e == DTLB_MISSES)
+            continue; // optional
+        if (_fds[e] < 0){
+            std::cerr<<"Hardware counters are not available ("<<strerror(errno)<<"), they are left out of the stats"<<std::endl;
+            for (int i = 0; i <= e; i++){
+                if (_fds[i] >= 0) close(_fds[i]);
+                _fds[i] = -1;
+            }
+            return false;
+        }
+    }
+    for (int e = 0; e < NUM_EVENTS; e++){
+        if (_fds[e] < 0) continue;
+        ioctl(_fds[e], PERF_EVENT_IOC_RESET, 0);
+        ioctl(_fds[e], PERF_EVENT_IOC_ENABLE, 0);
+    }
+    _available = true;
+    return true;
+#else
+    std::cerr<<"Hardware counters are only supported on Linux, they are left out of the stats"<<std::endl;
+    return false;
+#endif
+}
+
+void PerfCounters::stop(){
+#ifdef __linux__
+    if (!_available)
+        return;
+    for (int e = 0; e < NUM_EVENTS; e++){
+        if (_fds[e] < 0) continue;
+        ioctl(_fds[e], PERF_EVENT_IOC_DISABLE, 0);
+        uint64_t value = 0;
+        if (read(_fds[e], &value, sizeof(value)) != sizeof(value))
+            _available = false;
+        _values[e] = value;
+    }
+#endif
+}
+
+
+SamplingStats::SamplingStats(size_t reps, int threads) :
+    reads(0), kept(0), bases(0), duplicates(0), cache_entries(0), threads(threads), start_ns(StatsClock()), end_ns(start_ns), kde(reps),
+    sketch_bytes(0), huge_page_bytes(0){
+    faults.start();
+}
+
+void PageFaults::start(){
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0){
+        minor = usage.ru_minflt;
+        major = usage.ru_majflt;
+    }
+}
+
+void PageFaults::stop(){
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0){
+        minor = usage.ru_minflt - minor;
+        major = usage.ru_majflt - major;
+    }
+}
+
+void SamplingStats::progress(std::ostream& out) const {
+    double elapsed = (StatsClock() - start_ns) / 1e9;
+    out<<"Processed "<<reads<<" reads in "<<elapsed<<" s ("<<bases/elapsed/1e6<<" Mbp/s), kept "
+        <<kept<<" ("<<(reads ? 100.0*kept/reads : 0.0)<<"%)";
+    if (cache_entries)
+        out<<", duplicate cache hits "<<(reads ? 100.0*duplicates/reads : 0.0)<<"%";
+    out<<std::endl;
+}
+
+void SamplingStats::json(std::ostream& out) const {
+    double wall = seconds();
+    out<<"{\n";
+    out<<"  \"reads\": "<<reads<<",\n";
+    out<<"  \"kept\": "<<kept<<",\n";
+    out<<"  \"keep_rate\": "<<(reads ? (double)kept/reads : 0.0)<<",\n";
+    out<<"  \"bases\": "<<bases<<",\n";
+    out<<"  \"threads\": "<<threads<<",\n";
+    out<<"  \"seconds\": "<<wall<<",\n";
+    out<<"  \"reads_per_second\": "<<(wall > 0 ? reads/wall : 0.0)<<",\n";
+    out<<"  \"mbp_per_second\": "<<(wall > 0 ? bases/wall/1e6 : 0.0)<<",\n";
+    if (cache_entries){
+        out<<"  \"duplicate_cache\": {\"entries\": "<<cache_entries<<", \"hits\": "<<duplicates
+            <<", \"hit_rate\": "<<(reads ? (double)duplicates/reads : 0.0)<<"},\n";
+    }
+    // stages that run on several threads add up the time of every thread
+    out<<"  \"stage_seconds\": {";
+    for (int s = 0; s < NUM_STAGES; s++){
+        out<<(s ? ", " : "")<<"\""<<SamplingStageName((SamplingStage)s)<<"\": "<<times.ns[s]/1e9;
+    }
+    out<<"},\n";
+
+    // buckets of the KDE value, from min to max (inclusive)
+    out<<"  \"kde_histogram\": [";
+    const std::vector<uint64_t>& counts = kde.counts();
+    size_t last = 0;
+    for (size_t b = 0; b < counts.size(); b++) if (counts[b]) last = b;
+    for (size_t b = 0; b <= last; b++){
+        double low = b ? (double)(1ULL << (b - 1)) / kde.reps() : 0.0;
+        double high = b ? (double)((1ULL << (b - 1)) * 2 - 1) / kde.reps() : 0.0;
+        out<<(b ? ",\n    " : "\n    ")<<"{\"min\": "<<low<<", \"max\": "<<high<<", \"reads\": "<<counts[b]<<"}";
+    }
+    out<<"\n  ]";
+
+    out<<",\n  \"memory\": {\"allocator\": \""<<allocator<<"\", \"sketch_bytes\": "<<sketch_bytes
+        <<", \"huge_page_bytes\": "<<huge_page_bytes<<", \"minor_page_faults\": "<<faults.minor
+        <<", \"major_page_faults\": "<<faults.major<<"}";
+
+    if (perf.available()){
+        out<<",\n  \"perf\": {";
+        for (int e = 0; e < PerfCounters::NUM_EVENTS; e++){
+            PerfCounters::Event event = (PerfCounters::Event)e;
+            if (perf.has(event))
+                out<<(e ? ", " : "")<<"\""<<PerfCounters::name(event)<<"\": "<<perf.value(event);
+        }
+        if (perf.has(PerfCounters::DTLB_MISSES))
+            out<<", \"dtlb_misses_per_read\": "<<(reads ? (double)perf.value(PerfCounters::DTLB_MISSES)/reads : 0.0);
+        out<<", \"cache_misses_per_read\": "<<(reads ? (double)perf.value(PerfCounters::CACHE_MISSES)/reads : 0.0);
+        out<<", \"instructions_per_cycle\": "<<(perf.value(PerfCounters::CYCLES) ? (double)perf.value(PerfCounters::INSTRUCTIONS)/perf.value(PerfCounters::CYCLES) : 0.0);
+        out<<"}";
+    }
+    out<<"\n}\n";
+}
+
+bool SaveStats(const std::string& path, const SamplingStats& stats){
+    std::ofstream out(path.c_str());
+    stats.json(out);
+    out.close();
+    if (!out){
+        std::cerr<<"Could not write stats file "<<path<<std::endl;
+        return false;
+    }
+    return true;
+}
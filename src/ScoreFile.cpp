@@ -0,0 +1,153 @@
+#include "ScoreFile.h"
+
+#include <cmath>
+#include <cstring>
+#include <cerrno>
+#include <iostream>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+/*
+Copyright 2019, Benjamin Coleman, All rights reserved.
+Free for research use. For commercial use, contact
+Rice University Invention & Patent or the author
+
+*/
+
+static const char kScoreMagic[8] = {'R', 'A', 'C', 'E', 'K', 'D', 'E', '1'};
+static const size_t kScoreBuffer = 1 << 20;
+
+
+ScoreWriter::ScoreWriter() : _out(NULL), _reps(0) {}
+
+ScoreWriter::~ScoreWriter(){
+    close();
+}
+
+bool ScoreWriter::open(const std::string& path, size_t reps, int64_t resume_size){
+    if (IsCompressedOutput(path)){
+        std::cerr<<"Score files cannot be compressed: "<<path<<std::endl;
+        return false;
+    }
+    if (resume_size >= 0 && resume_size < (int64_t)kScoreHeader){
+        std::cerr<<"Could not resume score file "<<path<<": it has no header"<<std::endl;
+        return false;
+    }
+    _out = OpenSampleWriter(path, 1, resume_size);
+    if (_out == NULL)
+        return false;
+    _reps = reps;
+    if (resume_size < 0){
+        unsigned char header[kScoreHeader] = {0};
+        memcpy(header, kScoreMagic, sizeof(kScoreMagic));
+        for (int b = 0; b < 4; b++) header[8 + b] = (reps >> (8*b)) & 0xff;
+        _out->write((const char*)header, sizeof(header));
+    }
+    return true;
+}
+
+void ScoreWriter::add(const double* kde, size_t n){
+    // (a sum has at most 10 varint bytes)
+    _buffer.resize(10*n);
+    unsigned char* out = _buffer.data();
+    for (size_t i = 0; i < n; i++){
+        uint64_t sum = (uint64_t)std::llround(kde[i] * _reps);
+        while (sum >= 0x80){
+            *out++ = (unsigned char)(sum | 0x80);
+            sum >>= 7;
+        }
+        *out++ = (unsigned char)sum;
+    }
+    _out->write((const char*)_buffer.data(), out - _buffer.data());
+}
+
+bool ScoreWriter::sync(uint64_t& size){
+    return _out->sync(size);
+}
+
+bool ScoreWriter::close(){
+    if (_out == NULL)
+        return true;
+    bool ok = _out->close();
+    delete _out;
+    _out = NULL;
+    return ok;
+}
+
+
+ScoreReader::ScoreReader() : _fd(-1), _reps(0), _position(0), _end(0), _failed(false) {}
+
+ScoreReader::~ScoreReader(){
+    close();
+}
+
+bool ScoreReader::open(const std::string& path){
+    _fd = ::open(path.c_str(), O_RDONLY);
+    if (_fd < 0){
+        std::cerr<<"Could not open score file "<<path<<": "<<strerror(errno)<<std::endl;
+        return false;
+    }
+    _buffer.resize(kScoreBuffer);
+    _position = _end = 0;
+    _failed = false;
+    unsigned char header[kScoreHeader];
+    for (size_t i = 0; i < kScoreHeader; i++){
+        if (_position == _end && !refill()){
+            std::cerr<<"Not a score file: "<<path<<std::endl;
+            return false;
+        }
+        header[i] = _buffer[_position++];
+    }
+    if (memcmp(header, kScoreMagic, sizeof(kScoreMagic)) != 0){
+        std::cerr<<"Not a score file: "<<path<<std::endl;
+        return false;
+    }
+    _reps = 0;
+    for (int b = 0; b < 4; b++) _reps |= (size_t)header[8 + b] << (8*b);
+    if (_reps == 0){
+        std::cerr<<"Invalid score file: "<<path<<std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool ScoreReader::refill(){
+    while (true){
+        ssize_t n = ::read(_fd, _buffer.data(), _buffer.size());
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0){
+            std::cerr<<"Error reading score file: "<<strerror(errno)<<std::endl;
+            _failed = true;
+        }
+        _position = 0;
+        _end = (n > 0) ? n : 0;
+        return n > 0;
+    }
+}
+
+bool ScoreReader::next(uint64_t& sum){
+    if (_fd < 0 || _failed)
+        return false;
+    sum = 0;
+    for (int shift = 0; ; shift += 7){
+        if (_position == _end && !refill()){
+            if (shift > 0 && !_failed){
+                std::cerr<<"Score file ends in the middle of a score"<<std::endl;
+                _failed = true;
+            }
+            return false;
+        }
+        unsigned char byte = _buffer[_position++];
+        if (shift < 64) sum |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+            return true;
+    }
+}
+
+void ScoreReader::close(){
+    if (_fd >= 0)
+        ::close(_fd);
+    _fd = -1;
+}
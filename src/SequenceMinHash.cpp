@@ -1,45 +1,262 @@
 #include "SequenceMinHash.h"
+#include "simd.h"
+
+#include <algorithm>
 
 /*
-Copyright 2019, Benjamin Coleman, All rights reserved. 
-Free for research use. For commercial use, contact 
+Copyright 2019, Benjamin Coleman, All rights reserved.
+Free for research use. For commercial use, contact
 Rice University Invention & Patent or the author
 
 */
 
-SequenceMinHash::SequenceMinHash(int number_of_hashes){
-    _numhashes = number_of_hashes; 
+// 2-bit nucleotide codes. Anything that is not A, C, G or T (either case) maps to 4
+// and breaks the current k-mer, so k-mers that contain an N are never hashed.
+static const uint8_t kInvalidBase = 4;
+
+struct NucleotideTable {
+    uint8_t code[256];
+    NucleotideTable(){
+        for (int i = 0; i < 256; i++) code[i] = kInvalidBase;
+        code['A'] = 0; code['a'] = 0;
+        code['C'] = 1; code['c'] = 1;
+        code['G'] = 2; code['g'] = 2;
+        code['T'] = 3; code['t'] = 3;
+    }
+};
+static const NucleotideTable nucleotides;
+
+// MurmurHash3 finalizers. Both are bijections, so distinct k-mers never collide
+static inline uint64_t fmix64(uint64_t k){
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+static inline uint32_t fmix32(uint32_t h){
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
 }
 
 
+// Reads are only split if every piece gets at least this many bases
+static const size_t kMinPieceLength = 4096;
+
+SequenceMinHash::SequenceMinHash(int number_of_hashes, MinHashEngine engine){
+    _numhashes = number_of_hashes;
+    _engine = engine;
+    _salts.resize(_numhashes);
+    for (int n = 0; n < _numhashes; n++){
+        _salts[n] = fmix32(0x9e3779b9u * (uint32_t)(n + 1));
+    }
+    _pool = NULL;
+    _split_length = 0;
+}
+
+
+void SequenceMinHash::setPool(TaskPool* pool, size_t split_length){
+    _pool = pool;
+    _split_length = split_length;
+}
+
 
 void SequenceMinHash::getHash(size_t k, const std::string& sequence, int* hashes){
+    getHash(k, sequence.data(), sequence.length(), hashes);
+}
+
+
+void SequenceMinHash::getHash(size_t k, const char* sequence, size_t length, int* hashes){
     // getHash(size_t k, std::string& sequence, int* hashes)
     // hashes had better be pre-allocated to _numhashes!!
-    // I do this because this is faster in a loop 
-    #pragma omp parallel for 
+    // I do this because this is faster in a loop
+
+    // long reads are split into pieces that are hashed in parallel
+    if (_pool && _pool->helpers() > 0 && length >= _split_length && length >= 2*kMinPieceLength){
+        getHashSplit(k, sequence, length, hashes);
+        return;
+    }
+
+    // k-mers longer than 32 bases do not fit in a 64-bit word, so they always use MurmurHash
+    if (_engine == MINHASH_MURMUR || k > 32){
+        getHashMurmur(k, sequence, 0, MurmurStarts(k, length), hashes, NULL);
+    } else if (_engine == MINHASH_ONEPERM){
+        rollKmers(k, sequence, 0, length, _kmers);
+        _bins.assign(_numhashes, std::numeric_limits<uint64_t>::max());
+        fillBins(_kmers.data(), _kmers.size(), _bins.data());
+        densifyBins(_kmers.size(), hashes);
+    } else {
+        // For each seed, the MinHash value of a k-mer is fmix32 of the low half of its mix
+        // xor the seed's salt. The high half identifies the minimizing k-mer (like the
+        // second MurmurHash call in the original engine). The seed loop runs in the
+        // vectorized kernels of simd.cpp.
+        rollKmers(k, sequence, 0, length, _kmers);
+        MinHashKernel(_kmers.data(), _kmers.size(), _salts.data(), _numhashes, hashes);
+    }
+}
+
+
+void SequenceMinHash::getHashSplit(size_t k, const char* seq, size_t length, int* hashes){
+    // Every piece covers a range of k-mers (by start position for MurmurHash, by end
+    // position for the rolling engines) and finds the minimum of each seed within it.
+    // The minima are combined in read order, keeping the earlier piece on ties, which
+    // gives exactly the result of hashing the read in one piece.
+    bool murmur = (_engine == MINHASH_MURMUR || k > 32);
+    size_t positions = murmur ? MurmurStarts(k, length) : length;
+    size_t npieces = std::min((size_t)_pool->helpers() + 1, length / kMinPieceLength);
+    if (_pieces.size() < npieces) _pieces.resize(npieces);
+
+    _pool->run(npieces, [&](size_t p){
+        Piece& piece = _pieces[p];
+        size_t first = positions * p / npieces;
+        size_t last = positions * (p + 1) / npieces;
+        piece.hashes.resize(_numhashes);
+        piece.minima.resize(_numhashes);
+        if (murmur){
+            getHashMurmur(k, seq, first, last, piece.hashes.data(), piece.minima.data());
+            return;
+        }
+        rollKmers(k, seq, first, last, piece.kmers);
+        if (_engine == MINHASH_ONEPERM){
+            piece.bins.assign(_numhashes, std::numeric_limits<uint64_t>::max());
+            fillBins(piece.kmers.data(), piece.kmers.size(), piece.bins.data());
+        } else {
+            MinHashKernel(piece.kmers.data(), piece.kmers.size(), _salts.data(), _numhashes, piece.hashes.data(), piece.minima.data());
+        }
+    });
+
+    if (_engine == MINHASH_ONEPERM && !murmur){
+        // bins keep the smallest value, so the order of the pieces does not matter
+        size_t nkmers = 0;
+        _bins.assign(_numhashes, std::numeric_limits<uint64_t>::max());
+        for (size_t p = 0; p < npieces; p++){
+            nkmers += _pieces[p].kmers.size();
+            for (int n = 0; n < _numhashes; n++)
+                _bins[n] = std::min(_bins[n], _pieces[p].bins[n]);
+        }
+        densifyBins(nkmers, hashes);
+        return;
+    }
+    for (int n = 0; n < _numhashes; n++){
+        uint32_t minimum = _pieces[0].minima[n];
+        hashes[n] = _pieces[0].hashes[n];
+        for (size_t p = 1; p < npieces; p++){
+            if (_pieces[p].minima[n] < minimum){
+                minimum = _pieces[p].minima[n];
+                hashes[n] = _pieces[p].hashes[n];
+            }
+        }
+    }
+}
+
+
+size_t SequenceMinHash::MurmurStarts(size_t k, size_t length){
+    // the original engine skips the last two k-mers of every read
+    return (length > k + 1) ? length - k - 1 : 0;
+}
+
+
+void SequenceMinHash::getHashMurmur(size_t k, const char* seq, size_t first, size_t last, int* hashes, uint32_t* minima){
+    #pragma omp parallel for
     for (int n=0; n < _numhashes; n++) {
 
         unsigned int hashed_value;
         unsigned int minhashed_value;
 
-        minhashed_value = std::numeric_limits<unsigned int>::max(); 
-        hashes[n] = 0; 
-
-        const char* seq = sequence.c_str(); 
-        int len = sequence.length(); 
+        minhashed_value = std::numeric_limits<unsigned int>::max();
+        hashes[n] = 0;
 
         // for each kmer in the sequence
-        for (int start = 0; (start + k + 1) < len; start++){
-            hashed_value = MurmurHash(seq + start, sizeof(char)*k, n); 
+        for (size_t start = first; start < last; start++){
+            hashed_value = MurmurHash(seq + start, sizeof(char)*k, n);
 
             if (hashed_value < minhashed_value){
                 minhashed_value = hashed_value;
-                hashes[n] = MurmurHash(seq + start, sizeof(char)*k, n*3); 
+                hashes[n] = MurmurHash(seq + start, sizeof(char)*k, n*3);
                 // proxy for returning the string itself
             }
         }
+        if (minima) minima[n] = minhashed_value;
+    }
+    return;
+}
+
+
+void SequenceMinHash::rollKmers(size_t k, const char* seq, size_t begin, size_t end, std::vector<uint64_t>& kmers){
+    // Roll over the read once, keeping the last k bases as 2-bit codes in a 64-bit word.
+    // Each complete k-mer is mixed once with fmix64 and saved to kmers. Only k-mers that
+    // end in [begin, end) are saved, but rolling starts k - 1 bases earlier.
+    const uint64_t mask = (k == 32) ? ~0ULL : ((1ULL << (2*k)) - 1);
+
+    kmers.clear();
+    uint64_t kmer = 0;
+    size_t valid = 0; // number of consecutive ACGT bases ending at this position
+    for (size_t i = (begin >= k - 1) ? begin - (k - 1) : 0; i < end; i++){
+        uint8_t c = nucleotides.code[(uint8_t)seq[i]];
+        if (c == kInvalidBase){
+            valid = 0;
+            kmer = 0;
+            continue;
+        }
+        kmer = ((kmer << 2) | c) & mask;
+        if (++valid >= k && i >= begin){
+            kmers.push_back(fmix64(kmer));
+        }
+    }
+}
+
+
+void SequenceMinHash::fillBins(const uint64_t* kmers, size_t nkmers, uint64_t* bins){
+    // One permutation hashing: the low half of each k-mer mix picks one of the _numhashes
+    // bins and the high half is the value, so a single scan fills every slot that rehash
+    // reads.
+    const uint64_t nbins = _numhashes;
+    for (size_t i = 0; i < nkmers; i++){
+        uint64_t bin = ((kmers[i] & 0xffffffffULL) * nbins) >> 32;
+        uint64_t value = kmers[i] >> 32;
+        if (value < bins[bin]){
+            bins[bin] = value;
+        }
+    }
+}
+
+
+void SequenceMinHash::densifyBins(size_t nkmers, int* hashes){
+    // Bins that received no k-mer borrow the value of a non-empty bin found by a fixed
+    // probe sequence (optimal densification), which keeps the collision probability
+    // equal to the Jaccard similarity. Works best when reads have more k-mers than slots.
+    const uint64_t empty = std::numeric_limits<uint64_t>::max();
+    const uint64_t nbins = _numhashes;
+    if (nkmers == 0){
+        for (int n = 0; n < _numhashes; n++) hashes[n] = 0;
+        return;
+    }
+    for (int n = 0; n < _numhashes; n++){
+        uint64_t value = _bins[n];
+        for (uint32_t attempt = 0; value == empty; attempt++){
+            uint64_t probe = ((uint64_t)fmix32(_salts[n] + 0x9e3779b9u * attempt) * nbins) >> 32;
+            value = _bins[probe];
+        }
+        hashes[n] = (int)(uint32_t)value;
+    }
+}
+
 
+bool ParseMinHashEngine(const std::string& name, MinHashEngine& engine){
+    if (name == "murmur"){
+        engine = MINHASH_MURMUR;
+    } else if (name == "rolling"){
+        engine = MINHASH_ROLLING;
+    } else if (name == "oph"){
+        engine = MINHASH_ONEPERM;
+    } else {
+        return false;
     }
-    return; 
+    return true;
 }
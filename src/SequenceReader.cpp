@@ -0,0 +1,409 @@
+#include "SequenceReader.h"
+#include "GzipSource.h"
+#include "BoundedQueue.h"
+
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+Copyright 2019, Benjamin Coleman, All rights reserved.
+Free for research use. For commercial use, contact
+Rice University Invention & Patent or the author
+
+*/
+
+static const size_t kBlockSize = 1 << 22; // initial buffer for streamed inputs (4 MB)
+static const size_t kMagicBytes = 18;      // enough to recognize gzip and BGZF headers
+static const size_t kPrefetchBlock = 1 << 20;  // bytes per read-ahead block of streamed inputs
+static const size_t kPrefetchBlocks = 8;       // read-ahead blocks per streamed input
+static const size_t kMapWindow = 1 << 24;      // read-ahead window of mapped inputs (16 MB)
+
+// Reads a file descriptor in blocks, after returning the bytes in prefix (which were
+// already read from the descriptor to detect compression)
+class FileSource : public ByteSource {
+public:
+    FileSource(int fd, const std::string& prefix) : _fd(fd), _prefix(prefix), _prefix_offset(0) {}
+    long read(char* buffer, size_t capacity){
+        if (_prefix_offset < _prefix.size()){
+            size_t n = std::min(capacity, _prefix.size() - _prefix_offset);
+            memcpy(buffer, _prefix.data() + _prefix_offset, n);
+            _prefix_offset += n;
+            return (long)n;
+        }
+        while (true){
+            ssize_t n = ::read(_fd, buffer, capacity);
+            if (n < 0 && errno == EINTR)
+                continue;
+            return (long)n;
+        }
+    }
+private:
+    int _fd;
+    std::string _prefix;
+    size_t _prefix_offset;
+};
+
+
+// Reads another source ahead of the consumer on its own thread, into a ring of blocks.
+// Reading (and decompressing) the input then overlaps with parsing and hashing, and
+// every input of a paired-end run is read concurrently.
+class PrefetchSource : public ByteSource {
+public:
+    PrefetchSource(ByteSource* input) : _input(input), _free(kPrefetchBlocks), _full(kPrefetchBlocks),
+        _blocks(kPrefetchBlocks), _current(NULL), _offset(0), _done(false){
+        for (size_t i = 0; i < _blocks.size(); i++){
+            _blocks[i].data.resize(kPrefetchBlock);
+            _free.push(&_blocks[i]);
+        }
+        _thread = std::thread(&PrefetchSource::prefetch, this);
+    }
+    ~PrefetchSource(){
+        // unblocks the thread if it waits for a free block
+        _free.close();
+        _full.close();
+        _thread.join();
+        delete _input;
+    }
+    long read(char* buffer, size_t capacity){
+        while (_current == NULL || _offset == (size_t)_current->length){
+            if (_done)
+                return _result;
+            if (_current)
+                _free.push(_current);
+            _current = NULL;
+            if (!_full.pop(_current)){
+                _done = true;
+                _result = -1;
+                return -1;
+            }
+            _offset = 0;
+            if (_current->length <= 0){
+                // end of input (0) or an error (-1), with the errno of the thread
+                _done = true;
+                _result = _current->length;
+                errno = _current->error;
+                return _result;
+            }
+        }
+        size_t n = std::min(capacity, (size_t)_current->length - _offset);
+        memcpy(buffer, _current->data.data() + _offset, n);
+        _offset += n;
+        return (long)n;
+    }
+private:
+    struct Block {
+        std::vector<char> data;
+        long length;
+        int error;
+    };
+    void prefetch(){
+        Block* block;
+        while (_free.pop(block)){
+            errno = 0;
+            block->length = _input->read(block->data.data(), block->data.size());
+            block->error = errno;
+            if (!_full.push(block) || block->length <= 0)
+                break;
+        }
+    }
+
+    ByteSource* _input;
+    BoundedQueue<Block*> _free;
+    BoundedQueue<Block*> _full;
+    std::vector<Block> _blocks;
+    std::thread _thread;
+    Block* _current;
+    size_t _offset;
+    bool _done;
+    long _result;
+};
+
+
+SequenceReader::SequenceReader(){
+    _begin = 0;
+    _lines_per_record = 0;
+    _fd = -1;
+    _map = NULL;
+    _map_size = 0;
+    _advised = 0;
+    _source = NULL;
+    _buffer = NULL;
+    _capacity = 0;
+    _cursor = NULL;
+    _end = NULL;
+    _base = 0;
+    _eof = true;
+    _failed = false;
+}
+
+SequenceReader::~SequenceReader(){
+    close();
+}
+
+bool SequenceReader::open(const std::string& path, const std::string& fastWhat, int threads){
+    close();
+    if (fastWhat == "fasta") {
+        _lines_per_record = 2;
+        _begin = '>';
+    } else if (fastWhat == "fastq") {
+        _lines_per_record = 4;
+        _begin = '@';
+    } else {
+        std::cerr<<"Unsupported file type: "<<fastWhat<<std::endl;
+        return false;
+    }
+    _fastWhat = fastWhat;
+
+    // "-" is standard input (duplicated, so that close() leaves it open)
+    _fd = (path == "-") ? dup(STDIN_FILENO) : ::open(path.c_str(), O_RDONLY);
+    if (_fd < 0){
+        std::cerr<<"Could not open input file "<<path<<": "<<strerror(errno)<<std::endl;
+        return false;
+    }
+
+    // Peek at the first bytes to detect compressed inputs. Regular files are read with 
+    // pread, which leaves the file offset alone. For pipes, the bytes are consumed and 
+    // handed back through the prefix of the FileSource. 
+    struct stat info;
+    bool regular = (fstat(_fd, &info) == 0 && S_ISREG(info.st_mode));
+    char magic[kMagicBytes];
+    ssize_t nmagic = 0;
+    std::string prefix;
+    if (regular){
+        nmagic = pread(_fd, magic, kMagicBytes, 0);
+    } else {
+        while (nmagic < (ssize_t)kMagicBytes){
+            ssize_t n = ::read(_fd, magic + nmagic, kMagicBytes - nmagic);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                break;
+            nmagic += n;
+        }
+        prefix.assign(magic, nmagic > 0 ? nmagic : 0);
+    }
+    bool gzip = (nmagic > 0 && IsGzip(magic, nmagic));
+
+    // Map regular uncompressed files. If that is not possible, fall back to block reads.
+    if (!gzip && regular && info.st_size > 0){
+        void* map = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, _fd, 0);
+        if (map != MAP_FAILED){
+            madvise(map, info.st_size, MADV_SEQUENTIAL);
+            _map = (char*)map;
+            _map_size = info.st_size;
+            _buffer = _map;
+            _cursor = _map;
+            _end = _map + _map_size;
+            // (after _cursor is set, since the window starts at the cursor)
+            _advised = 0;
+            advise();
+            _base = 0;
+            _eof = true;
+            _failed = false;
+            return true;
+        }
+    }
+
+    // Everything but BGZF (which has its own dispatcher and inflate threads) is read 
+    // and decompressed ahead by a PrefetchSource 
+    _source = new FileSource(_fd, prefix);
+    if (gzip && IsBGZF(magic, nmagic)){
+        _source = new BGZFSource(_source, threads);
+    } else if (gzip){
+        _source = new PrefetchSource(new GzipSource(_source));
+    } else {
+        _source = new PrefetchSource(_source);
+    }
+    _capacity = kBlockSize;
+    _buffer = (char*)malloc(_capacity);
+    _cursor = _buffer;
+    _end = _buffer;
+    _base = 0;
+    _eof = false;
+    _failed = false;
+    return true;
+}
+
+void SequenceReader::close(){
+    if (_map){
+        munmap(_map, _map_size);
+        _map = NULL;
+        _map_size = 0;
+    } else {
+        free(_buffer);
+    }
+    _buffer = NULL;
+    delete _source;
+    _source = NULL;
+    _capacity = 0;
+    if (_fd >= 0){
+        ::close(_fd);
+        _fd = -1;
+    }
+    _cursor = NULL;
+    _end = NULL;
+    _eof = true;
+}
+
+bool SequenceReader::refill(){
+    // Move the unread bytes to the front of the buffer (growing it if a single record
+    // does not fit) and append the next block of input behind them
+    size_t remaining = _end - _cursor;
+    if (_cursor != _buffer){
+        memmove(_buffer, _cursor, remaining);
+        _base += _cursor - _buffer;
+    }
+    if (remaining == _capacity){
+        _capacity *= 2;
+        _buffer = (char*)realloc(_buffer, _capacity);
+    }
+    _cursor = _buffer;
+    _end = _buffer + remaining;
+
+    errno = 0;
+    long n = _source->read(_buffer + remaining, _capacity - remaining);
+    if (n < 0){
+        // decompression errors are reported by the source itself and leave errno alone
+        if (errno != 0)
+            std::cerr<<"Error reading "<<_fastWhat<<" file: "<<strerror(errno)<<std::endl;
+        _failed = true;
+        return false;
+    }
+    if (n == 0)
+        _eof = true;
+    _end += n;
+    return true;
+}
+
+bool SequenceReader::parse(SequenceRecord& record, int nrecords, bool& incomplete){
+    // incomplete is set if the buffer ends before the record(s) do. Returns false with
+    // incomplete unset for a malformed record.
+    incomplete = false;
+    const char* p = _cursor;
+
+    // blank lines between records are ignored
+    while (p < _end && (*p == '\n' || *p == '\r'))
+        p++;
+    if (p == _end){
+        incomplete = true;
+        return false;
+    }
+
+    const char* start = p;
+    for (int n = 0; n < nrecords; n++){
+        for (int l = 0; l < _lines_per_record; l++){
+            if (p == _end){
+                if (!_eof){
+                    incomplete = true;
+                    return false;
+                }
+                std::cerr<<"Error reading "<<_fastWhat<<" file: Expected "<<_lines_per_record*nrecords<<" lines of input, got "<<n*_lines_per_record + l<<" instead."<<std::endl;
+                return false;
+            }
+            const char* newline = (const char*)memchr(p, '\n', _end - p);
+            if (newline == NULL && !_eof){
+                incomplete = true;
+                return false;
+            }
+            const char* line_end = newline ? newline : _end;
+            SequenceView line(p, line_end - p);
+            p = newline ? newline + 1 : _end;
+
+            if (l == 0 && (line.length == 0 || line.data[0] != _begin)){
+                std::cerr<<"Error reading line of "<<_fastWhat<<" file: Expected a line beginning with "<<_begin<<" but instead found: "<<std::endl;
+                std::cerr<<line.str()<<std::endl;
+                return false;
+            }
+            if (l == 1 && line.length == 0){
+                std::cerr<<"Error reading "<<_fastWhat<<" file: Expected a sequence, but found empty line at byte offset "<<_base + (line.data - _buffer)<<std::endl;
+                return false;
+            }
+            if (n == 0){
+                switch(l){
+                    case 0: record.header = line; break;
+                    case 1: record.sequence = line; break;
+                    case 2: record.plus = line; break;
+                    case 3: record.quality = line; break;
+                }
+            }
+        }
+    }
+    if (_lines_per_record == 2){
+        record.plus = SequenceView();
+        record.quality = SequenceView();
+    }
+    record.chunk = SequenceView(start, p - start);
+    record.offset = _base + (start - _buffer);
+    _cursor = p;
+    return true;
+}
+
+void SequenceReader::advise(){
+    // Asks the kernel to start reading the next window of a mapped input (without 
+    // waiting for it) once the cursor is halfway through the current one 
+    size_t position = _cursor - _map;
+    if (position + kMapWindow/2 < _advised || _advised >= _map_size)
+        return;
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t start = std::max(_advised, position) / page * page;
+    size_t end = std::min(start + kMapWindow, _map_size);
+    if (start < end)
+        madvise(_map + start, end - start, MADV_WILLNEED);
+    _advised = end;
+}
+
+bool SequenceReader::next(SequenceRecord& record, int nrecords){
+    if (_failed || _cursor == NULL)
+        return false;
+    if (_map)
+        advise();
+
+    while (true){
+        bool incomplete;
+        if (parse(record, nrecords, incomplete))
+            return true;
+        if (!incomplete){
+            _failed = true;
+            return false;
+        }
+        // clean end of input
+        if (_eof)
+            return false;
+        if (!refill())
+            return false;
+    }
+}
+
+bool SequenceReader::skip(uint64_t offset){
+    if (_failed || _cursor == NULL)
+        return false;
+    // _base + (_end - _buffer) is the input offset of _end
+    while (_base + (_end - _buffer) < offset){
+        if (_eof){
+            std::cerr<<"Error reading "<<_fastWhat<<" file: the input ends before byte offset "<<offset<<std::endl;
+            _failed = true;
+            return false;
+        }
+        _cursor = _end;
+        if (!refill())
+            return false;
+    }
+    _cursor = _buffer + (offset - _base);
+    return true;
+}
+
+
+void WriteChunk(std::ostream& out, const SequenceView& chunk){
+    out.write(chunk.data, chunk.length);
+    if (chunk.length > 0 && chunk.data[chunk.length - 1] != '\n')
+        out.put('\n');
+}
@@ -0,0 +1,232 @@
+#include "SketchAllocator.h"
+
+#include <new>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <cstdint>
+
+#include <unistd.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+/*
+Copyright 2019, Benjamin Coleman, All rights reserved.
+Free for research use. For commercial use, contact
+Rice University Invention & Patent or the author
+
+*/
+
+static const size_t kCacheLine = 64;
+static const size_t kHugePage = 2 << 20;
+
+// memory policies of mbind (from linux/mempolicy.h, which needs no libnuma)
+static const int kPolicyInterleave = 3;
+static const int kPolicyLocal = 4;
+
+
+void* HeapAllocator::allocate(size_t bytes){
+    void* memory = NULL;
+    if (posix_memalign(&memory, kCacheLine, std::max(bytes, (size_t)1)) != 0)
+        throw std::bad_alloc();
+    memset(memory, 0, bytes);
+    std::lock_guard<std::mutex> lock(_mutex);
+    _bytes += bytes;
+    return memory;
+}
+
+void HeapAllocator::deallocate(void* memory, size_t bytes){
+    if (memory == NULL)
+        return;
+    free(memory);
+    std::lock_guard<std::mutex> lock(_mutex);
+    _bytes -= bytes;
+}
+
+void HeapAllocator::usage(size_t& bytes, size_t& huge_bytes) const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    bytes = _bytes;
+    huge_bytes = 0;
+}
+
+
+// Online NUMA nodes, from a list such as "0-1,4" (a single node if it cannot be read)
+static std::vector<int> OnlineNodes(){
+    std::vector<int> nodes;
+    std::ifstream in("/sys/devices/system/node/online");
+    std::string list, item;
+    if (in && std::getline(in, list)){
+        std::stringstream items(list);
+        while (std::getline(items, item, ',')){
+            size_t dash = item.find('-');
+            int first = std::atoi(item.c_str());
+            int last = (dash == std::string::npos) ? first : std::atoi(item.c_str() + dash + 1);
+            for (int node = first; node <= last; node++) nodes.push_back(node);
+        }
+    }
+    if (nodes.empty())
+        nodes.push_back(0);
+    return nodes;
+}
+
+PageAllocator::PageAllocator(HugePages pages, NumaPolicy numa) :
+    _pages(pages), _numa(numa), _warned_hugetlb(false), _warned_numa(false) {}
+
+std::string PageAllocator::name() const {
+    const char* pages[] = {"4k", "thp", "explicit"};
+    const char* numa[] = {"default", "interleave", "local"};
+    return std::string("pages=") + pages[_pages] + " numa=" + numa[_numa];
+}
+
+void PageAllocator::place(void* memory, size_t size){
+    if (_numa == NUMA_DEFAULT)
+        return;
+    bool placed = false;
+#ifdef __linux__
+    if (_numa == NUMA_LOCAL){
+        placed = syscall(SYS_mbind, memory, size, kPolicyLocal, NULL, 0, 0) == 0;
+    } else {
+        std::vector<int> nodes = OnlineNodes();
+        if (nodes.size() < 2)
+            return; // nothing to interleave
+        unsigned long mask[16] = {0};
+        for (size_t i = 0; i < nodes.size(); i++){
+            if (nodes[i] < 16*64) mask[nodes[i] / 64] |= 1UL << (nodes[i] % 64);
+        }
+        placed = syscall(SYS_mbind, memory, size, kPolicyInterleave, mask, 16*64, 0) == 0;
+    }
+#endif
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (!placed && !_warned_numa){
+        std::cerr<<"NUMA placement is not available ("<<strerror(errno)<<"), sketches use the default placement"<<std::endl;
+        _warned_numa = true;
+    }
+}
+
+void* PageAllocator::allocate(size_t bytes){
+    bool huge = (_pages != HUGE_PAGES_NONE);
+    size_t page = huge ? kHugePage : (size_t)sysconf(_SC_PAGESIZE);
+    size_t size = std::max((bytes + page - 1) / page * page, page);
+    char* memory = NULL;
+    bool hugetlb = false;
+
+#ifdef MAP_HUGETLB
+    if (_pages == HUGE_PAGES_EXPLICIT){
+        void* map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (map != MAP_FAILED){
+            memory = (char*)map;
+            hugetlb = true;
+        } else {
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (!_warned_hugetlb){
+                std::cerr<<"No explicit huge pages available ("<<strerror(errno)<<", see /proc/sys/vm/nr_hugepages), using transparent huge pages"<<std::endl;
+                _warned_hugetlb = true;
+            }
+        }
+    }
+#endif
+    if (memory == NULL){
+        // over-allocate, so that the memory can start on a huge page boundary
+        size_t extra = huge ? page : 0;
+        void* map = mmap(NULL, size + extra, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (map == MAP_FAILED)
+            throw std::bad_alloc();
+        char* start = (char*)map;
+        char* aligned = (char*)(((uintptr_t)start + page - 1) / page * page);
+        if (aligned > start) munmap(start, aligned - start);
+        if (start + size + extra > aligned + size) munmap(aligned + size, start + size + extra - (aligned + size));
+        memory = aligned;
+#ifdef MADV_HUGEPAGE
+        if (huge) madvise(memory, size, MADV_HUGEPAGE);
+#endif
+    }
+    // before the first touch, which is when the kernel picks the node of a page
+    place(memory, size);
+
+    // anonymous mappings are already zero, and stay untouched until the sketch uses them
+    Region region = {memory, size, hugetlb};
+    std::lock_guard<std::mutex> lock(_mutex);
+    _regions.push_back(region);
+    return memory;
+}
+
+void PageAllocator::deallocate(void* memory, size_t /* bytes: the region knows its size */){
+    if (memory == NULL)
+        return;
+    std::lock_guard<std::mutex> lock(_mutex);
+    for (size_t i = 0; i < _regions.size(); i++){
+        if (_regions[i].start == memory){
+            munmap(_regions[i].start, _regions[i].size);
+            _regions.erase(_regions.begin() + i);
+            return;
+        }
+    }
+}
+
+void PageAllocator::usage(size_t& bytes, size_t& huge_bytes) const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    bytes = 0;
+    huge_bytes = 0;
+    bool transparent = false;
+    for (size_t i = 0; i < _regions.size(); i++){
+        bytes += _regions[i].size;
+        if (_regions[i].hugetlb)
+            huge_bytes += _regions[i].size;
+        else
+            transparent = transparent || _pages != HUGE_PAGES_NONE;
+    }
+    if (!transparent)
+        return;
+    // AnonHugePages of every mapping that holds one of the regions
+    std::ifstream smaps("/proc/self/smaps");
+    std::string line;
+    bool ours = false;
+    while (std::getline(smaps, line)){
+        unsigned long long first, last;
+        char dash;
+        std::istringstream fields(line);
+        if (line.size() && isxdigit((unsigned char)line[0]) && (fields >> std::hex >> first >> dash >> last) && dash == '-'){
+            ours = false;
+            for (size_t i = 0; i < _regions.size(); i++){
+                uintptr_t start = (uintptr_t)_regions[i].start;
+                if (!_regions[i].hugetlb && start >= first && start < last) ours = true;
+            }
+        } else if (ours && line.compare(0, 14, "AnonHugePages:") == 0){
+            huge_bytes += std::strtoull(line.c_str() + 14, NULL, 10) << 10;
+        }
+    }
+}
+
+
+static HeapAllocator heap_allocator;
+static SketchAllocator* current_allocator = &heap_allocator;
+
+SketchAllocator& GetSketchAllocator(){
+    return *current_allocator;
+}
+
+void SetSketchAllocator(SketchAllocator* allocator){
+    current_allocator = allocator ? allocator : &heap_allocator;
+}
+
+bool ParseHugePages(const std::string& name, HugePages& pages){
+    if (name == "none") pages = HUGE_PAGES_NONE;
+    else if (name == "thp") pages = HUGE_PAGES_THP;
+    else if (name == "explicit") pages = HUGE_PAGES_EXPLICIT;
+    else return false;
+    return true;
+}
+
+bool ParseNumaPolicy(const std::string& name, NumaPolicy& numa){
+    if (name == "none") numa = NUMA_DEFAULT;
+    else if (name == "interleave") numa = NUMA_INTERLEAVE;
+    else if (name == "local") numa = NUMA_LOCAL;
+    else return false;
+    return true;
+}
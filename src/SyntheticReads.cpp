@@ -0,0 +1,103 @@
+#include "SyntheticReads.h"
+
+#include <random>
+#include <cmath>
+#include <algorithm>
+
+/*
+Copyright 2019, Benjamin Coleman, All rights reserved.
+Free for research use. For commercial use, contact
+Rice University Invention & Patent or the author
+
+*/
+
+static const char kBases[4] = {'A', 'C', 'G', 'T'};
+
+std::vector<std::string> RandomGenomes(size_t count, size_t length, uint64_t seed){
+    std::mt19937_64 rng(seed);
+    std::vector<std::string> genomes(count);
+    for (size_t g = 0; g < count; g++){
+        genomes[g].resize(length);
+        for (size_t i = 0; i < length; i++)
+            genomes[g][i] = kBases[rng() & 3];
+    }
+    return genomes;
+}
+
+// picks genome g with probability proportional to 1/(g+1)^skew
+static std::discrete_distribution<size_t> GenomeDistribution(size_t count, double skew){
+    std::vector<double> weights(count);
+    for (size_t g = 0; g < count; g++)
+        weights[g] = 1.0 / std::pow((double)(g + 1), skew);
+    return std::discrete_distribution<size_t>(weights.begin(), weights.end());
+}
+
+std::vector<SyntheticRead> SimulateReads(const std::vector<std::string>& genomes, size_t nreads,
+    size_t read_length, double error_rate, double skew, uint64_t seed){
+    std::mt19937_64 rng(seed);
+    std::discrete_distribution<size_t> genome = GenomeDistribution(genomes.size(), skew);
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+
+    std::vector<SyntheticRead> reads(nreads);
+    for (size_t n = 0; n < nreads; n++){
+        size_t g = genome(rng);
+        const std::string& source = genomes[g];
+        size_t length = std::min(read_length, source.size());
+        size_t start = (source.size() > length) ? rng() % (source.size() - length + 1) : 0;
+        reads[n].source = g;
+        reads[n].sequence = source.substr(start, length);
+        for (size_t i = 0; i < length; i++){
+            if (uniform(rng) < error_rate){
+                // substitute a different base
+                char base = reads[n].sequence[i];
+                do { reads[n].sequence[i] = kBases[rng() & 3]; } while (reads[n].sequence[i] == base);
+            }
+        }
+    }
+    return reads;
+}
+
+std::vector<SyntheticRead> SimulateLongReads(const std::vector<std::string>& genomes, size_t nreads,
+    size_t mean_length, double error_rate, double skew, uint64_t seed){
+    std::mt19937_64 rng(seed);
+    std::discrete_distribution<size_t> genome = GenomeDistribution(genomes.size(), skew);
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+    // log-normal with mean mean_length and standard deviation mean_length/2
+    double sigma = std::sqrt(std::log(1.25));
+    std::lognormal_distribution<double> length_distribution(std::log((double)mean_length) - sigma*sigma/2, sigma);
+
+    std::vector<SyntheticRead> reads(nreads);
+    for (size_t n = 0; n < nreads; n++){
+        size_t g = genome(rng);
+        const std::string& source = genomes[g];
+        size_t length = std::min(std::max((size_t)length_distribution(rng), (size_t)1), source.size());
+        size_t start = rng() % (source.size() - length + 1);
+        reads[n].source = g;
+        std::string& sequence = reads[n].sequence;
+        sequence.reserve(length + length/8);
+        for (size_t i = start; i < start + length; i++){
+            double u = uniform(rng);
+            if (u >= error_rate){
+                sequence.push_back(source[i]);
+            } else if (u < error_rate/3){
+                char base;
+                do { base = kBases[rng() & 3]; } while (base == source[i]);
+                sequence.push_back(base);
+            } else if (u < 2*error_rate/3){
+                // insertion before the base
+                sequence.push_back(kBases[rng() & 3]);
+                sequence.push_back(source[i]);
+            }
+            // else: deletion
+        }
+    }
+    return reads;
+}
+
+void WriteFastq(std::ostream& out, const std::vector<SyntheticRead>& reads){
+    std::string quality;
+    for (size_t n = 0; n < reads.size(); n++){
+        quality.assign(reads[n].sequence.size(), 'I');
+        out<<"@read"<<n<<" genome="<<reads[n].source<<'\n'<<reads[n].sequence<<"\n+\n"<<quality<<'\n';
+    }
+}
@@ -0,0 +1,78 @@
+#include "TaskPool.h"
+
+#include <algorithm>
+
+/*
+Copyright 2019, Benjamin Coleman, All rights reserved.
+Free for research use. For commercial use, contact
+Rice University Invention & Patent or the author
+
+*/
+
+TaskPool::TaskPool(int helpers) : _stopping(false){
+    for (int t = 0; t < helpers; t++)
+        _threads.push_back(std::thread(&TaskPool::help, this));
+}
+
+TaskPool::~TaskPool(){
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stopping = true;
+        _work.notify_all();
+    }
+    for (size_t t = 0; t < _threads.size(); t++)
+        _threads[t].join();
+}
+
+bool TaskPool::claim(Loop*& loop, size_t& index){
+    if (_loops.empty())
+        return false;
+    loop = _loops.front();
+    index = loop->next++;
+    if (loop->next == loop->nchunks)
+        _loops.pop_front();
+    return true;
+}
+
+void TaskPool::run(size_t nchunks, const std::function<void(size_t)>& chunk){
+    if (nchunks == 0)
+        return;
+    if (nchunks == 1 || _threads.empty()){
+        for (size_t i = 0; i < nchunks; i++) chunk(i);
+        return;
+    }
+    Loop own = {&chunk, nchunks, 0, 0};
+    std::unique_lock<std::mutex> lock(_mutex);
+    _loops.push_back(&own);
+    _work.notify_all();
+    // work on this loop until all of its chunks are handed out, then wait for the
+    // helpers to finish theirs
+    while (own.next < own.nchunks){
+        size_t index = own.next++;
+        if (own.next == own.nchunks)
+            _loops.erase(std::find(_loops.begin(), _loops.end(), &own));
+        lock.unlock();
+        chunk(index);
+        lock.lock();
+        own.finished++;
+    }
+    _finished.wait(lock, [&]{ return own.finished == own.nchunks; });
+}
+
+void TaskPool::help(){
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (true){
+        _work.wait(lock, [this]{ return _stopping || !_loops.empty(); });
+        if (_stopping)
+            return;
+        Loop* loop;
+        size_t index;
+        if (!claim(loop, index))
+            continue;
+        lock.unlock();
+        (*loop->chunk)(index);
+        lock.lock();
+        if (++loop->finished == loop->nchunks)
+            _finished.notify_all();
+    }
+}
@@ -1,5 +1,14 @@
 #include "io.h"
 
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
 /*
 Copyright 2019, Benjamin Coleman, All rights reserved. 
 Free for research use. For commercial use, contact 
@@ -7,7 +16,7 @@ Rice University Invention & Patent or the author
 
 */
 
-bool SequenceFeatures(std::istream& in, std::string& sequence, std::string& chunk, std::string fastWhat){
+bool SequenceFeatures(std::istream& in, std::string& sequence, std::string& chunk, const std::string& fastWhat){
 
     int chunksize = 0; 
     char begin;
@@ -68,11 +77,11 @@ bool SequenceFeatures(std::istream& in, std::string& sequence, std::string& chun
     return true;
 }
 
-bool SequenceFeaturesSE(std::istream& in, std::string& sequence, std::string& chunk, std::string fastWhat){
+bool SequenceFeaturesSE(std::istream& in, std::string& sequence, std::string& chunk, const std::string& fastWhat){
     return SequenceFeatures(in, sequence, chunk, fastWhat); 
 }
 
-bool SequenceFeaturesPE(std::istream& in1, std::istream& in2, std::string& sequence, std::string& chunk1, std::string& chunk2, std::string fastWhat){
+bool SequenceFeaturesPE(std::istream& in1, std::istream& in2, std::string& sequence, std::string& chunk1, std::string& chunk2, const std::string& fastWhat){
     bool success1 = SequenceFeatures(in2, sequence, chunk2, fastWhat); 
     bool success2 = SequenceFeatures(in1, sequence, chunk1, fastWhat); 
 
@@ -88,7 +97,7 @@ bool SequenceFeaturesPE(std::istream& in1, std::istream& in2, std::string& seque
 
 }
 
-bool SequenceFeaturesI(std::istream& in, std::string& sequence, std::string& chunk, std::string fastWhat){
+bool SequenceFeaturesI(std::istream& in, std::string& sequence, std::string& chunk, const std::string& fastWhat){
     bool success = SequenceFeatures(in, sequence, chunk, fastWhat); 
 
     // now tack on another few lines for the second chunk of the interleaved file! 
@@ -110,3 +119,109 @@ bool SequenceFeaturesI(std::istream& in, std::string& sequence, std::string& chu
 }
 
 
+
+
+void ByteRangeList::add(uint64_t offset, uint64_t length){
+    if (!_ranges.empty() && _ranges.back().offset + _ranges.back().length == offset){
+        _ranges.back().length += length; 
+        return; 
+    }
+    ByteRange range; 
+    range.offset = offset; 
+    range.length = length; 
+    _ranges.push_back(range); 
+}
+
+uint64_t ByteRangeList::bytes() const {
+    uint64_t total = 0; 
+    for (size_t i = 0; i < _ranges.size(); i++)
+        total += _ranges[i].length; 
+    return total; 
+}
+
+static bool CopyRange(int in_fd, int out_fd, uint64_t offset, uint64_t length){
+    // 1. copy_file_range: no copy at all on filesystems that support reflinks
+    // 2. sendfile: copies within the kernel
+    // 3. pread/write through a userspace buffer
+    off_t in_offset = offset; 
+    bool use_copy_file_range = true; 
+    bool use_sendfile = true; 
+    std::vector<char> buffer; 
+
+    while (length > 0){
+        ssize_t n = -1; 
+#ifdef __linux__
+        if (use_copy_file_range){
+            n = copy_file_range(in_fd, &in_offset, out_fd, NULL, length, 0); 
+            if (n < 0){
+                if (errno == EINTR) continue; 
+                use_copy_file_range = false; 
+                continue; 
+            }
+        } else if (use_sendfile){
+            n = sendfile(out_fd, in_fd, &in_offset, length); 
+            if (n < 0){
+                if (errno == EINTR) continue; 
+                use_sendfile = false; 
+                continue; 
+            }
+        } else 
+#endif
+        {
+            if (buffer.empty()) buffer.resize(1 << 20); 
+            size_t want = std::min<uint64_t>(length, buffer.size()); 
+            n = pread(in_fd, buffer.data(), want, in_offset); 
+            if (n < 0 && errno == EINTR) continue; 
+            if (n < 0) return false; 
+            for (ssize_t written = 0; written < n; ){
+                ssize_t w = write(out_fd, buffer.data() + written, n - written); 
+                if (w < 0 && errno == EINTR) continue; 
+                if (w < 0) return false; 
+                written += w; 
+            }
+            in_offset += n; 
+        }
+        if (n == 0){
+            // the input is shorter than the range
+            return false; 
+        }
+        length -= n; 
+    }
+    return true; 
+}
+
+bool CopyByteRanges(const std::string& input, const std::string& output, const std::vector<ByteRange>& ranges){
+    int in_fd = open(input.c_str(), O_RDONLY); 
+    if (in_fd < 0){
+        std::cerr<<"Could not open input file "<<input<<": "<<strerror(errno)<<std::endl; 
+        return false; 
+    }
+    int out_fd = open(output.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644); 
+    if (out_fd < 0){
+        std::cerr<<"Could not open output file "<<output<<": "<<strerror(errno)<<std::endl; 
+        close(in_fd); 
+        return false; 
+    }
+
+    bool success = true; 
+    for (size_t i = 0; success && i < ranges.size(); i++){
+        success = CopyRange(in_fd, out_fd, ranges[i].offset, ranges[i].length); 
+    }
+
+    // terminate the last record if the input file did not
+    struct stat info; 
+    if (success && !ranges.empty() && fstat(in_fd, &info) == 0){
+        const ByteRange& last = ranges.back(); 
+        char c; 
+        if (last.length > 0 && last.offset + last.length == (uint64_t)info.st_size 
+            && pread(in_fd, &c, 1, info.st_size - 1) == 1 && c != '\n'){
+            success = (write(out_fd, "\n", 1) == 1); 
+        }
+    }
+    if (!success){
+        std::cerr<<"Error copying kept reads from "<<input<<" to "<<output<<": "<<strerror(errno)<<std::endl; 
+    }
+    close(in_fd); 
+    if (close(out_fd) != 0) success = false; 
+    return success; 
+}
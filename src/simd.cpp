@@ -0,0 +1,278 @@
+#include "simd.h"
+#include "MurmurHash.h"
+
+#include <limits>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define RACE_X86 1
+#include <immintrin.h>
+#endif
+
+/*
+Copyright 2019, Benjamin Coleman, All rights reserved.
+Free for research use. For commercial use, contact
+Rice University Invention & Patent or the author
+
+*/
+
+// The AVX2 and AVX-512 kernels are compiled with target attributes rather than -mavx2,
+// so that the rest of the binary still runs on CPUs without them.
+
+static const uint32_t murmur_m = 0x5bd1e995;
+static const uint32_t rehash_seed = 42;
+
+
+/* ----------------------------- scalar kernels ----------------------------- */
+
+static inline uint32_t fmix32(uint32_t h){
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
+}
+
+static void MinHashScalar(const uint64_t* kmers, size_t nkmers, const uint32_t* salts, int nseeds, int* hashes, uint32_t* minima){
+    for (int n = 0; n < nseeds; n++){
+        uint32_t salt = salts[n];
+        uint32_t minhashed_value = std::numeric_limits<uint32_t>::max();
+        uint32_t argmin = 0;
+        for (size_t i = 0; i < nkmers; i++){
+            uint32_t hashed_value = fmix32((uint32_t)kmers[i] ^ salt);
+            if (hashed_value < minhashed_value){
+                minhashed_value = hashed_value;
+                argmin = (uint32_t)(kmers[i] >> 32);
+            }
+        }
+        hashes[n] = (int)argmin;
+        if (minima) minima[n] = minhashed_value;
+    }
+}
+
+static void RehashScalar(const int* input_hashes, int* output_hashes, int nhashes, int values_per_set){
+    for (int i = 0; i < nhashes; i++){
+        output_hashes[i] = MurmurHash(input_hashes + values_per_set*i, sizeof(int)*values_per_set, rehash_seed);
+    }
+}
+
+
+#ifdef RACE_X86
+
+/* ------------------------------ AVX2 kernels ------------------------------ */
+
+__attribute__((target("avx2")))
+static inline __m256i fmix32_avx2(__m256i h){
+    h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 16));
+    h = _mm256_mullo_epi32(h, _mm256_set1_epi32((int)0x85ebca6b));
+    h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 13));
+    h = _mm256_mullo_epi32(h, _mm256_set1_epi32((int)0xc2b2ae35));
+    h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 16));
+    return h;
+}
+
+__attribute__((target("avx2")))
+static void MinHashAVX2(const uint64_t* kmers, size_t nkmers, const uint32_t* salts, int nseeds, int* hashes, uint32_t* minima){
+    // AVX2 only has signed 32-bit compares, so flip the sign bit to compare unsigned
+    const __m256i bias = _mm256_set1_epi32((int)0x80000000);
+    for (int n = 0; n < nseeds; n += 8){
+        int lanes = (nseeds - n < 8) ? (nseeds - n) : 8;
+        uint32_t block_salts[8] = {0};
+        for (int l = 0; l < lanes; l++) block_salts[l] = salts[n + l];
+
+        __m256i salt = _mm256_loadu_si256((const __m256i*)block_salts);
+        __m256i minv = _mm256_set1_epi32(-1);
+        __m256i argmin = _mm256_setzero_si256();
+        for (size_t i = 0; i < nkmers; i++){
+            __m256i lo = _mm256_set1_epi32((int)(uint32_t)kmers[i]);
+            __m256i hi = _mm256_set1_epi32((int)(uint32_t)(kmers[i] >> 32));
+            __m256i h = fmix32_avx2(_mm256_xor_si256(lo, salt));
+            __m256i lt = _mm256_cmpgt_epi32(_mm256_xor_si256(minv, bias), _mm256_xor_si256(h, bias));
+            minv = _mm256_blendv_epi8(minv, h, lt);
+            argmin = _mm256_blendv_epi8(argmin, hi, lt);
+        }
+
+        int block_hashes[8];
+        uint32_t block_minima[8];
+        _mm256_storeu_si256((__m256i*)block_hashes, argmin);
+        _mm256_storeu_si256((__m256i*)block_minima, minv);
+        for (int l = 0; l < lanes; l++) hashes[n + l] = block_hashes[l];
+        if (minima) for (int l = 0; l < lanes; l++) minima[n + l] = block_minima[l];
+    }
+}
+
+__attribute__((target("avx2")))
+static void RehashAVX2(const int* input_hashes, int* output_hashes, int nhashes, int values_per_set){
+    // MurmurHash of 4*values_per_set bytes, one group per lane. The length is always a
+    // multiple of 4, so the tail switch of MurmurHash never runs.
+    const __m256i m = _mm256_set1_epi32((int)murmur_m);
+    const __m256i stride = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_epi32(values_per_set));
+    const __m256i h0 = _mm256_set1_epi32((int)(rehash_seed ^ (uint32_t)(sizeof(int)*values_per_set)));
+
+    int i = 0;
+    for (; i + 8 <= nhashes; i += 8){
+        const int* base = input_hashes + values_per_set*i;
+        __m256i h = h0;
+        for (int j = 0; j < values_per_set; j++){
+            __m256i k = (values_per_set == 1) ? _mm256_loadu_si256((const __m256i*)base)
+                                              : _mm256_i32gather_epi32(base + j, stride, 4);
+            k = _mm256_mullo_epi32(k, m);
+            k = _mm256_xor_si256(k, _mm256_srli_epi32(k, 24));
+            k = _mm256_mullo_epi32(k, m);
+            h = _mm256_mullo_epi32(h, m);
+            h = _mm256_xor_si256(h, k);
+        }
+        h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 13));
+        h = _mm256_mullo_epi32(h, m);
+        h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 15));
+        _mm256_storeu_si256((__m256i*)(output_hashes + i), h);
+    }
+    RehashScalar(input_hashes + values_per_set*i, output_hashes + i, nhashes - i, values_per_set);
+}
+
+
+/* ----------------------------- AVX-512 kernels ---------------------------- */
+
+__attribute__((target("avx512f")))
+static inline __m512i fmix32_avx512(__m512i h){
+    h = _mm512_xor_si512(h, _mm512_srli_epi32(h, 16));
+    h = _mm512_mullo_epi32(h, _mm512_set1_epi32((int)0x85ebca6b));
+    h = _mm512_xor_si512(h, _mm512_srli_epi32(h, 13));
+    h = _mm512_mullo_epi32(h, _mm512_set1_epi32((int)0xc2b2ae35));
+    h = _mm512_xor_si512(h, _mm512_srli_epi32(h, 16));
+    return h;
+}
+
+__attribute__((target("avx512f")))
+static void MinHashAVX512(const uint64_t* kmers, size_t nkmers, const uint32_t* salts, int nseeds, int* hashes, uint32_t* minima){
+    for (int n = 0; n < nseeds; n += 16){
+        int lanes = (nseeds - n < 16) ? (nseeds - n) : 16;
+        __mmask16 active = (__mmask16)((1u << lanes) - 1);
+
+        __m512i salt = _mm512_maskz_loadu_epi32(active, salts + n);
+        __m512i minv = _mm512_set1_epi32(-1);
+        __m512i argmin = _mm512_setzero_si512();
+        for (size_t i = 0; i < nkmers; i++){
+            __m512i lo = _mm512_set1_epi32((int)(uint32_t)kmers[i]);
+            __m512i hi = _mm512_set1_epi32((int)(uint32_t)(kmers[i] >> 32));
+            __m512i h = fmix32_avx512(_mm512_xor_si512(lo, salt));
+            __mmask16 lt = _mm512_cmplt_epu32_mask(h, minv);
+            minv = _mm512_mask_mov_epi32(minv, lt, h);
+            argmin = _mm512_mask_mov_epi32(argmin, lt, hi);
+        }
+        _mm512_mask_storeu_epi32(hashes + n, active, argmin);
+        if (minima) _mm512_mask_storeu_epi32(minima + n, active, minv);
+    }
+}
+
+__attribute__((target("avx512f")))
+static void RehashAVX512(const int* input_hashes, int* output_hashes, int nhashes, int values_per_set){
+    const __m512i m = _mm512_set1_epi32((int)murmur_m);
+    const __m512i stride = _mm512_mullo_epi32(_mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15), _mm512_set1_epi32(values_per_set));
+    const __m512i h0 = _mm512_set1_epi32((int)(rehash_seed ^ (uint32_t)(sizeof(int)*values_per_set)));
+
+    for (int i = 0; i < nhashes; i += 16){
+        int lanes = (nhashes - i < 16) ? (nhashes - i) : 16;
+        __mmask16 active = (__mmask16)((1u << lanes) - 1);
+        const int* base = input_hashes + values_per_set*i;
+        __m512i h = h0;
+        for (int j = 0; j < values_per_set; j++){
+            __m512i k = _mm512_mask_i32gather_epi32(_mm512_setzero_si512(), active, stride, base + j, 4);
+            k = _mm512_mullo_epi32(k, m);
+            k = _mm512_xor_si512(k, _mm512_srli_epi32(k, 24));
+            k = _mm512_mullo_epi32(k, m);
+            h = _mm512_mullo_epi32(h, m);
+            h = _mm512_xor_si512(h, k);
+        }
+        h = _mm512_xor_si512(h, _mm512_srli_epi32(h, 13));
+        h = _mm512_mullo_epi32(h, m);
+        h = _mm512_xor_si512(h, _mm512_srli_epi32(h, 15));
+        _mm512_mask_storeu_epi32(output_hashes + i, active, h);
+    }
+}
+
+#endif // RACE_X86
+
+
+/* -------------------------------- dispatch -------------------------------- */
+
+typedef void (*minhash_kernel_t)(const uint64_t*, size_t, const uint32_t*, int, int*, uint32_t*);
+typedef void (*rehash_kernel_t)(const int*, int*, int, int);
+
+struct KernelTable {
+    SimdLevel level;
+    minhash_kernel_t minhash;
+    rehash_kernel_t rehash;
+};
+
+static KernelTable SelectKernels(SimdLevel level){
+    KernelTable table;
+    table.level = SIMD_SCALAR;
+    table.minhash = MinHashScalar;
+    table.rehash = RehashScalar;
+#ifdef RACE_X86
+    if (level == SIMD_AVX2){
+        table.level = SIMD_AVX2;
+        table.minhash = MinHashAVX2;
+        table.rehash = RehashAVX2;
+    } else if (level == SIMD_AVX512){
+        table.level = SIMD_AVX512;
+        table.minhash = MinHashAVX512;
+        table.rehash = RehashAVX512;
+    }
+#endif
+    return table;
+}
+
+SimdLevel DetectSimdLevel(){
+#ifdef RACE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+        return SIMD_AVX512;
+    if (__builtin_cpu_supports("avx2"))
+        return SIMD_AVX2;
+#endif
+    return SIMD_SCALAR;
+}
+
+static KernelTable kernels = SelectKernels(DetectSimdLevel());
+
+SimdLevel ActiveSimdLevel(){
+    return kernels.level;
+}
+
+bool SetSimdLevel(SimdLevel level){
+    if (level > DetectSimdLevel())
+        return false;
+    kernels = SelectKernels(level);
+    return true;
+}
+
+const char* SimdLevelName(SimdLevel level){
+    switch(level){
+        case SIMD_AVX2: return "avx2";
+        case SIMD_AVX512: return "avx512";
+        default: return "scalar";
+    }
+}
+
+bool ParseSimdLevel(const std::string& name, SimdLevel& level){
+    if (name == "scalar"){
+        level = SIMD_SCALAR;
+    } else if (name == "avx2"){
+        level = SIMD_AVX2;
+    } else if (name == "avx512"){
+        level = SIMD_AVX512;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+void MinHashKernel(const uint64_t* kmers, size_t nkmers, const uint32_t* salts, int nseeds, int* hashes, uint32_t* minima){
+    kernels.minhash(kmers, nkmers, salts, nseeds, hashes, minima);
+}
+
+void RehashKernel(const int* input_hashes, int* output_hashes, int nhashes, int values_per_set){
+    kernels.rehash(input_hashes, output_hashes, nhashes, values_per_set);
+}
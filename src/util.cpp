@@ -1,4 +1,5 @@
 #include "util.h"
+#include "simd.h"
 
 /*
 Copyright 2019, Benjamin Coleman, All rights reserved. 
@@ -9,8 +10,6 @@ Rice University Invention & Patent or the author
 
 
 void rehash(int* input_hashes, int* output_hashes, int nhashes, int values_per_set){
-    #pragma omp parallel for 
-    for (size_t i = 0; i < nhashes; i++){
-       output_hashes[i] = MurmurHash(input_hashes + values_per_set*i, sizeof(int)*values_per_set, 42);
-    }
+    // MurmurHash (seed 42) of each group of values_per_set hashes, vectorized across groups
+    RehashKernel(input_hashes, output_hashes, nhashes, values_per_set);
 }
\ No newline at end of file
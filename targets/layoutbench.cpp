@@ -0,0 +1,172 @@
+#include "SequenceReader.h"
+#include "SequenceMinHash.h"
+#include "RACE.h"
+#include "Pipeline.h"
+#include "SyntheticReads.h"
+
+#include <chrono>
+#include <string>
+#include <sstream>
+#include <vector>
+#include <cstring>
+#include <iostream>
+#include <algorithm>
+#include <limits>
+
+/*
+Copyright 2019, Benjamin Coleman, All rights reserved.
+Free for research use. For commercial use, contact
+Rice University Invention & Patent or the author
+
+*/
+
+
+/*
+Compares the RACE sketch layouts (one row after another vs. cache-line blocks) on
+simulated reads from genomes with skewed abundance. Every read is hashed once, then
+each layout runs the samplerace loop (query_and_add, keep if below tau) on the same
+hashes. Prints one tab-separated line per layout and range:
+
+layout, counter bits, range, sketch bytes, reads kept, genomes with a kept read,
+share of rare genomes (the less abundant half) in the input and in the sample,
+fraction of keep decisions equal to the row layout, and nanoseconds per read
+(fastest of --passes runs). The sketches are updated with the batched query_and_add,
+as in samplerace, unless --batch is 0.
+*/
+
+struct LayoutResult {
+    std::vector<bool> keep;
+    double ns_per_read;
+};
+
+static LayoutResult RunLayout(Sketch* sketch, const std::vector<int>& rehashes, size_t nreads, int reps, double tau, int passes, size_t batch){
+    LayoutResult result;
+    result.keep.resize(nreads);
+    result.ns_per_read = std::numeric_limits<double>::max();
+    std::vector<double> KDE(std::max(batch, (size_t)1));
+    for (int pass = 0; pass < passes; pass++){
+        sketch->clear();
+        auto start = std::chrono::high_resolution_clock::now();
+        if (batch == 0){
+            for (size_t n = 0; n < nreads; n++){
+                result.keep[n] = (sketch->query_and_add(rehashes.data() + n*reps) < tau);
+            }
+        } else {
+            for (size_t n = 0; n < nreads; n += batch){
+                size_t size = std::min(batch, nreads - n);
+                sketch->query_and_add(rehashes.data() + n*reps, size, KDE.data());
+                for (size_t i = 0; i < size; i++) result.keep[n + i] = (KDE[i] < tau);
+            }
+        }
+        auto end = std::chrono::high_resolution_clock::now();
+        double ns = std::chrono::duration<double, std::nano>(end - start).count() / nreads;
+        result.ns_per_read = std::min(result.ns_per_read, ns);
+    }
+    return result;
+}
+
+int main(int argc, char **argv){
+
+    if (argc > 1 && (std::strcmp("--help",argv[1]) == 0 || std::strcmp("-h",argv[1]) == 0)){
+        std::clog<<"Usage: "<<std::endl;
+        std::clog<<"layoutbench [--tau tau] [--reads n_reads] [--length read_length] [--genomes n_genomes] [--ranges r1,r2,...] [--reps race_reps] [--hashes n_minhashes] [--k kmer_size] [--counters bits] [--passes n] [--batch n_reads] [--seed seed]"<<std::endl;
+        std::clog<<"Defaults: --tau 1.0 --reads 200000 --length 150 --genomes 200 --ranges 100,1048576 --reps 10 --hashes 1 --k 16 --passes 3 --batch 1024 --seed 1"<<std::endl;
+        std::clog<<"--batch 0 calls query_and_add once per read instead of the batched (prefetching) version"<<std::endl;
+        return 0;
+    }
+
+    double tau = 1.0;
+    size_t nreads = 200000;
+    size_t read_length = 150;
+    size_t ngenomes = 200;
+    std::vector<size_t> ranges;
+    int race_repetitions = 10;
+    int hash_power = 1;
+    int kmer_k = 16;
+    int counter_bits = 0;
+    int passes = 3;
+    size_t batch = 1024;
+    uint64_t seed = 1;
+
+    for (int i = 1; i < argc; ++i){
+        if ((i+1) >= argc){
+            std::cerr<<"Missing value for "<<argv[i]<<std::endl;
+            return -1;
+        }
+        if (std::strcmp("--tau",argv[i]) == 0) tau = std::stod(argv[i+1]);
+        else if (std::strcmp("--reads",argv[i]) == 0) nreads = std::stoul(argv[i+1]);
+        else if (std::strcmp("--length",argv[i]) == 0) read_length = std::stoul(argv[i+1]);
+        else if (std::strcmp("--genomes",argv[i]) == 0) ngenomes = std::stoul(argv[i+1]);
+        else if (std::strcmp("--reps",argv[i]) == 0) race_repetitions = std::stoi(argv[i+1]);
+        else if (std::strcmp("--hashes",argv[i]) == 0) hash_power = std::stoi(argv[i+1]);
+        else if (std::strcmp("--k",argv[i]) == 0) kmer_k = std::stoi(argv[i+1]);
+        else if (std::strcmp("--counters",argv[i]) == 0) counter_bits = std::stoi(argv[i+1]);
+        else if (std::strcmp("--passes",argv[i]) == 0) passes = std::stoi(argv[i+1]);
+        else if (std::strcmp("--batch",argv[i]) == 0) batch = std::stoul(argv[i+1]);
+        else if (std::strcmp("--seed",argv[i]) == 0) seed = std::stoull(argv[i+1]);
+        else if (std::strcmp("--ranges",argv[i]) == 0){
+            std::stringstream list(argv[i+1]);
+            std::string item;
+            while (std::getline(list, item, ',')) ranges.push_back(std::stoul(item));
+        } else {
+            std::cerr<<"Unknown option "<<argv[i]<<std::endl;
+            return -1;
+        }
+        i++;
+    }
+    if (ranges.empty()){
+        ranges.push_back(100);
+        ranges.push_back(1 << 20);
+    }
+    if (tau <= 0 || nreads == 0 || ngenomes == 0 || race_repetitions <= 0 || hash_power <= 0 || kmer_k <= 0 || passes <= 0){
+        std::cerr<<"Invalid parameters"<<std::endl;
+        return -1;
+    }
+    if (counter_bits == 0) counter_bits = CounterBitsFor(race_repetitions, tau);
+    for (size_t r = 0; r < ranges.size(); r++){
+        if (ranges[r] == 0){ std::cerr<<"Invalid value in --ranges"<<std::endl; return -1; }
+    }
+
+    // genomes are a few reads long, so that reads from the same genome overlap
+    std::vector<std::string> genomes = RandomGenomes(ngenomes, 20*read_length, seed);
+    std::vector<SyntheticRead> reads = SimulateReads(genomes, nreads, read_length, 0.01, 1.0, seed + 1);
+
+    std::vector<int> rehashes(nreads*race_repetitions);
+    BatchHasher hasher(race_repetitions, hash_power, kmer_k, MINHASH_ROLLING);
+    for (size_t n = 0; n < nreads; n++){
+        hasher.hash(SequenceView(reads[n].sequence.data(), reads[n].sequence.size()), rehashes.data() + n*race_repetitions);
+    }
+
+    size_t rare_input = 0;
+    for (size_t n = 0; n < nreads; n++) rare_input += (reads[n].source >= ngenomes/2);
+
+    std::cout<<"layout\tbits\trange\tbytes\tkept\tgenomes\trare_input\trare_sample\tagreement\tns_per_read"<<std::endl;
+    for (size_t r = 0; r < ranges.size(); r++){
+        std::vector<bool> row_keep;
+        for (int blocked = 0; blocked < 2; blocked++){
+            Sketch* sketch = blocked ? MakeBlockedRACE(race_repetitions, ranges[r], counter_bits) : MakeRACE(race_repetitions, ranges[r], counter_bits);
+            if (sketch == NULL){
+                std::cerr<<"Invalid value for --counters"<<std::endl;
+                return -1;
+            }
+            LayoutResult result = RunLayout(sketch, rehashes, nreads, race_repetitions, tau, passes, batch);
+            if (!blocked) row_keep = result.keep;
+
+            size_t kept = 0, rare_kept = 0, agree = 0;
+            std::vector<bool> covered(ngenomes, false);
+            for (size_t n = 0; n < nreads; n++){
+                agree += (result.keep[n] == row_keep[n]);
+                if (!result.keep[n]) continue;
+                kept++;
+                rare_kept += (reads[n].source >= ngenomes/2);
+                covered[reads[n].source] = true;
+            }
+            std::cout<<(blocked ? "blocked" : "rows")<<'\t'<<counter_bits<<'\t'<<ranges[r]<<'\t'<<sketch->bytes()<<'\t'
+                <<kept<<'\t'<<std::count(covered.begin(), covered.end(), true)<<'\t'
+                <<(double)rare_input/nreads<<'\t'<<(kept ? (double)rare_kept/kept : 0.0)<<'\t'
+                <<(double)agree/nreads<<'\t'<<result.ns_per_read<<std::endl;
+            delete sketch;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,258 @@
+#include "io.h"
+#include "util.h"
+#include "SequenceReader.h"
+#include "SequenceMinHash.h"
+#include "RACE.h"
+#include "SyntheticReads.h"
+#include "TaskPool.h"
+
+#include <chrono>
+#include <string>
+#include <sstream>
+#include <fstream>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <algorithm>
+#include <functional>
+#include <limits>
+
+#include <unistd.h>
+
+/*
+Copyright 2019, Benjamin Coleman, All rights reserved.
+Free for research use. For commercial use, contact
+Rice University Invention & Patent or the author
+
+*/
+
+
+/*
+Per-stage throughput of the sampling loop on reproducible synthetic data (the same
+--seed always gives the same reads). Two datasets are simulated: short reads with
+substitution errors and long reads with log-normal lengths and indel errors. Each stage
+is timed on its own, on every read of a dataset, over a sweep of the parameters it
+depends on:
+
+parse          SequenceFeatures (the istream parser) on the dataset in memory
+reader         SequenceReader on the dataset file
+getHash        SequenceMinHash::getHash, for each k and reps x hashes MinHashes (with
+               --threads above 1, reads of at least --split-length bases are split
+               between the threads)
+rehash         rehash of the MinHashes into reps values, for each reps and hashes
+query_and_add  the batched RACE query_and_add, for each reps and range
+
+Prints one tab-separated line per measurement (the fastest of --passes runs), with
+"-" for the parameters that a stage does not depend on:
+
+dataset, stage, k, reps, hashes, range, reads, bases, seconds, Mbp/s, reads/s, threads
+*/
+
+struct Dataset {
+    std::string name;
+    std::vector<SyntheticRead> reads;
+    std::string fastq; // the reads as a fastq file
+    std::string path;  // where the fastq file was written
+    size_t bases;
+};
+
+static std::vector<size_t> ParseList(const char* text){
+    std::vector<size_t> values;
+    std::stringstream list(text);
+    std::string item;
+    while (std::getline(list, item, ',')) values.push_back(std::stoul(item));
+    return values;
+}
+
+// fastest of passes runs, in seconds
+static double Time(int passes, const std::function<void()>& run){
+    double best = std::numeric_limits<double>::max();
+    for (int pass = 0; pass < passes; pass++){
+        auto start = std::chrono::high_resolution_clock::now();
+        run();
+        auto end = std::chrono::high_resolution_clock::now();
+        best = std::min(best, std::chrono::duration<double>(end - start).count());
+    }
+    return best;
+}
+
+static std::string Value(size_t value){
+    return value ? std::to_string(value) : std::string("-");
+}
+
+static void Report(const Dataset& data, const char* stage, size_t k, size_t reps, size_t hashes, size_t range, double seconds, int threads = 1){
+    std::cout<<data.name<<'\t'<<stage<<'\t'<<Value(k)<<'\t'<<Value(reps)<<'\t'<<Value(hashes)<<'\t'<<Value(range)<<'\t'
+        <<data.reads.size()<<'\t'<<data.bases<<'\t'<<seconds<<'\t'<<data.bases/seconds/1e6<<'\t'<<data.reads.size()/seconds<<'\t'<<threads<<std::endl;
+}
+
+int main(int argc, char **argv){
+
+    if (argc > 1 && (std::strcmp("--help",argv[1]) == 0 || std::strcmp("-h",argv[1]) == 0)){
+        std::clog<<"Usage: "<<std::endl;
+        std::clog<<"racebench [--short-reads n_reads] [--short-length read_length] [--long-reads n_reads] [--long-length mean_length] [--k k1,k2,...] [--reps r1,r2,...] [--hashes n1,n2,...] [--ranges b1,b2,...] [--minhash engine] [--tau tau] [--passes n] [--seed seed] [--data dir] [--threads n] [--split-length bases]"<<std::endl;
+        std::clog<<"Defaults: --short-reads 100000 --short-length 150 --long-reads 1000 --long-length 10000 --k 16,32 --reps 10,50 --hashes 1,3 --ranges 10000,1048576 --minhash rolling --tau 1.0 --passes 3 --seed 1 --threads 1 --split-length 20000"<<std::endl;
+        std::clog<<"--data dir keeps the simulated fastq files in dir (otherwise they are written to a temporary directory and removed). A dataset with 0 reads is skipped."<<std::endl;
+        return 0;
+    }
+
+    size_t short_reads = 100000;
+    size_t short_length = 150;
+    size_t long_reads = 1000;
+    size_t long_length = 10000;
+    std::vector<size_t> ks = {16, 32};
+    std::vector<size_t> reps_list = {10, 50};
+    std::vector<size_t> hashes_list = {1, 3};
+    std::vector<size_t> ranges = {10000, 1 << 20};
+    MinHashEngine engine = MINHASH_ROLLING;
+    double tau = 1.0;
+    int passes = 3;
+    uint64_t seed = 1;
+    std::string data_dir;
+    int threads = 1;
+    size_t split_length = 20000;
+
+    for (int i = 1; i < argc; ++i){
+        if ((i+1) >= argc){
+            std::cerr<<"Missing value for "<<argv[i]<<std::endl;
+            return -1;
+        }
+        if (std::strcmp("--short-reads",argv[i]) == 0) short_reads = std::stoul(argv[i+1]);
+        else if (std::strcmp("--short-length",argv[i]) == 0) short_length = std::stoul(argv[i+1]);
+        else if (std::strcmp("--long-reads",argv[i]) == 0) long_reads = std::stoul(argv[i+1]);
+        else if (std::strcmp("--long-length",argv[i]) == 0) long_length = std::stoul(argv[i+1]);
+        else if (std::strcmp("--k",argv[i]) == 0) ks = ParseList(argv[i+1]);
+        else if (std::strcmp("--reps",argv[i]) == 0) reps_list = ParseList(argv[i+1]);
+        else if (std::strcmp("--hashes",argv[i]) == 0) hashes_list = ParseList(argv[i+1]);
+        else if (std::strcmp("--ranges",argv[i]) == 0) ranges = ParseList(argv[i+1]);
+        else if (std::strcmp("--tau",argv[i]) == 0) tau = std::stod(argv[i+1]);
+        else if (std::strcmp("--passes",argv[i]) == 0) passes = std::stoi(argv[i+1]);
+        else if (std::strcmp("--seed",argv[i]) == 0) seed = std::stoull(argv[i+1]);
+        else if (std::strcmp("--data",argv[i]) == 0) data_dir = argv[i+1];
+        else if (std::strcmp("--threads",argv[i]) == 0) threads = std::stoi(argv[i+1]);
+        else if (std::strcmp("--split-length",argv[i]) == 0) split_length = std::stoul(argv[i+1]);
+        else if (std::strcmp("--minhash",argv[i]) == 0){
+            if (!ParseMinHashEngine(argv[i+1], engine)){
+                std::cerr<<"Invalid value for --minhash"<<std::endl;
+                return -1;
+            }
+        } else {
+            std::cerr<<"Unknown option "<<argv[i]<<std::endl;
+            return -1;
+        }
+        i++;
+    }
+    std::vector<size_t> all = ks;
+    all.insert(all.end(), reps_list.begin(), reps_list.end());
+    all.insert(all.end(), hashes_list.begin(), hashes_list.end());
+    all.insert(all.end(), ranges.begin(), ranges.end());
+    if (tau <= 0 || passes <= 0 || threads <= 0 || short_length == 0 || long_length == 0 || ks.empty() || reps_list.empty()
+        || hashes_list.empty() || ranges.empty() || std::count(all.begin(), all.end(), 0)){
+        std::cerr<<"Invalid parameters"<<std::endl;
+        return -1;
+    }
+
+    bool temporary = data_dir.empty();
+    if (temporary){
+        const char* tmp = getenv("TMPDIR");
+        std::string pattern = std::string(tmp ? tmp : "/tmp") + "/racebench.XXXXXX";
+        if (mkdtemp(&pattern[0]) == NULL){
+            std::cerr<<"Could not create a temporary directory"<<std::endl;
+            return -1;
+        }
+        data_dir = pattern;
+    }
+
+    // both datasets come from the same skewed mixture of genomes, long enough for long reads
+    std::vector<std::string> genomes = RandomGenomes(20, std::max(20*short_length, 10*long_length), seed);
+    std::vector<Dataset> datasets(2);
+    datasets[0].name = "short";
+    datasets[0].reads = SimulateReads(genomes, short_reads, short_length, 0.01, 1.0, seed + 1);
+    datasets[1].name = "long";
+    datasets[1].reads = SimulateLongReads(genomes, long_reads, long_length, 0.05, 1.0, seed + 2);
+    for (size_t d = 0; d < datasets.size(); d++){
+        Dataset& data = datasets[d];
+        std::ostringstream fastq;
+        WriteFastq(fastq, data.reads);
+        data.fastq = fastq.str();
+        data.bases = 0;
+        for (size_t n = 0; n < data.reads.size(); n++) data.bases += data.reads[n].sequence.size();
+        data.path = data_dir + "/" + data.name + ".fastq";
+        std::ofstream out(data.path.c_str(), std::ios::binary);
+        out.write(data.fastq.data(), data.fastq.size());
+        out.close();
+        if (!out){
+            std::cerr<<"Could not write "<<data.path<<std::endl;
+            return -1;
+        }
+    }
+
+    TaskPool pool(threads - 1);
+    std::cout<<"dataset\tstage\tk\treps\thashes\trange\treads\tbases\tseconds\tmbp_per_s\treads_per_s\tthreads"<<std::endl;
+    for (size_t d = 0; d < datasets.size(); d++){
+        const Dataset& data = datasets[d];
+        size_t nreads = data.reads.size();
+        if (nreads == 0) continue;
+
+        double seconds = Time(passes, [&](){
+            std::istringstream in(data.fastq);
+            std::string sequence, chunk;
+            for (size_t n = 0; n < nreads; n++) SequenceFeatures(in, sequence, chunk, "fastq");
+        });
+        Report(data, "parse", 0, 0, 0, 0, seconds);
+
+        seconds = Time(passes, [&](){
+            SequenceReader reader;
+            SequenceRecord record;
+            if (!reader.open(data.path, "fastq")) return;
+            while (reader.next(record)) {}
+        });
+        Report(data, "reader", 0, 0, 0, 0, seconds);
+
+        for (size_t r = 0; r < reps_list.size(); r++){
+            for (size_t h = 0; h < hashes_list.size(); h++){
+                size_t reps = reps_list[r], hashes = hashes_list[h];
+                std::vector<int> raw(nreads*reps*hashes);
+                std::vector<int> rehashes(nreads*reps);
+                for (size_t kk = 0; kk < ks.size(); kk++){
+                    SequenceMinHash minhash(reps*hashes, engine);
+                    if (threads > 1) minhash.setPool(&pool, split_length);
+                    seconds = Time(passes, [&](){
+                        for (size_t n = 0; n < nreads; n++){
+                            const std::string& sequence = data.reads[n].sequence;
+                            minhash.getHash(ks[kk], sequence.data(), sequence.size(), raw.data() + n*reps*hashes);
+                        }
+                    });
+                    Report(data, "getHash", ks[kk], reps, hashes, 0, seconds, threads);
+                }
+                // the rehash and sketch stages use the MinHashes of the last k
+                seconds = Time(passes, [&](){
+                    for (size_t n = 0; n < nreads; n++)
+                        rehash(raw.data() + n*reps*hashes, rehashes.data() + n*reps, reps, hashes);
+                });
+                Report(data, "rehash", 0, reps, hashes, 0, seconds);
+
+                // the sketch only sees the rehashed values, so one hashes setting is enough
+                if (h != 0) continue;
+                std::vector<double> KDE(nreads);
+                for (size_t b = 0; b < ranges.size(); b++){
+                    Sketch* sketch = MakeRACE(reps, ranges[b], CounterBitsFor(reps, tau));
+                    seconds = Time(passes, [&](){
+                        sketch->clear();
+                        for (size_t n = 0; n < nreads; n += 1024)
+                            sketch->query_and_add(rehashes.data() + n*reps, std::min((size_t)1024, nreads - n), KDE.data() + n);
+                    });
+                    Report(data, "query_and_add", 0, reps, 0, ranges[b], seconds);
+                    delete sketch;
+                }
+            }
+        }
+    }
+
+    if (temporary){
+        for (size_t d = 0; d < datasets.size(); d++) unlink(datasets[d].path.c_str());
+        rmdir(data_dir.c_str());
+    }
+    return 0;
+}
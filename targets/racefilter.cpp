@@ -0,0 +1,194 @@
+#include "SequenceReader.h"
+#include "SampleWriter.h"
+#include "ScoreFile.h"
+
+#include <map>
+#include <string>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+/*
+Copyright 2019, Benjamin Coleman, All rights reserved.
+Free for research use. For commercial use, contact
+Rice University Invention & Patent or the author
+
+*/
+
+
+/*
+Takes the sample of a new tau from the scores of an earlier samplerace --scores run,
+without hashing the reads again:
+
+racefilter <format> <scores> <input> <output> --tau tau
+racefilter <format> <scores> <input> <output> --sample-size n_reads
+
+The input (and format) must be the one the scores were computed from. A read is kept
+if its KDE is below tau, which is exactly the sample of samplerace with that tau (and
+the other parameters of the scored run). With --sample-size, tau is the largest one
+that keeps at most n_reads reads (or pairs), which takes an extra pass over the scores.
+*/
+
+// The largest threshold on the score sums that keeps at most size reads: every read
+// whose sum is below the returned value is kept
+static bool SumThreshold(const std::string& path, uint64_t size, uint64_t& threshold){
+    ScoreReader scores;
+    if (!scores.open(path))
+        return false;
+    std::map<uint64_t, uint64_t> counts;
+    uint64_t sum;
+    while (scores.next(sum)) counts[sum]++;
+    if (scores.failed())
+        return false;
+    threshold = 0;
+    uint64_t kept = 0;
+    for (std::map<uint64_t, uint64_t>::iterator it = counts.begin(); it != counts.end(); ++it){
+        if (kept + it->second > size)
+            break;
+        kept += it->second;
+        threshold = it->first + 1;
+    }
+    return true;
+}
+
+int main(int argc, char **argv){
+
+    if (argc < 5){
+        std::clog<<"Usage: "<<std::endl;
+        std::clog<<"racefilter <format> <scores> <input> <output> (--tau tau | --sample-size n_reads) [--format fastq|fasta]"<<std::endl;
+        std::clog<<"format: Either PE, SE, or I. For PE format, specify two input and two output files."<<std::endl;
+        std::clog<<"scores: file written by samplerace --scores for the same input"<<std::endl;
+        std::clog<<"--tau tau: keep the reads with a KDE below tau, as samplerace with this tau would"<<std::endl;
+        std::clog<<"--sample-size n_reads: keep at most n_reads reads (or pairs), with the largest tau that does"<<std::endl;
+        std::clog<<"Example: racefilter SE run.kde data/input.fastq data/output.fastq --tau 2.5"<<std::endl;
+        return -1;
+    }
+
+    int format; // ENUM: 1 = unpaired, 2 = interleaved, 3 = paired
+    if (std::strcmp("SE",argv[1]) == 0){
+        format = 1;
+    } else if (std::strcmp("I",argv[1]) == 0){
+        format = 2;
+    } else if (std::strcmp("PE",argv[1]) == 0){
+        format = 3;
+        if (argc < 7){
+            std::cerr<<"For paired-end reads, please specify the files as: scores input1 input2 output1 output2"<<std::endl;
+            return -1;
+        }
+    } else {
+        std::cerr<<"Invalid format, please specify either SE, PE, or I"<<std::endl;
+        return -1;
+    }
+    std::string scores_path = argv[2];
+    std::string input1 = argv[3];
+    std::string input2 = (format == 3) ? argv[4] : "";
+    std::string output1 = (format == 3) ? argv[5] : argv[4];
+    std::string output2 = (format == 3) ? argv[6] : "";
+
+    double tau = 0;
+    long long sample_size = -1;
+    std::string file_extension;
+    for (int i = (format == 3) ? 7 : 5; i < argc; i += 2){
+        bool ok = (i+1) < argc;
+        if (ok && std::strcmp("--tau",argv[i]) == 0) ok = (tau = std::atof(argv[i+1])) > 0;
+        else if (ok && std::strcmp("--sample-size",argv[i]) == 0) ok = (sample_size = std::atoll(argv[i+1])) >= 0;
+        else if (ok && std::strcmp("--format",argv[i]) == 0){
+            file_extension = argv[i+1];
+            ok = (file_extension == "fastq" || file_extension == "fasta");
+        } else {
+            std::cerr<<"Unknown option "<<argv[i]<<std::endl;
+            return -1;
+        }
+        if (!ok){
+            std::cerr<<"Invalid argument for optional parameter "<<argv[i]<<std::endl;
+            return -1;
+        }
+    }
+    if ((tau > 0) == (sample_size >= 0)){
+        std::cerr<<"Please specify either --tau or --sample-size"<<std::endl;
+        return -1;
+    }
+
+    // file type from --format, or from the extension (ignoring .gz and .bgz)
+    if (file_extension.empty()){
+        std::string filename = input1;
+        for (const char* suffix : {".gz", ".bgz"}){
+            size_t length = std::strlen(suffix);
+            if (filename.length() > length && filename.compare(filename.length() - length, length, suffix) == 0){
+                filename.erase(filename.length() - length);
+            }
+        }
+        size_t idx = filename.rfind('.');
+        file_extension = (idx == std::string::npos) ? "" : filename.substr(idx+1);
+        if (file_extension == "fq") file_extension = "fastq";
+        if (file_extension == "fa") file_extension = "fasta";
+        if (file_extension != "fasta" && file_extension != "fastq"){
+            std::cerr<<"Unknown file type of "<<input1<<", please use a .fasta or .fastq extension or --format"<<std::endl;
+            return -1;
+        }
+    }
+
+    // keep a read if its sum is below threshold (--sample-size) or if sum / reps < tau,
+    // computed as the sketch computes the KDE
+    uint64_t threshold = 0;
+    if (sample_size >= 0 && !SumThreshold(scores_path, sample_size, threshold)) return -1;
+
+    ScoreReader scores;
+    if (!scores.open(scores_path)) return -1;
+    double reps = scores.reps();
+    SequenceReader datastream1;
+    SequenceReader datastream2;
+    if (!datastream1.open(input1, file_extension)) return -1;
+    if (format == 3 && !datastream2.open(input2, file_extension)) return -1;
+    SampleWriter* samplestream1 = OpenSampleWriter(output1, 1);
+    if (samplestream1 == NULL) return -1;
+    SampleWriter* samplestream2 = NULL;
+    if (format == 3){
+        samplestream2 = OpenSampleWriter(output2, 1);
+        if (samplestream2 == NULL) return -1;
+    }
+
+    int records_per_chunk = (format == 2) ? 2 : 1;
+    SequenceRecord record1;
+    SequenceRecord record2;
+    uint64_t reads = 0, kept = 0, sum = 0;
+    bool ok = true;
+    while (datastream1.next(record1, records_per_chunk)){
+        if (format == 3 && !datastream2.next(record2)){
+            std::cerr<<"Error reading second "<<file_extension<<" file: paired-end files are not synchronized"<<std::endl;
+            ok = false;
+            break;
+        }
+        if (!scores.next(sum)){
+            if (!scores.failed()) std::cerr<<"The score file has fewer scores than the input has reads; was it written for this input?"<<std::endl;
+            ok = false;
+            break;
+        }
+        reads++;
+        bool keep = (sample_size >= 0) ? (sum < threshold) : (sum / reps < tau);
+        if (keep){
+            bool written = WriteChunk(*samplestream1, record1.chunk);
+            if (format == 3) written = WriteChunk(*samplestream2, record2.chunk) && written;
+            if (!written){
+                ok = false; // (close reports the error)
+                break;
+            }
+            kept++;
+        }
+    }
+    if (ok && !datastream1.failed() && scores.next(sum)){
+        std::cerr<<"The score file has more scores than the input has reads; was it written for this input?"<<std::endl;
+        ok = false;
+    }
+    if (!samplestream1->close()) ok = false;
+    if (samplestream2 && !samplestream2->close()) ok = false;
+    delete samplestream1;
+    delete samplestream2;
+    if (!ok || datastream1.failed() || datastream2.failed() || scores.failed())
+        return -1;
+
+    std::clog<<"Kept "<<kept<<" of "<<reads<<" reads";
+    if (sample_size >= 0) std::clog<<" (tau = "<<threshold / reps<<")";
+    std::clog<<std::endl;
+    return 0;
+}
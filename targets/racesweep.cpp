@@ -0,0 +1,343 @@
+#include "io.h"
+#include "util.h"
+#include "simd.h"
+#include "SequenceReader.h"
+#include "SequenceMinHash.h"
+#include "RACE.h"
+#include "Pipeline.h"
+#include "SampleWriter.h"
+#include "TaskPool.h"
+
+#include <chrono>
+#include <string>
+#include <sstream>
+#include <vector>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <algorithm>
+
+/*
+Copyright 2019, Benjamin Coleman, All rights reserved.
+Free for research use. For commercial use, contact
+Rice University Invention & Patent or the author
+
+*/
+
+
+/*
+Samples one input with every combination of a grid of parameters, in a single pass:
+
+racesweep <format> <input> [input2] --tau t1,t2,... --k k1,... --reps r1,... --hashes n1,... --range b1,...
+
+The work is shared as far as the parameters allow:
+- each read is parsed once, for all configurations
+- configurations with the same k share one k-mer scan and one set of MinHashes (the
+  MinHashes of r*n seeds are the first r*n of any larger set, except with --minhash oph,
+  whose MinHashes are shared by configurations with the same k and r*n)
+- configurations that only differ in tau share one sketch and one KDE per read
+
+Every configuration keeps the same reads as samplerace with the same parameters. Prints
+one tab-separated line per configuration:
+
+tau, k, reps, hashes, range, reads, kept, keep_rate
+
+With --output-prefix, the sample of each configuration is also written to
+prefix.tau<t>.k<k>.reps<r>.hashes<n>.range<b>.<fastq|fasta> (with _1 and _2 before the
+extension for paired-end reads).
+*/
+
+static const size_t batch_reads = 1024;
+static const size_t batch_bases = 1 << 22;
+
+// MinHashes shared by the sketches with the same k (and, for oph, the same r*n)
+struct HashGroup {
+    int k;
+    int nhashes; // the most MinHashes any sketch of the group uses
+    std::vector<SequenceMinHash*> minhash; // one per worker
+    std::vector<std::vector<int> > raw;    // MinHashes of a batch, one per worker
+};
+
+// A sketch shared by the configurations that only differ in tau
+struct SweepSketch {
+    size_t group;
+    int k, reps, hashes, range;
+    size_t offset; // position of its rehashes in a read's block of ReadBatch::rehashes
+    Sketch* sketch;
+};
+
+struct SweepRun {
+    double tau;
+    size_t sketch;
+    uint64_t kept;
+    SampleWriter* out1;
+    SampleWriter* out2;
+};
+
+template <typename T>
+static bool ParseList(const char* text, std::vector<T>& values){
+    values.clear();
+    std::stringstream list(text);
+    std::string item;
+    while (std::getline(list, item, ',')){
+        std::stringstream parse(item);
+        T value;
+        if (!(parse >> value) || value <= 0) return false;
+        values.push_back(value);
+    }
+    return !values.empty();
+}
+
+static std::string RunPath(const std::string& prefix, const SweepRun& run, const SweepSketch& s, const char* mate, const std::string& extension){
+    std::ostringstream path;
+    path<<prefix<<".tau"<<run.tau<<".k"<<s.k<<".reps"<<s.reps<<".hashes"<<s.hashes<<".range"<<s.range<<mate<<"."<<extension;
+    return path.str();
+}
+
+int main(int argc, char **argv){
+
+    if (argc < 3){
+        std::clog<<"Usage: "<<std::endl;
+        std::clog<<"racesweep <format> <input> [input2] [--tau t1,t2,...] [--k k1,k2,...] [--reps r1,r2,...] [--hashes n1,n2,...] [--range b1,b2,...] [--minhash engine] [--simd level] [--threads num_threads] [--split-length bases] [--format fastq|fasta] [--output-prefix prefix]"<<std::endl;
+        std::clog<<"Samples the input once with every combination of the listed parameters, in one pass over the input, and prints the number of kept reads of each. The defaults are those of samplerace (--tau 1.0 --k 16 --reps 10 --hashes 1 --range 10000 --minhash rolling --threads 1 --split-length 20000)."<<std::endl;
+        std::clog<<"format: Either PE, SE, or I. For PE format, specify two input files."<<std::endl;
+        std::clog<<"[--output-prefix prefix]: (Optional) Also write the sample of each configuration to prefix.tau<t>.k<k>.reps<r>.hashes<n>.range<b>.<extension>"<<std::endl;
+        std::clog<<"Example: racesweep SE data/input.fastq --tau 0.5,1,2 --k 16,20 --reps 10,50 --range 10000,100000"<<std::endl;
+        return -1;
+    }
+
+    int format; // ENUM: 1 = unpaired, 2 = interleaved, 3 = paired
+    if (std::strcmp("SE",argv[1]) == 0){
+        format = 1;
+    } else if (std::strcmp("I",argv[1]) == 0){
+        format = 2;
+    } else if (std::strcmp("PE",argv[1]) == 0){
+        format = 3;
+        if (argc < 4){
+            std::cerr<<"For paired-end reads, please specify two input files"<<std::endl;
+            return -1;
+        }
+    } else {
+        std::cerr<<"Invalid format, please specify either SE, PE, or I"<<std::endl;
+        return -1;
+    }
+    std::string input1 = argv[2];
+    std::string input2 = (format == 3) ? argv[3] : "";
+
+    std::vector<double> taus = {1.0};
+    std::vector<int> ks = {16};
+    std::vector<int> reps_list = {10};
+    std::vector<int> hashes_list = {1};
+    std::vector<int> ranges = {10000};
+    MinHashEngine minhash_engine = MINHASH_ROLLING;
+    SimdLevel simd_level = DetectSimdLevel();
+    int num_threads = 1;
+    long split_length = 20000;
+    std::string file_extension;
+    std::string output_prefix;
+
+    for (int i = (format == 3) ? 4 : 3; i < argc; i += 2){
+        bool ok = (i+1) < argc;
+        if (ok && std::strcmp("--tau",argv[i]) == 0) ok = ParseList(argv[i+1], taus);
+        else if (ok && std::strcmp("--k",argv[i]) == 0) ok = ParseList(argv[i+1], ks);
+        else if (ok && std::strcmp("--reps",argv[i]) == 0) ok = ParseList(argv[i+1], reps_list);
+        else if (ok && std::strcmp("--hashes",argv[i]) == 0) ok = ParseList(argv[i+1], hashes_list);
+        else if (ok && std::strcmp("--range",argv[i]) == 0) ok = ParseList(argv[i+1], ranges);
+        else if (ok && std::strcmp("--minhash",argv[i]) == 0) ok = ParseMinHashEngine(argv[i+1], minhash_engine);
+        else if (ok && std::strcmp("--simd",argv[i]) == 0) ok = ParseSimdLevel(argv[i+1], simd_level);
+        else if (ok && std::strcmp("--threads",argv[i]) == 0) ok = (num_threads = std::atoi(argv[i+1])) > 0;
+        else if (ok && std::strcmp("--split-length",argv[i]) == 0) ok = (split_length = std::atol(argv[i+1])) >= 0;
+        else if (ok && std::strcmp("--format",argv[i]) == 0){
+            file_extension = argv[i+1];
+            ok = (file_extension == "fastq" || file_extension == "fasta");
+        }
+        else if (ok && std::strcmp("--output-prefix",argv[i]) == 0) output_prefix = argv[i+1];
+        else {
+            std::cerr<<"Unknown option "<<argv[i]<<std::endl;
+            return -1;
+        }
+        if (!ok){
+            std::cerr<<"Invalid argument for optional parameter "<<argv[i]<<std::endl;
+            return -1;
+        }
+    }
+    if (!SetSimdLevel(simd_level)){ std::cerr<<"This CPU does not support --simd "<<SimdLevelName(simd_level)<<std::endl; return -1; }
+    if (format == 3 && input1 == "-" && input2 == "-"){ std::cerr<<"Only one of the paired-end inputs can be standard input"<<std::endl; return -1; }
+
+    // file type from --format, or from the extension (ignoring .gz and .bgz)
+    if (file_extension.empty()){
+        std::string filename = input1;
+        for (const char* suffix : {".gz", ".bgz"}){
+            size_t length = std::strlen(suffix);
+            if (filename.length() > length && filename.compare(filename.length() - length, length, suffix) == 0){
+                filename.erase(filename.length() - length);
+            }
+        }
+        size_t idx = filename.rfind('.');
+        file_extension = (idx == std::string::npos) ? "" : filename.substr(idx+1);
+        if (file_extension == "fq") file_extension = "fastq";
+        if (file_extension == "fa") file_extension = "fasta";
+        if (file_extension != "fasta" && file_extension != "fastq"){
+            std::cerr<<"Unknown file type of "<<input1<<", please use a .fasta or .fastq extension or --format"<<std::endl;
+            return -1;
+        }
+    }
+
+    // the grid: one sketch per (k, reps, hashes, range), shared by every tau
+    std::vector<HashGroup> groups;
+    std::vector<SweepSketch> sketches;
+    std::vector<SweepRun> runs;
+    size_t total_reps = 0;
+    double max_tau = *std::max_element(taus.begin(), taus.end());
+    for (int k : ks) for (int reps : reps_list) for (int hashes : hashes_list) for (int range : ranges){
+        int nhashes = reps * hashes;
+        size_t g = 0;
+        while (g < groups.size() && (groups[g].k != k || (minhash_engine == MINHASH_ONEPERM && groups[g].nhashes != nhashes))) g++;
+        if (g == groups.size()){
+            HashGroup group;
+            group.k = k;
+            group.nhashes = 0;
+            groups.push_back(group);
+        }
+        groups[g].nhashes = std::max(groups[g].nhashes, nhashes);
+
+        SweepSketch s;
+        s.group = g;
+        s.k = k; s.reps = reps; s.hashes = hashes; s.range = range;
+        s.offset = total_reps;
+        // counters wide enough for the largest tau give every tau its samplerace sample
+        s.sketch = MakeRACE(reps, range, CounterBitsFor(reps, max_tau));
+        total_reps += reps;
+        for (double tau : taus){
+            SweepRun run = {tau, sketches.size(), 0, NULL, NULL};
+            runs.push_back(run);
+        }
+        sketches.push_back(s);
+    }
+
+    TaskPool* hash_pool = (num_threads > 1 && split_length > 0) ? new TaskPool(num_threads - 1) : NULL;
+    for (size_t g = 0; g < groups.size(); g++){
+        for (int t = 0; t < num_threads; t++){
+            groups[g].minhash.push_back(new SequenceMinHash(groups[g].nhashes, minhash_engine));
+            groups[g].minhash[t]->setPool(hash_pool, split_length);
+        }
+        groups[g].raw.resize(num_threads);
+    }
+
+    SequenceReader datastream1;
+    SequenceReader datastream2;
+    if (!datastream1.open(input1, file_extension, num_threads)) return -1;
+    if (format == 3 && !datastream2.open(input2, file_extension, num_threads)) return -1;
+    bool failed = false;
+    if (!output_prefix.empty()){
+        for (size_t r = 0; r < runs.size() && !failed; r++){
+            const SweepSketch& s = sketches[runs[r].sketch];
+            runs[r].out1 = OpenSampleWriter(RunPath(output_prefix, runs[r], s, (format == 3) ? "_1" : "", file_extension), 1);
+            if (format == 3) runs[r].out2 = OpenSampleWriter(RunPath(output_prefix, runs[r], s, "_2", file_extension), 1);
+            failed = (runs[r].out1 == NULL || (format == 3 && runs[r].out2 == NULL));
+        }
+    }
+
+    int records_per_chunk = (format == 2) ? 2 : 1;
+    bool synchronized = true;
+    uint64_t reads = 0;
+    auto start = std::chrono::steady_clock::now();
+
+    Pipeline pipeline(num_threads, batch_reads);
+
+    Pipeline::ReadStage read = [&](ReadBatch& batch){
+        SequenceRecord record1;
+        SequenceRecord record2;
+        size_t bases = 0;
+        while (batch.size < pipeline.batch_size() && bases < batch_bases){
+            if (!datastream1.next(record1, records_per_chunk)) return false;
+            if (format == 3 && !datastream2.next(record2)){
+                std::cerr<<"Error reading second "<<file_extension<<" file: paired-end files are not synchronized"<<std::endl;
+                synchronized = false;
+                return false;
+            }
+            batch.records1.push_back(datastream1.mapped() ? record1 : batch.copy(record1));
+            if (format == 3){
+                batch.records2.push_back(datastream2.mapped() ? record2 : batch.copy(record2));
+            }
+            bases += record1.sequence.length;
+            batch.size++;
+        }
+        return true;
+    };
+
+    // one scan per group gives the MinHashes of all of its sketches, which take the
+    // first reps * hashes of them. The rehashes of sketch s for read i are at
+    // size * s.offset + i * s.reps.
+    Pipeline::WorkStage work = [&](ReadBatch& batch, int worker){
+        batch.rehashes.resize(batch.size * total_reps);
+        for (size_t g = 0; g < groups.size(); g++){
+            HashGroup& group = groups[g];
+            std::vector<int>& raw = group.raw[worker];
+            raw.resize(batch.size * group.nhashes);
+            for (size_t i = 0; i < batch.size; i++){
+                const SequenceView& sequence = batch.records1[i].sequence;
+                group.minhash[worker]->getHash(group.k, sequence.data, sequence.length, raw.data() + i*group.nhashes);
+            }
+            for (size_t s = 0; s < sketches.size(); s++){
+                if (sketches[s].group != g) continue;
+                int* rehashes = batch.rehashes.data() + batch.size*sketches[s].offset;
+                for (size_t i = 0; i < batch.size; i++){
+                    rehash(raw.data() + i*group.nhashes, rehashes + i*sketches[s].reps, sketches[s].reps, sketches[s].hashes);
+                }
+            }
+        }
+    };
+
+    Pipeline::CommitStage commit = [&](ReadBatch& batch){
+        bool written = true;
+        batch.kde.resize(batch.size * sketches.size());
+        for (size_t s = 0; s < sketches.size(); s++){
+            sketches[s].sketch->query_and_add(batch.rehashes.data() + batch.size*sketches[s].offset, batch.size, batch.kde.data() + s*batch.size);
+        }
+        for (size_t r = 0; r < runs.size(); r++){
+            SweepRun& run = runs[r];
+            const double* kde = batch.kde.data() + run.sketch*batch.size;
+            for (size_t i = 0; i < batch.size; i++){
+                if (kde[i] >= run.tau) continue;
+                run.kept++;
+                if (run.out1 && !WriteChunk(*run.out1, batch.records1[i].chunk)) written = false;
+                if (run.out2 && !WriteChunk(*run.out2, batch.records2[i].chunk)) written = false;
+            }
+        }
+        reads += batch.size;
+        // stop at the first write error (close() reports it)
+        return written;
+    };
+
+    if (!failed && !pipeline.run(read, work, commit)) failed = true;
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    for (size_t r = 0; r < runs.size(); r++){
+        if (runs[r].out1 && !runs[r].out1->close()) failed = true;
+        if (runs[r].out2 && !runs[r].out2->close()) failed = true;
+        delete runs[r].out1;
+        delete runs[r].out2;
+    }
+    failed = failed || !synchronized || datastream1.failed() || datastream2.failed();
+    datastream1.close();
+    datastream2.close();
+
+    if (!failed){
+        std::cout<<"tau\tk\treps\thashes\trange\treads\tkept\tkeep_rate"<<std::endl;
+        for (size_t r = 0; r < runs.size(); r++){
+            const SweepSketch& s = sketches[runs[r].sketch];
+            std::cout<<runs[r].tau<<'\t'<<s.k<<'\t'<<s.reps<<'\t'<<s.hashes<<'\t'<<s.range<<'\t'<<reads<<'\t'
+                <<runs[r].kept<<'\t'<<(reads ? (double)runs[r].kept/reads : 0.0)<<std::endl;
+        }
+        std::clog<<"Swept "<<runs.size()<<" configurations ("<<sketches.size()<<" sketches, "<<groups.size()
+            <<" k-mer scans) over "<<reads<<" reads in "<<seconds<<" s"<<std::endl;
+    }
+
+    for (size_t g = 0; g < groups.size(); g++){
+        for (size_t t = 0; t < groups[g].minhash.size(); t++) delete groups[g].minhash[t];
+    }
+    delete hash_pool;
+    for (size_t s = 0; s < sketches.size(); s++) delete sketches[s].sketch;
+    return failed ? -1 : 0;
+}
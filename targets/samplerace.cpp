@@ -1,11 +1,21 @@
 #include "io.h"
+#include "SequenceReader.h"
 #include "SequenceMinHash.h"
 #include "RACE.h"
 #include "util.h"
+#include "simd.h"
+#include "Pipeline.h"
+#include "SampleWriter.h"
+#include "Checkpoint.h"
+#include "SamplingStats.h"
+#include "ScoreFile.h"
+#include "SketchAllocator.h"
 
 #include <chrono>
 #include <string>
 #include <cstring>
+#include <sstream>
+#include <iomanip>
 #include <algorithm>
 
 /*
@@ -32,28 +42,58 @@ samplerace tau I input output <flags>
 
 */
 
+// Reads are handed between the pipeline stages in batches of at most this many reads
+// (or bases, whichever limit is reached first)
+static const size_t batch_reads = 1024; 
+static const size_t batch_bases = 1 << 22; 
+
 int main(int argc, char **argv){
 
     if (argc < 4){
         std::clog<<"Usage: "<<std::endl; 
         std::clog<<"samplerace <tau> <format> <input> <output>"; 
-        std::clog<<" [--range race_range] [--reps race_reps] [--hashes n_minhashes] [-k kmer_size]"<<std::endl; 
+        std::clog<<" [--range race_range] [--reps race_reps] [--hashes n_minhashes] [-k kmer_size] [--minhash engine] [--simd level] [--byte-ranges] [--threads num_threads] [--split-length bases] [--dup-cache megabytes] [--relaxed] [--sharded merge_interval] [--window n_reads] [--epochs n] [--counters bits] [--blocked] [--huge-pages none|thp|explicit] [--numa none|interleave|local] [--load-sketch path] [--save-sketch path] [--checkpoint path] [--checkpoint-every n_reads] [--resume] [--format fastq|fasta] [--stats path] [--progress seconds] [--perf] [--scores path]"<<std::endl; 
         std::clog<<"Positional arguments: "<<std::endl; 
         std::clog<<"tau: floating point RACE sampling threshold. Roughly determines how many samples you will store. You may specify this in scientific notation (i.e. 10e-6)"<<std::endl; 
         std::clog<<"format: Either PE, SE, or I for paired-end, single-end, and interleaved paired reads"<<std::endl; 
-        std::clog<<"input: path to input data file (.fastq or .fasta extension). For PE format, specify two files."<<std::endl; 
-        std::clog<<"output: path to output sample file (same extension as input). For PE format, specify two files."<<std::endl; 
+        std::clog<<"input: path to input data file (.fastq or .fasta extension, optionally gzip or BGZF compressed with a .gz extension), or - for standard input. For PE format, specify two files."<<std::endl; 
+        std::clog<<"output: path to output sample file (same extension as input), or - for standard output. Outputs ending in .gz are BGZF compressed. For PE format, specify two files."<<std::endl; 
         
         std::clog<<"Optional arguments: "<<std::endl; 
         std::clog<<"[--range race_range]: (Optional, default 10000) Hash range for each ACE (B)"<<std::endl;
         std::clog<<"[--reps race_reps]: (Optional, default 10) Number of ACE repetitions (R)"<<std::endl;
         std::clog<<"[--hashes n_minhashes]: (Optional, default 1) Number of MinHashes for each ACE (n)"<<std::endl;
         std::clog<<"[--k kmer_size]: (Optional, default 16) Size of each MinHash k-mer (k)"<<std::endl;
+        std::clog<<"[--minhash engine]: (Optional, default rolling) MinHash engine: rolling (2-bit rolling k-mers), oph (one-pass one permutation hashing) or murmur (reproduces the MurmurHash output of earlier versions)"<<std::endl;
+        std::clog<<"[--simd level]: (Optional, default: best supported by the CPU) Kernel instruction set, either scalar, avx2 or avx512. Every level gives identical samples."<<std::endl;
+        std::clog<<"[--threads num_threads]: (Optional, default 1) Number of hashing threads. The sample does not depend on the number of threads."<<std::endl;
+        std::clog<<"[--split-length bases]: (Optional, default 20000) With --threads above 1, reads of at least this many bases are split into pieces that are hashed by several threads. 0 turns splitting off. The sample does not change."<<std::endl;
+        std::clog<<"[--dup-cache megabytes]: (Optional, default 0 = off) Memory for a cache of the hashes of recent reads, so that exact duplicate reads are not hashed again. The sample does not change."<<std::endl;
+        std::clog<<"[--relaxed]: (Optional) Let the threads update a shared lock-free sketch in any order. Faster with many threads, but the sample depends on the thread interleaving."<<std::endl;
+        std::clog<<"[--sharded merge_interval]: (Optional) Let each thread sample against the shared sketch plus its own private sketch, which is merged into the shared one every merge_interval reads. Scales without atomics; smaller intervals give a sample closer to the serial one."<<std::endl;
+        std::clog<<"[--window n_reads]: (Optional) Only count the last n_reads reads (roughly, see --epochs) in the KDE, so that the sampler keeps up with unbounded streams. Memory and time per read do not grow with the stream."<<std::endl;
+        std::clog<<"[--epochs n]: (Optional, default 8) With --window, the window expires in n steps of n_reads/n reads; it counts between n_reads - n_reads/n and n_reads reads."<<std::endl;
+        std::clog<<"[--counters bits]: (Optional, default: smallest width that holds reps*tau) Width of the RACE counters, either 8, 16 or 32. Narrow counters saturate; widths below reps*tau may change the sample. Not with --relaxed, which always uses 32-bit counters."<<std::endl;
+        std::clog<<"[--blocked]: (Optional) Use the cache-line-blocked sketch layout, which touches one cache line for a group of reps instead of one per rep. Faster with large sketches, but it is a different estimator: the reps of a group share one block, so they are not independent, the KDE is higher and tau must be retuned (it keeps up to several times as many reads at the same tau)."<<std::endl;
+        std::clog<<"[--huge-pages none|thp|explicit]: (Optional, default none) Back the sketch counters with 2 MB pages, either transparent huge pages (thp) or pages from the hugetlbfs pool (explicit, falling back to thp when the pool is empty). Fewer TLB misses with large sketches; the sample does not change."<<std::endl;
+        std::clog<<"[--numa none|interleave|local]: (Optional, default none) NUMA placement of the sketch counters: interleave spreads them over all nodes, local puts each page on the node of the thread that first touches it (e.g. the private sketches of --sharded). The sample does not change."<<std::endl;
+        std::clog<<"[--load-sketch path]: (Optional) Start from a sketch saved by --save-sketch (e.g. of every read sampled so far), so only reads unlike those are kept. Its layout and counter width are used instead of --blocked and --counters; its counters must be at least as wide as this run needs (see --counters)."<<std::endl;
+        std::clog<<"[--save-sketch path]: (Optional) Save the sketch at the end of the run, for a later --load-sketch."<<std::endl;
+        std::clog<<"[--checkpoint path]: (Optional) Periodically save the sketch and the position in the input and output files to path."<<std::endl;
+        std::clog<<"[--checkpoint-every n_reads]: (Optional, default 10000000) Number of reads between checkpoints."<<std::endl;
+        std::clog<<"[--resume]: (Optional) Continue an interrupted run from its --checkpoint file. All other arguments must be the same as in the interrupted run."<<std::endl;
+        std::clog<<"[--format fastq|fasta]: (Optional) File type of the input and output, instead of the one given by the input file extension. Required when the input is -."<<std::endl;
+        std::clog<<"[--stats path]: (Optional) Write a JSON report to path: reads, keep rate, time per stage (parsing, MinHash, rehash, sketch, output), throughput and a histogram of the KDE values."<<std::endl;
+        std::clog<<"[--progress seconds]: (Optional) Print the number of reads processed and kept so far every few seconds."<<std::endl;
+        std::clog<<"[--perf]: (Optional) Add hardware counters (cycles, instructions, cache and data TLB misses per read) to the --stats report. Needs perf_event_open permission."<<std::endl;
+        std::clog<<"[--scores path]: (Optional) Write the KDE score of every read to path, so that racefilter can take the sample of any other tau (or sample size) without hashing the reads again. Uses 32-bit counters."<<std::endl;
+        std::clog<<"[--byte-ranges]: (Optional) Record kept reads as byte ranges of the input and copy them to the output in the kernel after the pass. Requires regular input files."<<std::endl;
 
         std::clog<<std::endl<<"Example usage:"<<std::endl; 
         std::clog<<"samplerace 15.0 PE data/input-1.fastq data/input-2.fastq data/output-1.fastq data/output-2.fastq --range 100 --reps 50 --hashes 3 --k 5"<<std::endl; 
         std::clog<<"samplerace 10e-6 SE data/input.fastq data/output.fastq --range 100 --reps 5 --hashes 1 --k 33"<<std::endl; 
         std::clog<<"samplerace 0.1 SE data/input.fasta data/output.fasta --range 100000 --k 20"<<std::endl; 
+        std::clog<<"basecaller ... | samplerace 1.0 SE - - --format fastq | gzip > sample.fastq.gz"<<std::endl; 
         return -1; 
     }
 
@@ -77,46 +117,92 @@ int main(int argc, char **argv){
         return -1;
     }
 
-    // open the correct file streams given the format
-    std::ifstream datastream1;
-    std::ofstream samplestream1;
-    std::ifstream datastream2;
-    std::ofstream samplestream2;
-
-    if (format != 3){
-        datastream1.open(argv[3]);
-        samplestream1.open(argv[4]);
-    } else {
-        datastream1.open(argv[3]);
-        datastream2.open(argv[4]);
-        samplestream1.open(argv[5]);
-        samplestream2.open(argv[6]);
+    // --format gives the file type explicitly (needed for standard input, "-"); 
+    // otherwise it is determined from the file extension 
+    std::string file_extension = "";
+    for (int i = 0; i < argc; ++i){
+        if (std::strcmp("--format",argv[i]) == 0){
+            if ((i+1) < argc && (std::strcmp("fastq",argv[i+1]) == 0 || std::strcmp("fasta",argv[i+1]) == 0)){
+                file_extension = argv[i+1];
+            } else {
+                std::cerr<<"Invalid argument for optional parameter --format, please specify either fastq or fasta"<<std::endl; 
+                return -1;
+            }
+        }
+    }
+    if (file_extension.empty() && std::strcmp("-",argv[3]) == 0){
+        std::cerr<<"Reading from standard input requires --format fastq or --format fasta"<<std::endl; 
+        return -1; 
     }
 
-    // determine file extension
+    // determine file extension (ignoring the extension of compressed files)
     std::string filename(argv[3]); 
-    std::string file_extension = "";
-    size_t idx = filename.rfind('.',filename.length()); 
-    if (file_extension == "fq"){
-        file_extension = "fastq"; 
+    for (const char* suffix : {".gz", ".bgz"}){
+        size_t length = std::strlen(suffix); 
+        if (filename.length() > length && filename.compare(filename.length() - length, length, suffix) == 0){
+            filename.erase(filename.length() - length); 
+        }
     }
-    if (idx != std::string::npos){
+    size_t idx = filename.rfind('.',filename.length()); 
+    if (!file_extension.empty()){
+        // given by --format
+    } else if (idx != std::string::npos){
         file_extension = filename.substr(idx+1, filename.length() - idx); 
     } else {
         std::cerr<<"Input file does not appear to have any file extension."<<std::endl; 
         return -1; 
     }
+    if (file_extension == "fq"){
+        file_extension = "fastq"; 
+    }
+    if (file_extension == "fa"){
+        file_extension = "fasta"; 
+    }
     if (file_extension != "fasta" && file_extension != "fastq"){
         std::cerr<<"Unknown file extension: "<<file_extension<<std::endl; 
-        std::cerr<<"Please specify either a file with the .fasta or .fastq extension."<<std::endl; 
+        std::cerr<<"Please specify either a file with the .fasta or .fastq extension (optionally followed by .gz)."<<std::endl; 
         return -1; 
     }
 
+    // open the correct file streams given the format
+    SequenceReader datastream1;
+    SampleWriter* samplestream1 = NULL;
+    SequenceReader datastream2;
+    SampleWriter* samplestream2 = NULL;
+
+    std::string input1 = argv[3]; 
+    std::string input2 = (format == 3) ? argv[4] : ""; 
+    std::string output1 = (format == 3) ? argv[5] : argv[4]; 
+    std::string output2 = (format == 3) ? argv[6] : ""; 
+
     // OPTIONAL ARGUMENTS
     int race_range = 10000;
     int race_repetitions = 10;
     int hash_power = 1;
     int kmer_k = 16;
+    MinHashEngine minhash_engine = MINHASH_ROLLING;
+    SimdLevel simd_level = DetectSimdLevel();
+    bool byte_ranges = false;
+    int num_threads = 1;
+    long split_length = 20000; // 0 = never split reads
+    long dup_cache_mb = 0; // 0 = no duplicate cache
+    bool relaxed = false;
+    long merge_interval = 0; // 0 = not sharded
+    long window_reads = 0; // 0 = no window
+    long window_epochs = 8; 
+    bool blocked = false;
+    HugePages huge_pages = HUGE_PAGES_NONE;
+    NumaPolicy numa = NUMA_DEFAULT;
+    int counter_bits = 0; // 0 = choose from reps and tau
+    std::string load_sketch; 
+    std::string save_sketch; 
+    std::string checkpoint_path; 
+    long checkpoint_every = 10000000; 
+    bool resume = false; 
+    std::string stats_path; 
+    std::string scores_path; 
+    double progress_seconds = 0; // 0 = no progress lines
+    bool perf = false; 
 
     for (int i = 0; i < argc; ++i){
         if (std::strcmp("--range",argv[i]) == 0){
@@ -151,6 +237,163 @@ int main(int argc, char **argv){
                 return -1;
             }
         }
+        if (std::strcmp("--minhash",argv[i]) == 0){
+            if ((i+1) >= argc || !ParseMinHashEngine(argv[i+1], minhash_engine)){
+                std::cerr<<"Invalid argument for optional parameter --minhash"<<std::endl; 
+                return -1;
+            }
+        }
+        if (std::strcmp("--threads",argv[i]) == 0){
+            if ((i+1) < argc){
+                num_threads = std::stoi(argv[i+1]);
+            } else {
+                std::cerr<<"Invalid argument for optional parameter --threads"<<std::endl; 
+                return -1;
+            }
+        }
+        if (std::strcmp("--split-length",argv[i]) == 0){
+            if ((i+1) < argc){
+                split_length = std::stol(argv[i+1]);
+            } else {
+                std::cerr<<"Invalid argument for optional parameter --split-length"<<std::endl; 
+                return -1;
+            }
+            if (split_length < 0){ std::cerr<<"Invalid value for optional parameter --split-length"<<std::endl; return -1; }
+        }
+        if (std::strcmp("--dup-cache",argv[i]) == 0){
+            if ((i+1) < argc){
+                dup_cache_mb = std::stol(argv[i+1]);
+            } else {
+                std::cerr<<"Invalid argument for optional parameter --dup-cache"<<std::endl; 
+                return -1;
+            }
+            if (dup_cache_mb < 0){ std::cerr<<"Invalid value for optional parameter --dup-cache"<<std::endl; return -1; }
+        }
+        if (std::strcmp("--counters",argv[i]) == 0){
+            if ((i+1) < argc){
+                counter_bits = std::stoi(argv[i+1]);
+            } else {
+                std::cerr<<"Invalid argument for optional parameter --counters"<<std::endl; 
+                return -1;
+            }
+        }
+        if (std::strcmp("--relaxed",argv[i]) == 0){
+            relaxed = true;
+        }
+        if (std::strcmp("--sharded",argv[i]) == 0){
+            if ((i+1) < argc){
+                merge_interval = std::stol(argv[i+1]);
+            } else {
+                std::cerr<<"Invalid argument for optional parameter --sharded"<<std::endl; 
+                return -1;
+            }
+            if (merge_interval <= 0){ std::cerr<<"Invalid value for optional parameter --sharded"<<std::endl; return -1; }
+        }
+        if (std::strcmp("--window",argv[i]) == 0){
+            if ((i+1) < argc){
+                window_reads = std::stol(argv[i+1]);
+            } else {
+                std::cerr<<"Invalid argument for optional parameter --window"<<std::endl; 
+                return -1;
+            }
+            if (window_reads <= 0){ std::cerr<<"Invalid value for optional parameter --window"<<std::endl; return -1; }
+        }
+        if (std::strcmp("--epochs",argv[i]) == 0){
+            if ((i+1) < argc){
+                window_epochs = std::stol(argv[i+1]);
+            } else {
+                std::cerr<<"Invalid argument for optional parameter --epochs"<<std::endl; 
+                return -1;
+            }
+            if (window_epochs <= 0){ std::cerr<<"Invalid value for optional parameter --epochs"<<std::endl; return -1; }
+        }
+        if (std::strcmp("--blocked",argv[i]) == 0){
+            blocked = true;
+        }
+        if (std::strcmp("--huge-pages",argv[i]) == 0){
+            if ((i+1) >= argc || !ParseHugePages(argv[i+1], huge_pages)){
+                std::cerr<<"Invalid argument for optional parameter --huge-pages"<<std::endl; 
+                return -1;
+            }
+        }
+        if (std::strcmp("--numa",argv[i]) == 0){
+            if ((i+1) >= argc || !ParseNumaPolicy(argv[i+1], numa)){
+                std::cerr<<"Invalid argument for optional parameter --numa"<<std::endl; 
+                return -1;
+            }
+        }
+        if (std::strcmp("--load-sketch",argv[i]) == 0){
+            if ((i+1) < argc){
+                load_sketch = argv[i+1];
+            } else {
+                std::cerr<<"Invalid argument for optional parameter --load-sketch"<<std::endl; 
+                return -1;
+            }
+        }
+        if (std::strcmp("--save-sketch",argv[i]) == 0){
+            if ((i+1) < argc){
+                save_sketch = argv[i+1];
+            } else {
+                std::cerr<<"Invalid argument for optional parameter --save-sketch"<<std::endl; 
+                return -1;
+            }
+        }
+        if (std::strcmp("--checkpoint",argv[i]) == 0){
+            if ((i+1) < argc){
+                checkpoint_path = argv[i+1];
+            } else {
+                std::cerr<<"Invalid argument for optional parameter --checkpoint"<<std::endl; 
+                return -1;
+            }
+        }
+        if (std::strcmp("--checkpoint-every",argv[i]) == 0){
+            if ((i+1) < argc){
+                checkpoint_every = std::stol(argv[i+1]);
+            } else {
+                std::cerr<<"Invalid argument for optional parameter --checkpoint-every"<<std::endl; 
+                return -1;
+            }
+        }
+        if (std::strcmp("--resume",argv[i]) == 0){
+            resume = true;
+        }
+        if (std::strcmp("--scores",argv[i]) == 0){
+            if ((i+1) < argc){
+                scores_path = argv[i+1];
+            } else {
+                std::cerr<<"Invalid argument for optional parameter --scores"<<std::endl; 
+                return -1;
+            }
+        }
+        if (std::strcmp("--stats",argv[i]) == 0){
+            if ((i+1) < argc){
+                stats_path = argv[i+1];
+            } else {
+                std::cerr<<"Invalid argument for optional parameter --stats"<<std::endl; 
+                return -1;
+            }
+        }
+        if (std::strcmp("--progress",argv[i]) == 0){
+            if ((i+1) < argc){
+                progress_seconds = std::stod(argv[i+1]);
+            } else {
+                std::cerr<<"Invalid argument for optional parameter --progress"<<std::endl; 
+                return -1;
+            }
+            if (progress_seconds <= 0){ std::cerr<<"Invalid value for optional parameter --progress"<<std::endl; return -1; }
+        }
+        if (std::strcmp("--perf",argv[i]) == 0){
+            perf = true;
+        }
+        if (std::strcmp("--byte-ranges",argv[i]) == 0){
+            byte_ranges = true;
+        }
+        if (std::strcmp("--simd",argv[i]) == 0){
+            if ((i+1) >= argc || !ParseSimdLevel(argv[i+1], simd_level)){
+                std::cerr<<"Invalid argument for optional parameter --simd"<<std::endl; 
+                return -1;
+            }
+        }
     }
 
     // Check if arguments are valid
@@ -159,67 +402,383 @@ int main(int argc, char **argv){
     if (race_repetitions <= 0){ std::cerr<<"Invalid value for optional parameter --reps"<<std::endl; return -1; }
     if (hash_power <= 0){ std::cerr<<"Invalid value for optional parameter --hashes"<<std::endl; return -1; }
     if (kmer_k <= 0){ std::cerr<<"Invalid value for optional parameter --k"<<std::endl; return -1; }
+    if (counter_bits != 0 && counter_bits != 8 && counter_bits != 16 && counter_bits != 32){ std::cerr<<"Invalid value for optional parameter --counters"<<std::endl; return -1; }
+    if (num_threads <= 0){ std::cerr<<"Invalid value for optional parameter --threads"<<std::endl; return -1; }
+    if (blocked && relaxed){ std::cerr<<"--blocked cannot be combined with --relaxed"<<std::endl; return -1; }
+    // (the concurrent sketch of --relaxed always has 32-bit counters) 
+    if (counter_bits != 0 && relaxed){ std::cerr<<"--counters cannot be combined with --relaxed"<<std::endl; return -1; }
+    if (merge_interval > 0 && relaxed){ std::cerr<<"--sharded cannot be combined with --relaxed"<<std::endl; return -1; }
+    // the epochs of a window live outside the sketch, so they can be neither loaded nor checkpointed 
+    if (window_reads > 0 && (relaxed || merge_interval > 0 || !load_sketch.empty() || !checkpoint_path.empty())){ std::cerr<<"--window cannot be combined with --relaxed, --sharded, --load-sketch or --checkpoint"<<std::endl; return -1; }
+    if (window_epochs > window_reads && window_reads > 0){ std::cerr<<"--epochs cannot be larger than --window"<<std::endl; return -1; }
+    if (checkpoint_every <= 0){ std::cerr<<"Invalid value for optional parameter --checkpoint-every"<<std::endl; return -1; }
+    if (resume && checkpoint_path.empty()){ std::cerr<<"--resume requires --checkpoint"<<std::endl; return -1; }
+    if (relaxed && (!load_sketch.empty() || !save_sketch.empty())){ std::cerr<<"--load-sketch and --save-sketch cannot be combined with --relaxed"<<std::endl; return -1; }
+    // a checkpoint must hold the sketch of exactly the reads before its input offset, 
+    // which only the ordered modes have (and --byte-ranges writes nothing until the end) 
+    if (!checkpoint_path.empty() && (relaxed || merge_interval > 0 || byte_ranges)){ std::cerr<<"--checkpoint cannot be combined with --relaxed, --sharded or --byte-ranges"<<std::endl; return -1; }
+    if (format == 3 && input1 == "-" && input2 == "-"){ std::cerr<<"Only one of the paired-end inputs can be standard input"<<std::endl; return -1; }
+    if (format == 3 && output1 == "-" && output2 == "-"){ std::cerr<<"Only one of the paired-end outputs can be standard output"<<std::endl; return -1; }
+    if (byte_ranges && (output1 == "-" || output2 == "-")){ std::cerr<<"--byte-ranges cannot write to standard output"<<std::endl; return -1; }
+    if (!checkpoint_path.empty() && (output1 == "-" || output2 == "-")){ std::cerr<<"--checkpoint cannot be combined with standard output"<<std::endl; return -1; }
+    // the scores must not be capped by counters sized for this tau, or racefilter would not 
+    // reproduce the sample of a larger one 
+    if (!scores_path.empty() && counter_bits != 0 && counter_bits != 32){ std::cerr<<"--scores needs 32-bit counters, so it cannot be combined with --counters "<<counter_bits<<std::endl; return -1; }
+    if (perf && stats_path.empty()){ std::cerr<<"--perf requires --stats"<<std::endl; return -1; }
+    if (!SetSimdLevel(simd_level)){ std::cerr<<"This CPU does not support --simd "<<SimdLevelName(simd_level)<<std::endl; return -1; }
+
+    // before any sketch is created (including the one of a resumed checkpoint); the 
+    // allocator lives until the end of the process, after every sketch 
+    if (huge_pages != HUGE_PAGES_NONE || numa != NUMA_DEFAULT){
+        SetSketchAllocator(new PageAllocator(huge_pages, numa)); 
+    }
+
+    // the sampling parameters of this run, which a resumed run must repeat 
+    std::ostringstream parameters; 
+    parameters<<std::setprecision(17)<<"tau="<<tau<<" format="<<argv[2]<<" input="<<input1<<","<<input2
+        <<" output="<<output1<<","<<output2<<" range="<<race_range<<" reps="<<race_repetitions
+        <<" hashes="<<hash_power<<" k="<<kmer_k<<" minhash="<<(int)minhash_engine
+        <<" counters="<<counter_bits<<" blocked="<<blocked<<" load-sketch="<<load_sketch; 
+    if (!scores_path.empty()) parameters<<" scores="<<scores_path; 
+    Checkpoint progress; 
+    progress.parameters = parameters.str(); 
+    Sketch* resumed_sketch = NULL; 
+    if (resume){
+        Checkpoint saved; 
+        resumed_sketch = LoadCheckpoint(checkpoint_path, saved); 
+        if (resumed_sketch == NULL) return -1; 
+        if (saved.parameters != progress.parameters){
+            std::cerr<<"Cannot resume: the checkpoint was written by a run with different arguments ("<<saved.parameters<<")"<<std::endl; 
+            return -1; 
+        }
+        progress = saved; 
+        std::clog<<"Resuming after "<<progress.reads<<" reads ("<<progress.kept<<" kept)"<<std::endl; 
+    }
+
+    // Without --stats and --progress, nothing is counted or timed. Otherwise, the stages 
+    // are timed once per batch, on each thread separately. 
+    SamplingStats* stats = NULL; 
+    if (!stats_path.empty() || progress_seconds > 0){
+        stats = new SamplingStats(race_repetitions, num_threads); 
+        // before any thread is started, so that the counters include every thread 
+        if (perf) stats->perf.start(); 
+    }
+    bool timing = !stats_path.empty(); 
+    StageTimes reader_times; 
+    StageTimes commit_times; 
+    std::vector<StageTimes> worker_times(num_threads); 
+    uint64_t progress_ns = (uint64_t)(progress_seconds * 1e9); 
+    uint64_t next_progress = stats ? stats->start_ns + progress_ns : 0; 
 
     // done parsing information. Begin RACE algorithm: 
 
-    // buffer for sequences and fasta/fastq chunks
-    std::string sequence;
-    std::string chunk1;
-    std::string chunk2;
-
-    // set up the hash function that will be used to hash input sequences
-    SequenceMinHash hash = SequenceMinHash(race_repetitions*hash_power);
-    int* raw_hashes = new int[race_repetitions*hash_power]; 
-    int* rehashes = new int[race_repetitions];
-
-    RACE sketch = RACE(race_repetitions,race_range); 
-
-    do{
-        bool success = false; 
-        int c = datastream1.peek(); 
-        if (c == EOF) {
-            if (datastream1.eof()){
-                continue; 
-            }
-        }
-
-        switch(format){
-            case 1: // 1 = unpaired
-            success = SequenceFeaturesSE(datastream1, sequence, chunk1, file_extension);
-            break; 
-            case 2: // 2 = interleaved
-            success = SequenceFeaturesI(datastream1, sequence, chunk1, file_extension); 
-            break; 
-            case 3: // 3 = paired
-            success = SequenceFeaturesPE(datastream1, datastream2, sequence, chunk1, chunk2, file_extension);
-            break; 
-        }
-        if (!success) continue;
-
-        hash.getHash(kmer_k, sequence, raw_hashes); 
-        // now that we have the sequence and label
-        // feed the sequence into the RACE structure
-        // first rehash so that the arrays can fit into RACE
-        rehash(raw_hashes, rehashes, race_repetitions, hash_power);
-        // then simultaneously query and add 
-        double KDE = sketch.query_and_add(rehashes); 
-        // note: KDE is on a scale from [0,N] not the normalized interval [0,1]
-        if (KDE < tau){
-            // then keep this sample
-            
-            switch(format){
-                case 1: // 1 = unpaired
-                samplestream1 << chunk1; 
-                break; 
-                case 2: // 2 = interleaved
-                samplestream1 << chunk1; 
-                break; 
-                case 3: // 3 = paired
-                samplestream1 << chunk1; 
-                samplestream2 << chunk2; 
-                break; 
-            }
-        }
-    }
-    while(datastream1);
+    if (!datastream1.open(input1, file_extension, num_threads)) return -1; 
+    if (format == 3 && !datastream2.open(input2, file_extension, num_threads)) return -1; 
+    if (resume && (!datastream1.skip(progress.input1) || (format == 3 && !datastream2.skip(progress.input2)))){
+        std::cerr<<"Cannot resume: the input is shorter than at the checkpoint"<<std::endl; 
+        return -1; 
+    }
+
+    // In byte-range mode, kept reads are recorded as ranges of the input files and 
+    // copied to the output by the kernel after the pass. This needs mapped inputs, 
+    // since the offsets of streamed inputs cannot be copied from later. 
+    ByteRangeList ranges1; 
+    ByteRangeList ranges2; 
+    if (byte_ranges){
+        if (!datastream1.mapped() || (format == 3 && !datastream2.mapped())){
+            std::cerr<<"--byte-ranges requires regular (seekable, non-empty, uncompressed) input files"<<std::endl; 
+            return -1; 
+        }
+        if (IsCompressedOutput(output1) || (format == 3 && IsCompressedOutput(output2))){
+            std::cerr<<"--byte-ranges cannot write compressed output files"<<std::endl; 
+            return -1; 
+        }
+    } else {
+        // outputs ending in .gz are compressed to BGZF by --threads threads
+        // (a resumed run drops whatever was written after the checkpoint and appends) 
+        samplestream1 = OpenSampleWriter(output1, num_threads, resume ? (int64_t)progress.output1 : -1);
+        if (samplestream1 == NULL) return -1; 
+        if (format == 3){
+            samplestream2 = OpenSampleWriter(output2, num_threads, resume ? (int64_t)progress.output2 : -1);
+            if (samplestream2 == NULL) return -1; 
+        }
+    }
+
+    // the KDE of every read, in input order, for racefilter 
+    ScoreWriter scores; 
+    if (!scores_path.empty() && !scores.open(scores_path, race_repetitions, resume ? (int64_t)progress.scores : -1)) return -1; 
+
+    // interleaved pairs are read as one chunk of two records
+    int records_per_chunk = (format == 2) ? 2 : 1; 
+    bool synchronized = true; 
+
+    // set up the hash functions that will be used to hash input sequences
+    // (one per worker, since SequenceMinHash keeps scratch space)
+    std::vector<BatchHasher*> hashers; 
+    // long reads are split between the workers and num_threads - 1 helper threads, 
+    // so that a few long reads in flight still keep every thread busy 
+    TaskPool* hash_pool = (num_threads > 1 && split_length > 0) ? new TaskPool(num_threads - 1) : NULL; 
+    // exact duplicates reuse the rehashes of an earlier copy (one cache for all workers) 
+    DuplicateCache* dup_cache = dup_cache_mb ? new DuplicateCache((size_t)dup_cache_mb << 20, race_repetitions) : NULL; 
+    if (stats && dup_cache) stats->cache_entries = dup_cache->entries(); 
+    for (int t = 0; t < num_threads; t++){
+        hashers.push_back(new BatchHasher(race_repetitions, hash_power, kmer_k, minhash_engine)); 
+        hashers[t]->setPool(hash_pool, split_length); 
+        hashers[t]->setDuplicateCache(dup_cache); 
+    }
+
+    // the narrowest counters that give the same keep decisions, unless --counters says otherwise
+    // (with a window, counters are subtracted again, so they must hold a whole window, and 
+    // with --scores, the scores must be valid for every tau) 
+    if (counter_bits == 0 && !scores_path.empty()) counter_bits = 32; 
+    size_t epoch_reads = window_reads ? (window_reads + window_epochs - 1) / window_epochs : 0; 
+    if (window_reads > 0){
+        int window_bits = CounterBitsForReads((uint64_t)epoch_reads * window_epochs); 
+        if (window_bits == 0 || (counter_bits != 0 && counter_bits < window_bits)){
+            std::cerr<<"--window needs counters that hold "<<epoch_reads * window_epochs<<" reads"<<std::endl; 
+            return -1; 
+        }
+        if (counter_bits == 0) counter_bits = window_bits; 
+    }
+    if (counter_bits == 0) counter_bits = CounterBitsFor(race_repetitions, tau); 
+    // (in relaxed mode, the workers share one concurrent sketch instead) 
+    Sketch* sketch = NULL; 
+    if (resumed_sketch){
+        sketch = resumed_sketch; 
+    } else if (!load_sketch.empty()){
+        // mapped, so that only the counters the reads touch are read from disk 
+        sketch = LoadSketch(load_sketch, true); 
+        if (sketch == NULL) return -1; 
+    } else if (!relaxed){
+        sketch = blocked ? MakeBlockedRACE(race_repetitions, race_range, counter_bits) : MakeRACE(race_repetitions, race_range, counter_bits); 
+    }
+    if (sketch && (sketch->reps() != (size_t)race_repetitions || sketch->range() != (size_t)race_range)){
+        std::cerr<<"The sketch in "<<(resume ? checkpoint_path : load_sketch)<<" has --reps "<<sketch->reps()<<" and --range "<<sketch->range()<<", not the ones of this run"<<std::endl; 
+        return -1; 
+    }
+    if (sketch && sketch->hash_tag() != 0 && sketch->hash_tag() != hashers[0]->tag()){
+        std::cerr<<"The sketch in "<<(resume ? checkpoint_path : load_sketch)<<" was built with different --hashes, --k or --minhash"<<std::endl; 
+        return -1; 
+    }
+    // saturated counters lose counts, so a sketch from a file must be as wide as the 
+    // counters this run would create (widening it now could not restore lost counts) 
+    if (sketch && sketch->counter_bits() < counter_bits){
+        std::cerr<<"The sketch in "<<(resume ? checkpoint_path : load_sketch)<<" has "<<sketch->counter_bits()<<"-bit counters, but this run needs "
+            <<counter_bits<<"-bit counters"<<(scores_path.empty() ? "" : " for --scores")<<" (save the sketch with --counters "<<counter_bits<<" or more)"<<std::endl; 
+        return -1; 
+    }
+    if (sketch) sketch->set_hash_tag(hashers[0]->tag()); 
+    ConcurrentRACE* shared_sketch = relaxed ? new ConcurrentRACE(race_repetitions, race_range) : NULL; 
+    // in sharded mode, each worker adds its reads to a private delta of the sketch 
+    ShardedSketch* sharded_sketch = NULL; 
+    if (merge_interval > 0){
+        std::vector<Sketch*> deltas; 
+        for (int t = 0; t < num_threads; t++){
+            deltas.push_back(sketch->make_empty()); 
+        }
+        sharded_sketch = new ShardedSketch(sketch, deltas, race_repetitions, merge_interval); 
+    }
+    // with a window, the sketch only counts the reads of the last window_epochs epochs 
+    WindowedSketch* windowed_sketch = window_reads ? new WindowedSketch(sketch, race_repetitions, epoch_reads, window_epochs) : NULL; 
+
+    // Reads flow through three stages: the reader fills batches of consecutive reads, 
+    // a pool of workers hashes the batches, and the commit stage queries and updates 
+    // the sketch in input order. The sample is therefore the same for any --threads. 
+    Pipeline pipeline(num_threads, batch_reads); 
+
+    Pipeline::ReadStage read = [&](ReadBatch& batch){
+        // views of the current record(s) in the input buffers
+        SequenceRecord record1; 
+        SequenceRecord record2; 
+        size_t bases = 0; 
+        uint64_t start = timing ? StatsClock() : 0; 
+        // (time spent in the loop counts as parsing time, even on early returns) 
+        struct ParseTimer {
+            uint64_t start; StageTimes* times; 
+            ~ParseTimer(){ if (times) times->ns[STAGE_PARSE] += StatsClock() - start; }
+        } timer = {start, timing ? &reader_times : NULL}; 
+        while (batch.size < pipeline.batch_size() && bases < batch_bases){
+            if (!datastream1.next(record1, records_per_chunk)) return false; 
+            if (format == 3 && !datastream2.next(record2)){
+                std::cerr<<"Error reading second "<<file_extension<<" file: paired-end files are not synchronized"<<std::endl; 
+                synchronized = false; 
+                return false; 
+            }
+            // streamed inputs reuse their buffer, so their records are copied to the batch
+            batch.records1.push_back(datastream1.mapped() ? record1 : batch.copy(record1)); 
+            if (format == 3){
+                batch.records2.push_back(datastream2.mapped() ? record2 : batch.copy(record2)); 
+            }
+            bases += record1.sequence.length; 
+            batch.size++; 
+        }
+        return true; 
+    }; 
+
+    Pipeline::WorkStage work = [&](ReadBatch& batch, int worker){
+        // now that we have the sequences, 
+        // rehash their MinHashes so that the arrays can fit into RACE
+        StageTimes* times = timing ? &worker_times[worker] : NULL; 
+        hashers[worker]->hash(batch, times); 
+        uint64_t start = times ? StatsClock() : 0; 
+        if (relaxed){
+            // query and update the shared sketch right away, in whatever order the 
+            // workers get there; the commit stage only writes the kept reads 
+            batch.kde.resize(batch.size); 
+            shared_sketch->query_and_add(batch.rehashes.data(), batch.size, batch.kde.data()); 
+        } else if (sharded_sketch){
+            batch.kde.resize(batch.size); 
+            sharded_sketch->query_and_add(worker, batch.rehashes.data(), batch.size, batch.kde.data()); 
+        }
+        if (times && (relaxed || sharded_sketch)) times->ns[STAGE_SKETCH] += StatsClock() - start; 
+    }; 
+
+    // saves the sketch together with the position in the inputs and outputs 
+    auto save_checkpoint = [&](){
+        if (!samplestream1->sync(progress.output1)) return false; 
+        if (samplestream2 && !samplestream2->sync(progress.output2)) return false; 
+        if (!scores_path.empty() && !scores.sync(progress.scores)) return false; 
+        return SaveCheckpoint(checkpoint_path, progress, *sketch); 
+    }; 
+    uint64_t next_checkpoint = progress.reads + checkpoint_every; 
+
+    Pipeline::CommitStage commit = [&](ReadBatch& batch){
+        uint64_t start = timing ? StatsClock() : 0; 
+        if (!relaxed && !sharded_sketch){
+            // feed the batch into the RACE structure: simultaneously query and add, one 
+            // read after another (the batched call prefetches the counters of later reads) 
+            batch.kde.resize(batch.size); 
+            if (windowed_sketch){
+                windowed_sketch->query_and_add(batch.rehashes.data(), batch.size, batch.kde.data()); 
+            } else {
+                sketch->query_and_add(batch.rehashes.data(), batch.size, batch.kde.data()); 
+            }
+        }
+        uint64_t queried = timing ? StatsClock() : 0; 
+        if (!scores_path.empty()) scores.add(batch.kde.data(), batch.size); 
+        bool written = true; 
+        for (size_t i = 0; i < batch.size; i++){
+            const SequenceRecord& record1 = batch.records1[i]; 
+            double KDE = batch.kde[i]; 
+            // note: KDE is on a scale from [0,N] not the normalized interval [0,1]
+            if (KDE < tau){
+                // then keep this sample
+                // (for interleaved reads, chunk1 already holds both reads of the pair)
+                if (byte_ranges){
+                    ranges1.add(record1.offset, record1.chunk.length); 
+                    if (format == 3){
+                        ranges2.add(batch.records2[i].offset, batch.records2[i].chunk.length); 
+                    }
+                } else {
+                    written = WriteChunk(*samplestream1, record1.chunk) && written; 
+                    if (format == 3){
+                        written = WriteChunk(*samplestream2, batch.records2[i].chunk) && written; 
+                    }
+                }
+                progress.kept++; 
+            }
+        }
+        // stop at the first write error (close() reports it) 
+        if (!written) return false; 
+        if (stats){
+            uint64_t kept = 0; 
+            for (size_t i = 0; i < batch.size; i++){
+                stats->bases += batch.records1[i].sequence.length; 
+                stats->kde.add(batch.kde[i]); 
+                kept += (batch.kde[i] < tau); 
+            }
+            stats->reads += batch.size; 
+            stats->kept += kept; 
+            stats->duplicates += batch.duplicates; 
+            if (timing){
+                commit_times.ns[STAGE_SKETCH] += queried - start; 
+                commit_times.ns[STAGE_OUTPUT] += StatsClock() - queried; 
+            }
+            if (progress_ns && StatsClock() >= next_progress){
+                stats->progress(std::clog); 
+                next_progress += progress_ns; 
+            }
+        }
+        if (batch.size > 0){
+            progress.reads += batch.size; 
+            const SequenceRecord& last1 = batch.records1[batch.size - 1]; 
+            progress.input1 = last1.offset + last1.chunk.length; 
+            if (format == 3){
+                const SequenceRecord& last2 = batch.records2[batch.size - 1]; 
+                progress.input2 = last2.offset + last2.chunk.length; 
+            }
+        }
+        if (!checkpoint_path.empty() && progress.reads >= next_checkpoint){
+            next_checkpoint = progress.reads + checkpoint_every; 
+            return save_checkpoint(); 
+        }
+        return true; 
+    }; 
+
+    bool committed = pipeline.run(read, work, commit); 
+    if (stats){
+        // while the sketches are still allocated 
+        size_t sketch_bytes = 0, huge_page_bytes = 0; 
+        GetSketchAllocator().usage(sketch_bytes, huge_page_bytes); 
+        stats->allocator = GetSketchAllocator().name(); 
+        stats->sketch_bytes = sketch_bytes; 
+        stats->huge_page_bytes = huge_page_bytes; 
+    }
+    // a final checkpoint, so that resuming a finished run does not repeat any of it 
+    if (committed && !checkpoint_path.empty() && synchronized && !datastream1.failed() && !datastream2.failed()){
+        committed = save_checkpoint(); 
+    }
+    for (size_t t = 0; t < hashers.size(); t++){
+        delete hashers[t]; 
+    }
+    delete hash_pool; 
+    delete dup_cache; 
+    if (sharded_sketch){
+        sharded_sketch->merge(); 
+        delete sharded_sketch; 
+    }
+    if (committed && !save_sketch.empty() && !SaveSketch(save_sketch, *sketch)){
+        committed = false; 
+    }
+    delete shared_sketch; 
+    delete windowed_sketch; 
+    delete sketch; 
+
+    bool written = true; 
+    if (samplestream1 && !samplestream1->close()) written = false; 
+    if (samplestream2 && !samplestream2->close()) written = false; 
+    if (!scores.close()) written = false; 
+    delete samplestream1; 
+    delete samplestream2; 
+
+    if (!written || !committed || !synchronized || datastream1.failed() || datastream2.failed()){
+        return -1; 
+    }
+    SequenceRecord record2; 
+    if (format == 3 && datastream2.next(record2)){
+        std::cerr<<"Warning: second "<<file_extension<<" file has more reads than the first, the extra reads were ignored"<<std::endl; 
+    }
+
+    if (byte_ranges){
+        // finishing stage: copy the kept ranges straight from the inputs
+        uint64_t start = timing ? StatsClock() : 0; 
+        datastream1.close(); 
+        datastream2.close(); 
+        if (!CopyByteRanges(input1, output1, ranges1.ranges())) return -1; 
+        if (format == 3 && !CopyByteRanges(input2, output2, ranges2.ranges())) return -1; 
+        if (timing) commit_times.ns[STAGE_OUTPUT] += StatsClock() - start; 
+    }
+
+    if (stats){
+        stats->end_ns = StatsClock(); 
+        stats->perf.stop(); 
+        stats->faults.stop(); 
+        stats->times.add(reader_times); 
+        stats->times.add(commit_times); 
+        for (size_t t = 0; t < worker_times.size(); t++) stats->times.add(worker_times[t]); 
+        if (progress_ns) stats->progress(std::clog); 
+        bool saved = stats_path.empty() || SaveStats(stats_path, *stats); 
+        delete stats; 
+        if (!saved) return -1; 
+    }
 }
@@ -0,0 +1,69 @@
+#include "RACE.h"
+
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <iostream>
+#include <algorithm>
+
+/*
+Copyright 2019, Benjamin Coleman, All rights reserved.
+Free for research use. For commercial use, contact
+Rice University Invention & Patent or the author
+
+*/
+
+
+/*
+Checks that the batched query_and_add (which prefetches the counters of later reads)
+gives exactly the results of one query_and_add per read, and leaves the same counters,
+for both layouts, every counter width and power-of-two and other ranges. The hashes
+are skewed, so that 8-bit counters saturate. Run by "make test"; returns 0 on success.
+*/
+
+static bool Check(bool blocked, int bits, size_t range){
+    const size_t R = 10, nreads = 20000;
+    std::mt19937 rng(bits * 1000003 + range);
+    std::vector<int> hashes(nreads * R);
+    for (size_t i = 0; i < hashes.size(); i++){
+        // a few hot values per row, and the rest spread over the range
+        hashes[i] = (rng() % 4 == 0) ? (int)(rng() % 3) : (int)(rng() % (4 * range));
+    }
+
+    Sketch* serial = blocked ? MakeBlockedRACE(R, range, bits) : MakeRACE(R, range, bits);
+    Sketch* batched = blocked ? MakeBlockedRACE(R, range, bits) : MakeRACE(R, range, bits);
+    std::vector<double> expected(nreads), results(nreads);
+    for (size_t i = 0; i < nreads; i++)
+        expected[i] = serial->query_and_add(hashes.data() + i*R);
+    // batches of varying sizes, including 1 and ones larger than the prefetch distance
+    const size_t sizes[] = {1, 7, 1024, 3, 300};
+    for (size_t i = 0, b = 0; i < nreads; b++){
+        size_t n = std::min(sizes[b % 5], nreads - i);
+        batched->query_and_add(hashes.data() + i*R, n, results.data() + i);
+        i += n;
+    }
+
+    std::ostringstream a, b;
+    serial->serialize(a);
+    batched->serialize(b);
+    bool ok = (expected == results) && (a.str() == b.str());
+    if (!ok){
+        std::cerr<<"Batched query_and_add differs: layout "<<(blocked ? "blocked" : "rows")
+            <<", "<<bits<<"-bit counters, range "<<range<<std::endl;
+    }
+    delete serial;
+    delete batched;
+    return ok;
+}
+
+int main(){
+    bool ok = true;
+    for (int blocked = 0; blocked < 2; blocked++){
+        for (int bits = 8; bits <= 32; bits *= 2){
+            ok = Check(blocked, bits, 1000) && ok;
+            ok = Check(blocked, bits, 1024) && ok;
+        }
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,148 @@
+#!/bin/sh
+# Checks that the modes which promise the same sample as a plain serial run give it,
+# on a fixed synthetic input. Run by "make test" (after "make binaries").
+#
+# Usage: sh tests/equivalence.sh [bin_dir] [build_dir]
+
+BIN=${1:-bin}
+BUILD=${2:-build}
+SAMPLERACE=$BIN/samplerace
+WORK=$(mktemp -d "${TMPDIR:-/tmp}/racetest.XXXXXX") || exit 1
+trap 'rm -rf "$WORK"' EXIT
+failures=0
+
+# Simulated reads from 20 random genomes of 20 kb, the first genomes more abundant than
+# the last, with 1% substitutions. The generator is a Park-Miller LCG (exact in double
+# precision), so every awk on every platform writes the same files:
+#   r1.fastq, r2.fastq: 3000 pairs of 150 bp reads
+#   long.fastq: 30 reads of 2-8 kb, which --split-length 1000 splits between threads
+awk -v dir="$WORK" 'function rand01(){ seed = (seed * 16807) % 2147483647; return seed / 2147483647 }
+function base(){ return substr("ACGT", int(rand01() * 4) + 1, 1) }
+function genome(){ return int(20 * rand01() * rand01() * rand01()) + 1 }
+function read(g, start, len,    s, i){
+    s = substr(G[g], start, len)
+    for (i = int(len / 100); i > 0; i--){
+        p = int(rand01() * len) + 1
+        s = substr(s, 1, p - 1) base() substr(s, p + 1)
+    }
+    return s
+}
+function record(file, name, s,    q){
+    q = s; gsub(/./, "I", q)
+    print "@" name "\n" s "\n+\n" q > file
+}
+BEGIN {
+    seed = 20190101
+    for (g = 1; g <= 20; g++){
+        G[g] = ""
+        for (i = 0; i < 20000; i++) G[g] = G[g] base()
+    }
+    for (n = 0; n < 3000; n++){
+        g = genome(); start = int(rand01() * 19500) + 1
+        record(dir "/r1.fastq", "read" n "/1", read(g, start, 150))
+        record(dir "/r2.fastq", "read" n "/2", read(g, start + 300, 150))
+    }
+    for (n = 0; n < 30; n++){
+        g = genome(); len = int(2000 + rand01() * 6000)
+        record(dir "/long.fastq", "long" n, read(g, int(rand01() * (20000 - len)) + 1, len))
+    }
+}' || exit 1
+
+# same NAME COMMAND...: runs COMMAND, which writes $WORK/out*, and compares every output
+# with the one of the first run of the same name. The runs also write the KDE of every
+# read (--scores), so that hashes that change without flipping a decision are caught too.
+same(){
+    name=$1; shift
+    rm -f "$WORK"/out*
+    if ! "$@" > "$WORK/log" 2>&1; then
+        echo "FAIL $name: $* exited with an error"; cat "$WORK/log"; failures=$((failures + 1)); return
+    fi
+    for f in "$WORK"/out*; do
+        ref="$WORK/ref.$name.${f##*/}"
+        if [ ! -f "$ref" ]; then
+            cp "$f" "$ref"
+        elif ! cmp -s "$f" "$ref"; then
+            echo "FAIL $name: ${f##*/} of '$*' differs"; failures=$((failures + 1)); return
+        fi
+    done
+    echo "ok   $name: $(echo "$*" | sed "s|$WORK/||g")"
+}
+
+# matches NAME SUMS COMMAND...: runs COMMAND and checks the CRCs (cksum) of the reads it
+# writes, $WORK/out*.fastq in order, against SUMS.
+matches(){
+    name=$1; sums=$2; shift 2
+    rm -f "$WORK"/out*
+    if ! "$@" > "$WORK/log" 2>&1; then
+        echo "FAIL $name: $* exited with an error"; cat "$WORK/log"; failures=$((failures + 1)); return
+    fi
+    if [ "$(for f in "$WORK"/out*.fastq; do cksum < "$f" | cut -d ' ' -f 1; done | tr '\n' ' ')" != "$sums " ]; then
+        echo "FAIL $name: the reads of '$*' differ"; failures=$((failures + 1)); return
+    fi
+    echo "ok   $name: $(echo "$*" | sed "s|$WORK/||g")"
+}
+
+# resumed COMMAND...: runs COMMAND, which reads $WORK/in1.fastq (and in2.fastq), with a
+# checkpoint on the first half of the reads, as if it had been interrupted there after
+# writing more output, and then again with --resume on all of the reads.
+resumed(){
+    rm -f "$WORK/ck"
+    head -n 6000 "$WORK/r1.fastq" > "$WORK/in1.fastq"
+    head -n 6000 "$WORK/r2.fastq" > "$WORK/in2.fastq"
+    "$@" --checkpoint "$WORK/ck" --checkpoint-every 700 || return 1
+    for f in "$WORK"/out*; do echo "written after the checkpoint" >> "$f"; done
+    cp "$WORK/r1.fastq" "$WORK/in1.fastq"
+    cp "$WORK/r2.fastq" "$WORK/in2.fastq"
+    "$@" --checkpoint "$WORK/ck" --checkpoint-every 700 --resume
+}
+
+SE="$SAMPLERACE 1.0 SE $WORK/r1.fastq $WORK/out.fastq --scores $WORK/out.kde"
+PE="$SAMPLERACE 1.0 PE $WORK/r1.fastq $WORK/r2.fastq $WORK/out1.fastq $WORK/out2.fastq --scores $WORK/out.kde"
+LONG="$SAMPLERACE 1.0 SE $WORK/long.fastq $WORK/out.fastq --range 1000 --scores $WORK/out.kde"
+
+# the sample does not depend on the number of threads (or on splitting long reads)
+same threads-se $SE
+same threads-se $SE --threads 4
+same threads-pe $PE --hashes 3
+same threads-pe $PE --hashes 3 --threads 3
+same threads-long $LONG
+same threads-long $LONG --threads 4 --split-length 1000
+
+# the SIMD kernels give the same sample as the scalar ones (at the best level of this CPU)
+for engine in rolling oph murmur; do
+    for hashes in 1 3; do
+        same simd-$engine-$hashes $PE --minhash $engine --hashes $hashes --simd scalar
+        same simd-$engine-$hashes $PE --minhash $engine --hashes $hashes
+    done
+    same simd-$engine-long $LONG --minhash $engine --simd scalar
+    same simd-$engine-long $LONG --minhash $engine
+done
+
+# a run resumed from a checkpoint gives the sample of an uninterrupted run
+RESUME_SE="$SAMPLERACE 1.0 SE $WORK/in1.fastq $WORK/out.fastq --scores $WORK/out.kde"
+RESUME_PE="$SAMPLERACE 1.0 PE $WORK/in1.fastq $WORK/in2.fastq $WORK/out1.fastq $WORK/out2.fastq --scores $WORK/out.kde"
+same resume-se $SE
+same resume-se resumed $RESUME_SE
+same resume-pe $PE --hashes 3
+same resume-pe resumed $RESUME_PE --hashes 3
+same resume-pe resumed $RESUME_PE --hashes 3 --threads 3
+
+# --minhash murmur gives the sample of the versions before the rolling engine (the sums
+# are those of the original samplerace on the same reads)
+MURMUR_PE="$SAMPLERACE 1.0 PE $WORK/r1.fastq $WORK/r2.fastq $WORK/out1.fastq $WORK/out2.fastq --minhash murmur"
+matches murmur-pe-1 "1176765257 2017158473" $MURMUR_PE --hashes 1
+matches murmur-pe-3 "1108346982 859249779" $MURMUR_PE --hashes 3
+matches murmur-long 114188152 $SAMPLERACE 1.0 SE $WORK/long.fastq $WORK/out.fastq --range 1000 --minhash murmur
+
+# the batched (prefetching) query_and_add gives the same results as one call per read
+if "$BUILD/batchtest" > "$WORK/log" 2>&1; then
+    echo "ok   batched query_and_add"
+else
+    echo "FAIL batched query_and_add"; cat "$WORK/log"; failures=$((failures + 1))
+fi
+
+if [ $failures -ne 0 ]; then
+    echo "$failures test(s) failed"
+    exit 1
+fi
+echo "All tests passed"